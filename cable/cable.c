@@ -1,16 +1,26 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates pairs of virtual serial ports using "socat": for each of the -k
+// links, one for the Tx and one for each of its -n receivers, numLinks *
+// (numRx + 1) in all. Link 1's Tx opens /dev/ttyS10 and its receivers
+// /dev/ttyS11 onwards; link k's Tx opens /dev/ttyS<10k> and its receivers
+// the ports that follow. The cable holds the other end of every pair
+// (/dev/emulator*) and waits on all of them with a single epoll set.
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 // Modified by: Rui Prior [rcprior@fc.up.pt]
 
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
 #include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
@@ -23,37 +33,178 @@
 // included by <termios.h>
 #define BAUDRATE B9600         // For struct termios
 #define DEFAULT_BAUDRATE 9600  // For the delaying transmissions
+#define MIN_BAUDRATE 50
+#define MAX_BAUDRATE 4000000   // Any rate in between, as with termios2
 #define _POSIX_SOURCE 1        // POSIX compliant source
 #define FALSE 0
 #define TRUE 1
 
 #define BUF_SIZE 2048
+#define MAX_RX 8  // Receivers sharing the line (-n option)
+#define MAX_LINKS 8  // Independent links (-k option)
+#define TX2RX 0  // Directions, for impairments
+#define RX2TX 1
+#define DIRECTION_NAME(dir) ((dir) == TX2RX ? "Tx->Rx" : "Rx->Tx")
+#define QUANTUM_NSEC 1000000  // Bytes are moved in batches, once per quantum
+#define MAX_BATCH BUF_SIZE    // Byte slots moved by a single batch at most
+#define NEVER (LLONG_MAX / 2)   // Countdown of an impairment that is off
+
+// Binary capture: a header (CAPTURE_MAGIC, then the wall clock time it
+// started in nsec, 64 bit little endian) followed by a record per busy slot:
+// the slot time in nsec since the start (64 bit little endian), flags, the
+// byte entering the cable, the byte leaving it and the spurious byte
+#define CAPTURE_MAGIC "FTACAP1\n"
+#define CAPTURE_HEADER_SIZE 16
+#define CAPTURE_RECORD_SIZE 12
+#define CAPTURE_BUF_SIZE (1 << 20)
+#define CAP_RX2TX 0x01     // Else Tx->Rx
+#define CAP_IN 0x02        // A byte entered the cable
+#define CAP_OUT 0x04       // A byte was due to leave it
+#define CAP_CORRUPTED 0x08
+#define CAP_DROPPED 0x10   // The byte due was lost
+#define CAP_INSERTED 0x20  // A spurious byte followed
+
+// Framing of the link layer, for decoding captures
+#define FLAG 0x7E
+#define ESCAPE 0x7D
+#define SPECIAL_MASK 0x20
+#define MAX_FRAME_SIZE 16384
+#define LINKTYPE_USER0 147  // pcap link type of the frames exported
+
+// Impairments of one direction of the line. Bit errors follow a
+// Gilbert-Elliott model: a good and a bad (burst) state with their own BER,
+// and the probabilities of going from one to the other in each byte slot.
+struct Impairments {
+    double ber[2];         // Bit error rate in the good and in the bad state
+    double enterBurst;     // Probability of going from good to bad
+    double leaveBurst;     // Probability of going from bad to good
+    double dropRate;       // Probability of a byte being lost
+    double insertRate;     // Probability of a spurious byte in a slot
+};
+
+// An impairment process of a line. Rather than a random draw per bit, byte
+// or slot, the number of them before the next event is drawn (geometric
+// distribution). Every process has its own random stream, so that, e.g.,
+// the bytes corrupted don't depend on how many idle slots went by.
+struct Process {
+    uint64_t rng[4];  // xoshiro256** state
+    long long left;   // Bits, bytes or slots before the next event
+};
+
+// An impairment decision of a trace, for the byte'th byte a line carried:
+// dropping it or flipping bits of it, or inserting a spurious byte once
+// that many bytes went by
+struct Decision {
+    long long byte;
+    int drop;
+    char value;  // Bits flipped, or the spurious byte
+};
+
+// Decisions of a line being replayed, in order
+struct Trace {
+    struct Decision *decisions;
+    int count;
+    int next;
+};
+
+// Impairment state of a line (to a receiver, or back to the Tx)
+struct Line {
+    int inBurst;
+    struct Process bitError;  // Counts bits carried
+    struct Process drop;      // Counts bytes carried
+    struct Process insert;    // Counts slots
+    struct Process burst;     // Counts slots, until the state changes
+    long long carried;        // Bytes carried since the trace started
+    struct Trace errors;      // Drops and bit flips replayed
+    struct Trace inserts;     // Spurious bytes replayed
+};
+
+// Counters of one direction of the line. What leaves the cable is counted at
+// the first receiver, as the log shows it.
+struct Stats {
+    long long slots;      // Byte slots gone by
+    long long bytesIn;    // Bytes entering the cable (the others are idle slots)
+    long long bytesOut;   // Bytes carried to the far end, spurious ones included
+    long long corrupted;
+    long long dropped;
+    long long inserted;
+    long long frames;     // Frames entering, delimited by flags
+    long long frameLength;  // Of the frame being sent, -1 until a flag
+};
+
+// One direction of the line, with byte slots of its own. A byte entering
+// the cable is stored in a ring buffer at the slot it must leave in.
+struct Direction {
+    struct timespec byteDelay;
+    struct timespec nextSlotTime;
+    unsigned long propDelay;  // Desired propagation delay in usec
+    unsigned long jitter;     // Desired jitter in usec (maximum, or mean)
+    int jitterExp;            // Exponential jitter, else uniform
+    long propSlots;           // The same, in byte slots
+    long jitterSlots;
+    long maxJitterSlots;
+    struct Process jitterDraw;
+    int bufSize;  // Dimensioned to enforce the propagation delay and jitter
+    char *buf;
+    char *valid;  // TRUE if corresponding entry holds a byte
+    long long slot;     // Current slot
+    long long lastOut;  // Slot the last byte entered leaves in
+    struct Stats stats;
+    struct Stats lastStats;  // When the stats file was last written
+};
 
-// Current running parameters
+// Current running parameters of a link: a Tx port pair, fanned out to the
+// port pairs of its receivers
 struct Parameters {
     int cableOn;
-    double byteER;   // Byte error rate
-    struct timespec byteDelay;
-    unsigned long propDelay;   // Desired propagation delay in usec
-    int bufSize;  // Dimensioned to enforce the propagation delay
-    char *tx2rx;
-    char *tx2rxValid;  // TRUE if corresponding entry holds a byte
-    long tx2rxIdx;     // Input index for the tx2rx buffer
-    char *rx2tx;
-    char *rx2txValid;  // TRUE if corresponding entry holds a byte
-    long rx2txIdx;     // Input index for the tx2rx buffer
+    int fdTx;
+    int fdRx[MAX_RX];
+    struct Direction direction[2];  // TX2RX and RX2TX
+    struct Impairments impair[2];
+    struct Line tx2rxLine[MAX_RX];  // One per receiver
+    struct Line rx2txLine;
+    uint64_t seed;  // Of all random streams
     FILE *logfile;
+    int logIdle[2];    // The last slot logged of each direction was idle...
+    int logSeparator;  // ...and the separator was logged
+    FILE *trace;    // Recording impairment decisions
+    int replaying;  // Impairment decisions come from a trace, not at random
+    FILE *statsFile;
+    struct timespec statsPeriod;
+    struct timespec statsStart;
+    struct timespec nextStats;  // When the stats file is written next
+    FILE *capture;
+    unsigned char *captureBuf;  // Records not written yet
+    int captureLength;
+    long long captureStart;     // Monotonic time, nsec
+    int numRx;  // Rx ports the Tx is fanned out to
+};
+
+struct Parameters links[MAX_LINKS];
+int numLinks = 1;
+int commandLink = 0;  // The link commands apply to
+struct Parameters *par = &links[0];  // The link being handled
+
+// Timed command of a scenario (-s option)
+struct Event {
+    long long at;  // usec since the first byte entered the cable
+    int line;      // For sorting events with the same time in file order
+    char command[64];
+};
+
+struct Scenario {
+    struct Event *events;
+    int count;
+    int next;     // First event not run yet
+    int started;  // The clock starts with the first byte entering the cable
+    struct timespec start;
 };
 
-struct Parameters par = {
-    .cableOn = TRUE,
-    .byteER = 0.0,
-    .propDelay = 0,
-    .tx2rx = NULL,
-    .tx2rxValid = NULL,
-    .rx2tx = NULL,
-    .rx2txValid = NULL,
-    .logfile = NULL};
+struct Scenario scenario = {
+    .events = NULL,
+    .count = 0,
+    .next = 0,
+    .started = FALSE};
 
 // Returns: serial port file descriptor (fd).
 int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
@@ -90,45 +241,47 @@ void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
 }
 
 
-// Initialize the ring buffers that implement the propagation delay
+// Initialize the ring buffer of a direction, that implements the
+// propagation delay and jitter
 // Returns 0 on success, -1 on failure
-int init_ring_buffers(void)
+int init_ring_buffer(int dir)
 {
-    long nsecPropDelay = 1000 * par.propDelay;
-    long bytesInFlight = nsecPropDelay / par.byteDelay.tv_nsec;
-    // Round instead of truncating
-    if (nsecPropDelay % par.byteDelay.tv_nsec > par.byteDelay.tv_nsec / 2)
+    struct Direction *way = &par->direction[dir];
+    long byteNsec = way->byteDelay.tv_nsec;
+    // Rounded instead of truncated
+    way->propSlots = (1000 * way->propDelay + byteNsec / 2) / byteNsec;
+    way->jitterSlots = (1000 * way->jitter + byteNsec / 2) / byteNsec;
+    way->maxJitterSlots = way->jitterExp ? 10 * way->jitterSlots : way->jitterSlots;
+    way->bufSize = way->propSlots + way->maxJitterSlots + 1;
+    way->buf = realloc(way->buf, way->bufSize);
+    way->valid = realloc(way->valid, way->bufSize);
+    if (way->buf == NULL || way->valid == NULL)
     {
-        ++bytesInFlight;
+        return -1;
     }
-    long actualPropDelay = bytesInFlight * par.byteDelay.tv_nsec / 1000; // usec
-    par.bufSize = bytesInFlight + 1;
-    par.tx2rx = realloc(par.tx2rx, par.bufSize);
-    par.tx2rxValid = realloc(par.tx2rxValid, par.bufSize);
-    par.rx2tx = realloc(par.rx2tx, par.bufSize);
-    par.rx2txValid = realloc(par.rx2txValid, par.bufSize);
-    if (par.tx2rx == NULL || par.tx2rxValid == NULL || par.rx2tx == NULL || par.rx2txValid == NULL)
+    bzero(way->valid, way->bufSize);
+    way->slot = 0;
+    way->lastOut = -1;
+    printf("PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec) (%s)\n",
+           way->propSlots * byteNsec / 1000, way->propDelay, DIRECTION_NAME(dir));
+    if (way->jitter != 0)
     {
-        return -1;
+        printf("JITTER SET TO %ld usec %s (DESIRED = %lu usec) (%s)\n", way->jitterSlots * byteNsec / 1000,
+               way->jitterExp ? "ON AVERAGE, EXPONENTIAL" : "AT MOST, UNIFORM", way->jitter, DIRECTION_NAME(dir));
     }
-    bzero(par.tx2rxValid, par.bufSize);
-    bzero(par.rx2txValid, par.bufSize);
-    par.tx2rxIdx = 0;
-    par.rx2txIdx = 0;
-    printf("PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n", actualPropDelay, par.propDelay);
     return 0;
 }
 
 
-// Set the byte delay corresponding to the selected baud rate
-void set_baud_rate(unsigned long baud)
+// Set the byte delay of a direction corresponding to the selected baud rate
+void set_baud_rate(int dir, unsigned long baud)
 {
     // 10 bit times per byte; delay in nanoseconds
     double delay = 1.0e10 / baud;
-    par.byteDelay.tv_sec = 0;
-    par.byteDelay.tv_nsec = (long) delay;
-    printf("BAUD RATE: %lu\n", baud);
-    init_ring_buffers();
+    par->direction[dir].byteDelay.tv_sec = 0;
+    par->direction[dir].byteDelay.tv_nsec = (long) delay;
+    printf("BAUD RATE: %lu (%s)\n", baud, DIRECTION_NAME(dir));
+    init_ring_buffer(dir);
 }
 
 
@@ -154,6 +307,15 @@ struct timespec timespec_diff(const struct timespec *t2, const struct timespec *
 }
 
 
+// A time some nsec after t
+struct timespec timespec_after(const struct timespec *t, long long nsec)
+{
+    nsec += t->tv_nsec;
+    struct timespec after = { .tv_sec = t->tv_sec + nsec / 1000000000, .tv_nsec = nsec % 1000000000 };
+    return after;
+}
+
+
 // Compute the sum of two timespecs
 struct timespec timespec_sum(const struct timespec *t1, const struct timespec *t2)
 {
@@ -199,10 +361,10 @@ int timespec_is_negative(const struct timespec *t)
 
 void endlog(void)
 {
-    if (par.logfile != NULL)
+    if (par->logfile != NULL)
     {
-        fclose(par.logfile);
-        par.logfile = NULL;
+        fclose(par->logfile);
+        par->logfile = NULL;
     }
 }
 
@@ -210,10 +372,10 @@ void endlog(void)
 void startlog(const char *filename)
 {
     endlog();
-    par.logfile = fopen(filename, "w");
-    if (par.logfile != NULL)
+    par->logfile = fopen(filename, "w");
+    if (par->logfile != NULL)
     {
-        fprintf(par.logfile, "Tx->Rx | Rx->Tx\n");
+        fprintf(par->logfile, "Tx->Rx | Rx->Tx\n");
         printf("LOGGING TO FILE %s\n", filename);
     }
     else
@@ -223,334 +385,1918 @@ void startlog(const char *filename)
 }
 
 
-// Show help
-void help()
+void put_le64(unsigned char *to, uint64_t value)
 {
-    printf("\n\n"
-           "Transmitter must open " TXDEV "\n"
-           "Receiver must open " RXDEV "\n"
-           "\n"
-           "The cable program is sensible to the following interactive commands:\n"
-           "--- help         : show this help\n"
-           "--- on           : connect the cable and data is exchanged (default state)\n"
-           "--- off          : disconnect the cable disabling data to be exchanged\n"
-           "--- ber <ber>    : add noise to data bits at a specified BER (default=0)\n"
-           "--- baud <rate>  : set baud rate, between 1200 and 115200 (default=9600)\n"
-           "                   note that 10 bits are sent per byte (8-N-1)\n"
-           "--- prop <delay> : set the propagation delay in usec (0-1000000, default=0)\n"
-           "                   will be approximated to an integer multiple of the byte\n"
-           "                   delay (10 / baud_rate)\n"
-           "--- log <file>   : log transmitted data to file\n"
-           "--- endlog       : stop logging transmitted data\n"
-           "--- quit         : terminate the program\n"
-           "\n"
-           "IMPORTANT: Changing the baud rate or propagation delay while a transmission is\n"
-           "           ongoing will result in losses.\n"
-           "\n");
+    for (int i = 0; i < 8; i++)
+    {
+        to[i] = value >> (8 * i);
+    }
 }
 
-int main(int argc, char *argv[])
+
+uint64_t get_le64(const unsigned char *from)
 {
-    printf("\n");
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+        value = (value << 8) | from[i];
+    }
+    return value;
+}
 
-    system("socat -dd PTY,link=" TXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorTx,mode=777,raw,echo=0 &");
-    sleep(1);
-    printf("\n");
 
-    system("socat -dd PTY,link=" RXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorRx,mode=777,raw,echo=0 &");
-    sleep(1);
+long long timespec_nsec(const struct timespec *t)
+{
+    return t->tv_sec * 1000000000LL + t->tv_nsec;
+}
 
-    help();
 
-    // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
+void flush_capture(void)
+{
+    fwrite(par->captureBuf, 1, par->captureLength, par->capture);
+    par->captureLength = 0;
+}
 
-    int fdTx = openSerialPort("/dev/emulatorTx", &oldtioTx, &newtioTx);
 
-    if (fdTx < 0)
+void endcapture(void)
+{
+    if (par->capture != NULL)
     {
-        perror("Opening Tx emulator serial port");
-        exit(-1);
+        flush_capture();
+        fclose(par->capture);
+        par->capture = NULL;
     }
+}
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
 
-    int fdRx = openSerialPort("/dev/emulatorRx", &oldtioRx, &newtioRx);
+void startcapture(const char *filename)
+{
+    endcapture();
+    if (par->captureBuf == NULL)
+    {
+        par->captureBuf = malloc(CAPTURE_BUF_SIZE);
+    }
+    par->capture = par->captureBuf != NULL ? fopen(filename, "w") : NULL;
+    if (par->capture == NULL)
+    {
+        printf("ERROR OPENING FILE %s, NOT CAPTURING\n", filename);
+        return;
+    }
+    struct timespec now;
+    unsigned char header[CAPTURE_HEADER_SIZE];
+    memcpy(header, CAPTURE_MAGIC, 8);
+    clock_gettime(CLOCK_REALTIME, &now);
+    put_le64(header + 8, timespec_nsec(&now));
+    fwrite(header, 1, CAPTURE_HEADER_SIZE, par->capture);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    par->captureStart = timespec_nsec(&now);
+    par->captureLength = 0;
+    printf("CAPTURING TO FILE %s\n", filename);
+}
+
 
-    if (fdRx < 0)
+// Add the record of a busy slot to the capture; the file is only written
+// when the buffer is full, so capturing doesn't disturb the timing of slots
+void capture_slot(long long nsec, int flags, char in, char out, char extra)
+{
+    if (par->captureLength + CAPTURE_RECORD_SIZE > CAPTURE_BUF_SIZE)
     {
-        perror("Opening Rx emulator serial port");
-        exit(-1);
+        flush_capture();
     }
+    unsigned char *record = par->captureBuf + par->captureLength;
+    put_le64(record, nsec - par->captureStart);
+    record[8] = flags;
+    record[9] = in;
+    record[10] = out;
+    record[11] = extra;
+    par->captureLength += CAPTURE_RECORD_SIZE;
+}
 
-    // Configure stdin to receive commands to this program
-    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
 
-    char rxStdin[BUF_SIZE] = {0};
+void reset_stats(void)
+{
+    for (int dir = TX2RX; dir <= RX2TX; dir++)
+    {
+        struct Stats *stats = &par->direction[dir].stats;
+        memset(stats, 0, sizeof(*stats));
+        stats->frameLength = -1;
+        par->direction[dir].lastStats = *stats;
+    }
+}
 
-    int STOP = FALSE;
 
-    set_baud_rate(DEFAULT_BAUDRATE);
+double utilization(const struct Stats *now, const struct Stats *before)
+{
+    long long slots = now->slots - before->slots;
+    return slots > 0 ? 100.0 * (now->bytesIn - before->bytesIn) / slots : 0.0;
+}
+
 
-    set_rt_priority();
+void print_stats(void)
+{
+    if (numLinks > 1)
+    {
+        printf("LINK %d\n", (int) (par - links) + 1);
+    }
+    for (int dir = TX2RX; dir <= RX2TX; dir++)
+    {
+        struct Stats *stats = &par->direction[dir].stats;
+        struct Stats none = { .slots = 0, .bytesIn = 0 };
+        printf("%s: %lld BYTES IN, %lld OUT, %lld CORRUPTED, %lld DROPPED, %lld INSERTED\n"
+               "        %lld FRAMES, %lld IDLE SLOTS, %.1f%% UTILIZATION\n",
+               DIRECTION_NAME(dir), stats->bytesIn, stats->bytesOut, stats->corrupted, stats->dropped,
+               stats->inserted, stats->frames, stats->slots - stats->bytesIn, utilization(stats, &none));
+    }
+}
 
-    // For logging
-    char tx2rxTx[3], tx2rxRx[3], rx2txTx[3], rx2txRx[3];
-    int cableIdle = FALSE;
 
-    printf("\nCable ready\n\n");
+void endstatslog(void)
+{
+    if (par->statsFile != NULL)
+    {
+        fclose(par->statsFile);
+        par->statsFile = NULL;
+    }
+}
 
-    // To compensate for deviations in byte transmission time
-    struct timespec currentTime, nextTxTime, timeDiff, nextWait;
-    int skipWait = FALSE;
-    int unreliableRate = FALSE;
-    clock_gettime(CLOCK_MONOTONIC, &nextTxTime);
 
-    while (STOP == FALSE)
+void startstatslog(const char *filename, double period)
+{
+    endstatslog();
+    par->statsFile = fopen(filename, "w");
+    if (par->statsFile == NULL)
     {
-        // Check how much waiting time we should have (if any)
-        clock_gettime(CLOCK_MONOTONIC, &currentTime);
-        timeDiff = timespec_diff(&currentTime, &nextTxTime);
-        nextTxTime = timespec_sum(&nextTxTime, &par.byteDelay);
-        if (timeDiff.tv_sec >= 1)
+        printf("ERROR OPENING FILE %s, NOT WRITING STATS\n", filename);
+        return;
+    }
+    // The counters are cumulative, the utilization is that of the period
+    fprintf(par->statsFile, "# seconds");
+    for (int dir = TX2RX; dir <= RX2TX; dir++)
+    {
+        const char *name = dir == TX2RX ? "tx2rx" : "rx2tx";
+        fprintf(par->statsFile, " %s_in %s_out %s_corrupted %s_dropped %s_inserted %s_frames %s_idle %s_util",
+                name, name, name, name, name, name, name, name);
+    }
+    fprintf(par->statsFile, "\n");
+    par->statsPeriod.tv_sec = (time_t) period;
+    par->statsPeriod.tv_nsec = (long) ((period - (time_t) period) * 1e9);
+    clock_gettime(CLOCK_MONOTONIC, &par->statsStart);
+    par->nextStats = timespec_sum(&par->statsStart, &par->statsPeriod);
+    for (int dir = TX2RX; dir <= RX2TX; dir++)
+    {
+        par->direction[dir].lastStats = par->direction[dir].stats;
+    }
+    printf("WRITING STATS TO FILE %s EVERY %g s\n", filename, period);
+}
+
+
+// Write a line of the stats file if due
+void write_stats(const struct timespec *now)
+{
+    if (par->statsFile == NULL || timespec_comp(now, &par->nextStats) < 0)
+    {
+        return;
+    }
+    struct timespec elapsed = timespec_diff(now, &par->statsStart);
+    fprintf(par->statsFile, "%lld.%03ld", (long long) elapsed.tv_sec, elapsed.tv_nsec / 1000000);
+    for (int dir = TX2RX; dir <= RX2TX; dir++)
+    {
+        struct Stats *stats = &par->direction[dir].stats;
+        fprintf(par->statsFile, " %lld %lld %lld %lld %lld %lld %lld %.1f", stats->bytesIn, stats->bytesOut,
+                stats->corrupted, stats->dropped, stats->inserted, stats->frames, stats->slots - stats->bytesIn,
+                utilization(stats, &par->direction[dir].lastStats));
+        par->direction[dir].lastStats = *stats;
+    }
+    fprintf(par->statsFile, "\n");
+    fflush(par->statsFile);
+    par->nextStats = timespec_sum(&par->nextStats, &par->statsPeriod);
+    if (timespec_comp(&par->nextStats, now) <= 0)
+    {
+        par->nextStats = timespec_sum(now, &par->statsPeriod);  // Fell behind
+    }
+}
+
+
+// A frame being rebuilt from the bytes leaving one direction of the cable
+struct Deframer {
+    int inFrame;
+    int escaped;
+    unsigned char frame[MAX_FRAME_SIZE];  // Without flags and stuffing
+    int length;
+    int stuffed;    // Bytes that were escaped
+    int corrupted;  // Impairments of the bytes of the frame
+    int dropped;
+    int inserted;
+    long long start;    // Time of the opening flag, nsec since the capture started
+    long long outside;  // Bytes seen out of any frame
+};
+
+
+const char *frame_type(unsigned char control)
+{
+    switch (control)
+    {
+        case 0x03: return "SET";
+        case 0x07: return "UA";
+        case 0x0B: return "DISC";
+        case 0x00: return "I0";
+        case 0x80: return "I1";
+        case 0x20: return "AGG0";
+        case 0xA0: return "AGG1";
+        case 0xAA: return "RR0";
+        case 0xAB: return "RR1";
+        case 0x54: return "REJ0";
+        case 0x55: return "REJ1";
+        case 0x13: return "UI";
+        default: return "?";
+    }
+}
+
+
+// Print a frame rebuilt, and export it to the pcap file (if any): a byte
+// with the direction (0 for Tx->Rx), then the frame without flags and
+// stuffing
+void end_frame(struct Deframer *deframer, int dir, long long startTime, FILE *pcap)
+{
+    unsigned char *frame = deframer->frame;
+    int length = deframer->length;
+    printf("%lld.%06lld %s ", deframer->start / 1000000000, deframer->start % 1000000000 / 1000, DIRECTION_NAME(dir));
+    if (length < 3)
+    {
+        printf("SHORT FRAME (%d bytes)", length);
+    }
+    else
+    {
+        printf("A=%02X C=%02X %-4s %4d bytes", frame[0], frame[1], frame_type(frame[1]), length);
+        if (deframer->stuffed > 0)
         {
-            if (unreliableRate == FALSE)
-            {
-                printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
-                       "No further warnings will be issued\n");
-                unreliableRate = TRUE;
-            }
+            printf(", %d stuffed", deframer->stuffed);
         }
-        nextWait = timespec_diff(&nextTxTime, &currentTime);
-        if (timespec_is_negative(&nextWait))
+        if ((frame[0] ^ frame[1]) != frame[2])
         {
-            skipWait = TRUE;
+            printf(", BCC1 ERROR");
         }
-        else
+        else if (length > 4)
         {
-            skipWait = FALSE;
+            unsigned char bcc2 = 0;
+            for (int i = 3; i < length - 1; i++)
+            {
+                bcc2 ^= frame[i];
+            }
+            if (bcc2 != frame[length - 1])
+            {
+                printf(", BCC2 ERROR");
+            }
         }
+    }
+    if (deframer->corrupted + deframer->dropped + deframer->inserted > 0)
+    {
+        printf(" [%d corrupted, %d dropped, %d inserted]", deframer->corrupted, deframer->dropped,
+               deframer->inserted);
+    }
+    printf("\n");
 
-        // Read from Tx
-        int bytesFromTx = read(fdTx, par.tx2rx + par.tx2rxIdx, 1);
-        par.tx2rxValid[par.tx2rxIdx] = bytesFromTx > 0;
+    if (pcap != NULL)
+    {
+        long long time = startTime + deframer->start;
+        uint32_t header[4] = { time / 1000000000, time % 1000000000, length + 1, length + 1 };
+        unsigned char direction = dir;
+        fwrite(header, sizeof(header), 1, pcap);
+        fwrite(&direction, 1, 1, pcap);
+        fwrite(frame, 1, length, pcap);
+    }
+}
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, par.rx2tx + par.rx2txIdx, 1);
-        par.rx2txValid[par.rx2txIdx] = bytesFromRx > 0;
 
-        if (!par.cableOn)
+void deframe(struct Deframer *deframer, int dir, unsigned char byte, long long time, long long startTime,
+             FILE *pcap)
+{
+    if (byte == FLAG)
+    {
+        // A flag closes a frame, and may open the next one
+        if (deframer->inFrame && deframer->length > 0)
         {
-            // Ignore what was read
-            par.tx2rxValid[par.tx2rxIdx] = 0;
-            par.rx2txValid[par.rx2txIdx] = 0;
+            end_frame(deframer, dir, startTime, pcap);
         }
+        deframer->escaped = FALSE;
+        deframer->length = deframer->stuffed = 0;
+        deframer->corrupted = deframer->dropped = deframer->inserted = 0;
+        deframer->inFrame = TRUE;
+        deframer->start = time;
+    }
+    else if (!deframer->inFrame || deframer->length == MAX_FRAME_SIZE)
+    {
+        deframer->inFrame = FALSE;
+        deframer->outside++;
+    }
+    else if (byte == ESCAPE && !deframer->escaped)
+    {
+        deframer->escaped = TRUE;
+        deframer->stuffed++;
+    }
+    else
+    {
+        deframer->frame[deframer->length++] = deframer->escaped ? byte ^ SPECIAL_MASK : byte;
+        deframer->escaped = FALSE;
+    }
+}
 
-        if (par.logfile != NULL)  // Currently logging
-        {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxTx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxTx, "  ", 3);
-            }
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                sprintf(rx2txTx, "%02hhX", par.rx2tx[par.rx2txIdx]);
-            }
-            else
-            {
-                memcpy(rx2txTx, "  ", 3);
-            }
-        }
 
-        // Advance indices to next position
-        par.tx2rxIdx = (par.tx2rxIdx + 1) % par.bufSize;
-        par.rx2txIdx = (par.rx2txIdx + 1) % par.bufSize;
+// Print the frames of a capture, as they left the cable, with the
+// impairments they went through; with a pcap file, export them too
+// Returns 0 on success, -1 on failure
+int decode_capture(const char *filename, const char *pcapFile)
+{
+    FILE *capture = fopen(filename, "r");
+    unsigned char header[CAPTURE_HEADER_SIZE], record[CAPTURE_RECORD_SIZE];
+    if (capture == NULL || fread(header, 1, CAPTURE_HEADER_SIZE, capture) != CAPTURE_HEADER_SIZE ||
+        memcmp(header, CAPTURE_MAGIC, 8) != 0)
+    {
+        printf("%s IS NOT A CABLE CAPTURE\n", filename);
+        return -1;
+    }
+    long long startTime = get_le64(header + 8);
 
-        if (par.cableOn)
+    FILE *pcap = NULL;
+    if (pcapFile != NULL)
+    {
+        pcap = fopen(pcapFile, "w");
+        if (pcap == NULL)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.tx2rx[par.tx2rxIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdRx, par.tx2rx + par.tx2rxIdx, 1);
-            }
+            perror(pcapFile);
+            return -1;
+        }
+        // Nanosecond timestamps
+        uint32_t globalHeader[6] = { 0xA1B23C4D, 2 | (4 << 16), 0, 0, MAX_FRAME_SIZE + 1, LINKTYPE_USER0 };
+        fwrite(globalHeader, sizeof(globalHeader), 1, pcap);
+    }
 
-            if (par.rx2txValid[par.rx2txIdx])
+    static struct Deframer deframer[2];
+    long long slots[2] = {0}, corrupted[2] = {0}, dropped[2] = {0}, inserted[2] = {0};
+    while (fread(record, 1, CAPTURE_RECORD_SIZE, capture) == CAPTURE_RECORD_SIZE)
+    {
+        long long time = get_le64(record);
+        int flags = record[8];
+        int dir = flags & CAP_RX2TX ? RX2TX : TX2RX;
+        struct Deframer *d = &deframer[dir];
+        slots[dir]++;
+        if (flags & CAP_OUT)
+        {
+            d->corrupted += (flags & CAP_CORRUPTED) != 0;
+            d->dropped += (flags & CAP_DROPPED) != 0;
+            corrupted[dir] += (flags & CAP_CORRUPTED) != 0;
+            dropped[dir] += (flags & CAP_DROPPED) != 0;
+            if (!(flags & CAP_DROPPED))
             {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.rx2tx[par.rx2txIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdTx, par.rx2tx + par.rx2txIdx, 1);
+                deframe(d, dir, record[10], time, startTime, pcap);
             }
         }
+        if (flags & CAP_INSERTED)
+        {
+            d->inserted++;
+            inserted[dir]++;
+            deframe(d, dir, record[11], time, startTime, pcap);
+        }
+    }
+    fclose(capture);
+    if (pcap != NULL)
+    {
+        fclose(pcap);
+    }
+
+    for (int dir = TX2RX; dir <= RX2TX; dir++)
+    {
+        int unfinished = deframer[dir].inFrame && deframer[dir].length > 0;
+        printf("%s: %lld busy slots, %lld bytes corrupted, %lld dropped, %lld inserted, "
+               "%lld bytes outside frames%s\n", DIRECTION_NAME(dir), slots[dir], corrupted[dir], dropped[dir],
+               inserted[dir], deframer[dir].outside, unfinished ? ", last frame unfinished" : "");
+    }
+    return 0;
+}
+
+
+int compare_events(const void *a, const void *b)
+{
+    const struct Event *e1 = a, *e2 = b;
+    if (e1->at != e2->at)
+    {
+        return e1->at < e2->at ? -1 : 1;
+    }
+    return e1->line - e2->line;
+}
+
 
-        if (par.logfile != NULL)  // Currently logging
+// Load a scenario: events of the form "t=<time> <command>", separated by
+// newlines or ';', where time is in s (default), ms or us, e.g.
+// "t=2s ber 1e-5; t=10s off; t=11s on". Text after '#' is a comment.
+// Returns 0 on success, -1 on failure
+int load_scenario(const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        printf("ERROR OPENING SCENARIO %s\n", filename);
+        return -1;
+    }
+
+    char text[BUF_SIZE];
+    int line = 0;
+    while (fgets(text, sizeof(text), file) != NULL)
+    {
+        ++line;
+        char *comment = strchr(text, '#');
+        if (comment != NULL)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxRx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxRx, "  ", 3);
-            }
-            if (par.rx2txValid[par.rx2txIdx])
+            *comment = '\0';
+        }
+        for (char *event = strtok(text, ";\r\n"); event != NULL; event = strtok(NULL, ";\r\n"))
+        {
+            while (*event == ' ' || *event == '\t')
             {
-                sprintf(rx2txRx, "%02hhX", par.rx2tx[par.rx2txIdx]);
+                ++event;
             }
-            else
+            if (*event == '\0')
             {
-                memcpy(rx2txRx, "  ", 3);
+                continue;
             }
 
-            if (*tx2rxTx == ' ' && *rx2txTx == ' ' && *tx2rxRx == ' ' && *rx2txRx == ' ')
+            char *end;
+            double at = -1;
+            if (strncmp(event, "t=", 2) == 0)
             {
-                if (cableIdle == FALSE)
-                {
-                    fputs("---------------\n", par.logfile);
-                    cableIdle = TRUE;
-                }
+                at = strtod(event + 2, &end);
             }
-            else
+            if (at < 0 || end == event + 2)
             {
-                fprintf(par.logfile, "%s  %s | %s  %s\n", tx2rxTx, tx2rxRx, rx2txTx, rx2txRx);
-                cableIdle = FALSE;
+                printf("BAD SCENARIO EVENT AT LINE %d: %s\n", line, event);
+                fclose(file);
+                return -1;
             }
-        }
-
-        // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
-        {
-            rxStdin[fromStdin - 1] = '\0';
-
-            if (strcmp(rxStdin, "off") == 0)
+            if (strncmp(end, "us", 2) == 0)
             {
-                printf("CONNECTION OFF\n");
-                if (par.cableOn && par.logfile != NULL)
-                {
-                    fputs("CABLE OFF\n", par.logfile);
-                }
-                par.cableOn = FALSE;
+                end += 2;
             }
-            else if (strcmp(rxStdin, "on") == 0)
+            else if (strncmp(end, "ms", 2) == 0)
             {
-                printf("CONNECTION ON\n");
-                par.cableOn = TRUE;
+                at *= 1000;
+                end += 2;
             }
-            else if (strncmp(rxStdin, "ber ", 4) == 0)
+            else
             {
-                double ber;
-                sscanf(rxStdin + 4, "%lf", &ber);
-                // Compute pow(1 - ber, 8) without libm
-                double acc = 1 - ber;
-                acc *= acc;   // Squared
-                acc *= acc;   // To the fourth
-                acc *= acc;   // To the eightth
-                par.byteER = 1.0 - acc;
-                //printf("Byte Error Rate is %lf\n", par.byteER);
-                if (ber >= 0.0 && ber < 1.0)
-                {
-                    printf("BER SET TO %lf\n", ber);
-                    if (ber > 0.01)
-                    {
-                        printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
-                    }
-                }
-                else
-                {
-                    printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
-                }
-            }
-            else if (strncmp(rxStdin, "baud ", 5) == 0)
-            {
-                unsigned long baud = 0;
-                sscanf(rxStdin + 5, "%lu", &baud);
-                switch (baud) {
-                    case 1200:
-                    case 1800:
-                    case 2400:
-                    case 4800:
-                    case 9600:
-                    case 19200:
-                    case 38400:
-                    case 57600:
-                    case 115200:
-                        set_baud_rate(baud);
-                        break;
-                    default:
-                        printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600 or 115200\n");
-                }
+                at *= 1000000;
+                end += *end == 's';
             }
-            else if (strncmp(rxStdin, "prop ", 5) == 0)
+            if (*end != ' ' && *end != '\t')
             {
-                unsigned long propDelay;
-                if (sscanf(rxStdin + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
-                {
-                    printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
-                }
-                else
-                {
-                    par.propDelay = propDelay;
-                    init_ring_buffers();
-                }
+                printf("BAD SCENARIO EVENT AT LINE %d: %s\n", line, event);
+                fclose(file);
+                return -1;
             }
-            else if (strncmp(rxStdin, "log ", 4) == 0)
+            while (*end == ' ' || *end == '\t')
             {
-                startlog(rxStdin + 4);
+                ++end;
             }
-            else if (strcmp(rxStdin, "endlog") == 0)
+            // Trailing blanks would make the command unknown
+            size_t length = strlen(end);
+            while (length > 0 && (end[length - 1] == ' ' || end[length - 1] == '\t'))
             {
-                endlog();
-                printf("NOT LOGGING\n");
+                end[--length] = '\0';
             }
-            else if (strcmp(rxStdin, "quit") == 0)
+
+            scenario.events = realloc(scenario.events, (scenario.count + 1) * sizeof(struct Event));
+            if (scenario.events == NULL)
             {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
-            }
-            else if (strcmp(rxStdin, "help") == 0) {
-                help();
-            }
-            else {
-                printf("BAD COMMAND OR MISSING PARAMETERS\n");
+                fclose(file);
+                return -1;
             }
-        }
-
-        if (skipWait == FALSE) {
-            nanosleep(&nextWait, NULL);
+            struct Event *new = &scenario.events[scenario.count++];
+            new->at = (long long) at;
+            new->line = line;
+            snprintf(new->command, sizeof(new->command), "%s", end);
         }
     }
+    fclose(file);
+
+    qsort(scenario.events, scenario.count, sizeof(struct Event), compare_events);
+    printf("SCENARIO %s: %d EVENTS\n", filename, scenario.count);
+    return 0;
+}
+
 
-    // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
+// Name of the serial port opened by the Tx of a link, and of the cable's end
+// of it; link 0 uses TXDEV, link k /dev/ttyS<10(k+1)>
+void tx_port_names(int link, char *port, char *emulator)
+{
+    if (link == 0)
     {
-        perror("tcsetattr");
-        exit(-1);
+        strcpy(port, TXDEV);
+        strcpy(emulator, "/dev/emulatorTx");
     }
-
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
+    else
     {
-        perror("tcsetattr");
-        exit(-1);
+        sprintf(port, "/dev/ttyS%d", 10 * (link + 1));
+        sprintf(emulator, "/dev/emulator%dTx", link + 1);
     }
+}
 
-    close(fdTx);
-    close(fdRx);
+
+// Name of the serial port opened by receiver i of a link, and of the cable's
+// end of it: the ports following the Tx port
+void rx_port_names(int link, int i, char *port, char *emulator)
+{
+    sprintf(port, "/dev/ttyS%d", 10 * (link + 1) + 1 + i);
+    if (link == 0 && i == 0)
+    {
+        strcpy(emulator, "/dev/emulatorRx");
+    }
+    else if (link == 0)
+    {
+        sprintf(emulator, "/dev/emulatorRx%d", i + 1);
+    }
+    else
+    {
+        sprintf(emulator, "/dev/emulator%dRx%d", link + 1, i + 1);
+    }
+}
+
+
+// Log a slot of a direction: the byte entering the cable, the byte leaving
+// it ("--" for a byte dropped), then the spurious byte inserted, if any
+void log_slot(int dir, const char *in, const char *out, const char *extra)
+{
+    if (*in == ' ' && *out == ' ' && *extra == ' ')
+    {
+        par->logIdle[dir] = TRUE;
+        if (par->logIdle[TX2RX] && par->logIdle[RX2TX] && par->logSeparator == FALSE)
+        {
+            fputs("---------------\n", par->logfile);
+            par->logSeparator = TRUE;
+        }
+        return;
+    }
+    par->logIdle[dir] = FALSE;
+    par->logSeparator = FALSE;
+    const char *format = dir == TX2RX ? "%s  %s |\n" : "       | %s  %s\n";
+    fprintf(par->logfile, format, in, out);
+    if (*extra != ' ')
+    {
+        fprintf(par->logfile, format, "  ", extra);
+    }
+}
+
+
+uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+
+// Next number of a process's stream (xoshiro256**)
+uint64_t random_next(struct Process *p)
+{
+    uint64_t *s = p->rng;
+    const uint64_t result = rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+
+// Natural logarithm without libm: with x = m * 2^e and m in [sqrt(2)/2,
+// sqrt(2)), ln(x) = e * ln(2) + 2 * atanh((m - 1) / (m + 1)), whose series
+// converges fast
+double natural_log(double x)
+{
+    union { double d; uint64_t u; } v = { .d = x };
+    int e = (int) ((v.u >> 52) & 0x7FF) - 1023;
+    v.u = (v.u & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;  // m in [1, 2)
+    double m = v.d;
+    if (m > 1.4142135623730951)
+    {
+        m /= 2;
+        ++e;
+    }
+    double z = (m - 1) / (m + 1), z2 = z * z, term = z, sum = 0;
+    for (int k = 1; k < 30; k += 2)
+    {
+        sum += term / k;
+        term *= z2;
+    }
+    return 2 * sum + e * 0.6931471805599453;
+}
+
+
+// ln(1 - p), precise for small p too
+double log_complement(double p)
+{
+    if (p < 0.01)
+    {
+        return -(p + p * p / 2 + p * p * p / 3 + p * p * p * p / 4 + p * p * p * p * p / 5);
+    }
+    return natural_log(1 - p);
+}
+
+
+// Number of trials before the next event of a process, each trial being an
+// event with probability p
+long long geometric(struct Process *process, double p)
+{
+    if (p <= 0.0)
+    {
+        return NEVER;
+    }
+    if (p >= 1.0)
+    {
+        return 0;
+    }
+    // Uniform in (0, 1]
+    double u = ((random_next(process) >> 11) + 1) * 0x1.0p-53;
+    double trials = natural_log(u) / log_complement(p);
+    return trials < NEVER ? (long long) trials : NEVER;
+}
+
+
+// Restart the impairments of a line, in the good state
+void reset_line(struct Line *line, int dir)
+{
+    const struct Impairments *imp = &par->impair[dir];
+    line->inBurst = FALSE;
+    line->bitError.left = geometric(&line->bitError, imp->ber[0]);
+    line->drop.left = geometric(&line->drop, imp->dropRate);
+    line->insert.left = geometric(&line->insert, imp->insertRate);
+    line->burst.left = geometric(&line->burst, imp->enterBurst);
+}
+
+
+void reset_lines(void)
+{
+    for (int i = 0; i < MAX_RX; i++)
+    {
+        reset_line(&par->tx2rxLine[i], TX2RX);
+    }
+    reset_line(&par->rx2txLine, RX2TX);
+}
+
+
+// Seed the random streams of every line, and restart them
+void seed_lines(uint64_t seed)
+{
+    uint64_t x = seed;
+    for (int i = 0; i <= MAX_RX; i++)
+    {
+        struct Line *line = i < MAX_RX ? &par->tx2rxLine[i] : &par->rx2txLine;
+        struct Process *processes[] = { &line->bitError, &line->drop, &line->insert, &line->burst };
+        for (int j = 0; j < 4; j++)
+        {
+            for (int k = 0; k < 4; k++)
+            {
+                processes[j]->rng[k] = splitmix64(&x);
+            }
+        }
+    }
+    for (int dir = TX2RX; dir <= RX2TX; dir++)
+    {
+        for (int k = 0; k < 4; k++)
+        {
+            par->direction[dir].jitterDraw.rng[k] = splitmix64(&x);
+        }
+    }
+    par->seed = seed;
+    reset_lines();
+}
+
+
+// Extra delay of a byte, in slots
+long long draw_jitter(struct Direction *way)
+{
+    if (way->jitterSlots == 0)
+    {
+        return 0;
+    }
+    if (!way->jitterExp)
+    {
+        return random_next(&way->jitterDraw) % (way->jitterSlots + 1);
+    }
+    long long slots = geometric(&way->jitterDraw, 1.0 / (way->jitterSlots + 1));
+    return slots < way->maxJitterSlots ? slots : way->maxJitterSlots;
+}
+
+
+// What leaves the cable in a slot, on one line
+struct Impaired {
+    char bytes[2];  // The byte carried and/or a spurious one
+    int count;
+    int dropped;    // The byte carried was lost
+    int inserted;   // The last byte is a spurious one
+};
+
+
+// Draw the impairments of direction dir in a slot of a line, carrying
+// "byte" if valid
+struct Impaired draw_impairments(int dir, struct Line *line, char byte, int valid)
+{
+    const struct Impairments *imp = &par->impair[dir];
+    struct Impaired out = { .count = 0, .dropped = FALSE, .inserted = FALSE };
+
+    if (imp->enterBurst != 0.0)
+    {
+        if (line->burst.left-- == 0)
+        {
+            line->inBurst = !line->inBurst;
+            line->burst.left = geometric(&line->burst, line->inBurst ? imp->leaveBurst : imp->enterBurst);
+            // The BER changed
+            line->bitError.left = geometric(&line->bitError, imp->ber[line->inBurst]);
+        }
+    }
+    if (valid)
+    {
+        if (line->drop.left-- == 0)
+        {
+            line->drop.left = geometric(&line->drop, imp->dropRate);
+            out.dropped = TRUE;
+        }
+        else
+        {
+            // Flip the bits the countdown falls on
+            while (line->bitError.left < 8)
+            {
+                byte ^= (char) (1 << line->bitError.left);
+                line->bitError.left += 1 + geometric(&line->bitError, imp->ber[line->inBurst]);
+            }
+            line->bitError.left -= 8;
+            out.bytes[out.count++] = byte;
+        }
+    }
+    if (line->insert.left-- == 0)
+    {
+        line->insert.left = geometric(&line->insert, imp->insertRate);
+        out.bytes[out.count++] = (char) random_next(&line->insert);
+        out.inserted = TRUE;
+    }
+    return out;
+}
+
+
+// The impairments of a slot of a line, as the trace being replayed decided
+struct Impaired replay_decisions(struct Line *line, char byte, int valid)
+{
+    struct Impaired out = { .count = 0, .dropped = FALSE, .inserted = FALSE };
+    struct Trace *errors = &line->errors, *inserts = &line->inserts;
+
+    if (valid)
+    {
+        while (errors->next < errors->count && errors->decisions[errors->next].byte < line->carried)
+        {
+            errors->next++;
+        }
+        if (errors->next < errors->count && errors->decisions[errors->next].byte == line->carried)
+        {
+            struct Decision *error = &errors->decisions[errors->next++];
+            out.dropped = error->drop;
+            byte ^= error->drop ? 0 : error->value;
+        }
+        if (!out.dropped)
+        {
+            out.bytes[out.count++] = byte;
+        }
+    }
+    // The spurious bytes due once this slot's byte went by; if the byte came
+    // sooner than in the recorded run, they are late
+    long long carried = line->carried + (valid ? 1 : 0);
+    if (inserts->next < inserts->count && inserts->decisions[inserts->next].byte <= carried)
+    {
+        out.bytes[out.count++] = inserts->decisions[inserts->next++].value;
+        out.inserted = TRUE;
+    }
+    return out;
+}
+
+
+void line_name(const struct Line *line, char *name)
+{
+    if (line == &par->rx2txLine)
+    {
+        strcpy(name, "rx2tx");
+    }
+    else
+    {
+        sprintf(name, "tx2rx%d", (int) (line - par->tx2rxLine) + 1);
+    }
+}
+
+
+// Apply the impairments of direction dir to a slot of a line, carrying
+// "byte" if valid, and record them if a trace is being recorded
+struct Impaired impair(int dir, struct Line *line, char byte, int valid)
+{
+    struct Impaired out = par->replaying ? replay_decisions(line, byte, valid)
+                                        : draw_impairments(dir, line, byte, valid);
+    if (par->trace != NULL && (out.dropped || out.inserted || (valid && out.bytes[0] != byte)))
+    {
+        char name[24];
+        line_name(line, name);
+        if (out.dropped)
+        {
+            fprintf(par->trace, "%s %lld drop\n", name, line->carried);
+        }
+        else if (valid && out.bytes[0] != byte)
+        {
+            fprintf(par->trace, "%s %lld flip %02hhX\n", name, line->carried, (char) (out.bytes[0] ^ byte));
+        }
+        if (out.inserted)
+        {
+            fprintf(par->trace, "%s %lld insert %02hhX\n", name, line->carried + (valid ? 1 : 0),
+                    out.bytes[out.count - 1]);
+        }
+    }
+    line->carried += valid ? 1 : 0;
+    return out;
+}
+
+
+// Restart the byte counts of every line, which decisions refer to
+void restart_traces(void)
+{
+    for (int i = 0; i <= MAX_RX; i++)
+    {
+        struct Line *line = i < MAX_RX ? &par->tx2rxLine[i] : &par->rx2txLine;
+        line->carried = 0;
+        line->errors.next = 0;
+        line->inserts.next = 0;
+    }
+}
+
+
+void endrecord(void)
+{
+    if (par->trace != NULL)
+    {
+        fclose(par->trace);
+        par->trace = NULL;
+    }
+}
+
+
+void startrecord(const char *filename)
+{
+    endrecord();
+    par->trace = fopen(filename, "w");
+    if (par->trace == NULL)
+    {
+        printf("ERROR OPENING FILE %s, NOT RECORDING\n", filename);
+        return;
+    }
+    fprintf(par->trace, "# Cable trace (seed %llu): <line> <byte> drop | flip <bits> | insert <byte>\n",
+            (unsigned long long) par->seed);
+    restart_traces();
+    printf("RECORDING IMPAIRMENTS TO FILE %s\n", filename);
+}
+
+
+// Load a trace recorded by startrecord and replay it instead of drawing
+// impairments at random: with the same traffic, the lines carry exactly the
+// same bytes as in the recorded run
+// Returns 0 on success, -1 on failure
+int startreplay(const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        printf("ERROR OPENING FILE %s, NOT REPLAYING\n", filename);
+        return -1;
+    }
+    for (int i = 0; i <= MAX_RX; i++)
+    {
+        struct Line *line = i < MAX_RX ? &par->tx2rxLine[i] : &par->rx2txLine;
+        line->errors.count = 0;
+        line->inserts.count = 0;
+    }
+
+    char text[128], name[16], kind[16];
+    int lineNumber = 0, decisions = 0;
+    while (fgets(text, sizeof(text), file) != NULL)
+    {
+        lineNumber++;
+        long long byte;
+        unsigned int value = 0;
+        int n = sscanf(text, "%15s %lld %15s %x", name, &byte, kind, &value);
+        if (n <= 0 || name[0] == '#')
+        {
+            continue;
+        }
+
+        struct Line *line = NULL;
+        int receiver = 0;
+        if (strcmp(name, "rx2tx") == 0)
+        {
+            line = &par->rx2txLine;
+        }
+        else if (sscanf(name, "tx2rx%d", &receiver) == 1 && receiver >= 1 && receiver <= MAX_RX)
+        {
+            line = &par->tx2rxLine[receiver - 1];
+        }
+        int drop = n == 3 && strcmp(kind, "drop") == 0;
+        int insert = n == 4 && strcmp(kind, "insert") == 0;
+        if (line == NULL || byte < 0 || value > 0xFF || !(drop || insert || (n == 4 && strcmp(kind, "flip") == 0)))
+        {
+            printf("BAD TRACE LINE %d: %s", lineNumber, text);
+            fclose(file);
+            return -1;
+        }
+
+        struct Trace *trace = insert ? &line->inserts : &line->errors;
+        if (trace->count > 0 && trace->decisions[trace->count - 1].byte > byte)
+        {
+            printf("TRACE OUT OF ORDER AT LINE %d\n", lineNumber);
+            fclose(file);
+            return -1;
+        }
+        // Grow by doubling
+        if ((trace->count & (trace->count - 1)) == 0)
+        {
+            void *decisions = realloc(trace->decisions, 2 * (trace->count + 1) * sizeof(struct Decision));
+            if (decisions == NULL)
+            {
+                printf("OUT OF MEMORY\n");
+                fclose(file);
+                return -1;
+            }
+            trace->decisions = decisions;
+        }
+        trace->decisions[trace->count++] = (struct Decision) { .byte = byte, .drop = drop, .value = value };
+        decisions++;
+    }
+    fclose(file);
+    restart_traces();
+    par->replaying = TRUE;
+    printf("REPLAYING %d IMPAIRMENTS FROM FILE %s\n", decisions, filename);
+    return 0;
+}
+
+
+// Describe the bytes leaving the cable in a slot, for the log
+void describe_slot(const struct Impaired *out, char *text, char *extra)
+{
+    int carried = out->count - out->inserted;
+    if (carried > 0)
+    {
+        sprintf(text, "%02hhX", out->bytes[0]);
+    }
+    else
+    {
+        memcpy(text, out->dropped ? "--" : "  ", 3);
+    }
+    if (out->inserted)
+    {
+        sprintf(extra, "%02hhX", out->bytes[out->count - 1]);
+    }
+    else
+    {
+        memcpy(extra, "  ", 3);
+    }
+}
+
+
+// Move "slots" byte slots worth of data through one direction of the cable.
+// Every slot takes at most one byte in and hands out the byte due in it,
+// exactly as if slots were run one at a time; only the reads and writes are
+// batched. The first emptySlots slots take no bytes in (the line was known
+// to be idle then).
+void move_bytes(int dir, int fdTx, const int *fdRx, int slots, int emptySlots)
+{
+    struct Direction *way = &par->direction[dir];
+    int numIn = dir == TX2RX ? 1 : par->numRx;
+    int numOut = dir == TX2RX ? par->numRx : 1;
+    char in[MAX_BATCH], byte[MAX_BATCH];
+    // Up to two bytes per slot, with a spurious one
+    char out[MAX_RX][2 * MAX_BATCH];
+    int outCount[MAX_RX] = {0};
+
+    // Bytes sent by several receivers in the same slot collide
+    int readSlots = slots - emptySlots;
+    int bytesIn = 0;
+    for (int i = 0; i < numIn; i++)
+    {
+        int res = read(dir == TX2RX ? fdTx : fdRx[i], byte, readSlots);
+        for (int j = 0; j < res; j++)
+        {
+            in[emptySlots + j] = j < bytesIn ? in[emptySlots + j] | byte[j] : byte[j];
+        }
+        if (res > bytesIn)
+        {
+            bytesIn = res;
+        }
+    }
+
+    // For logging
+    char inText[3], outText[3], extraText[3];
+    long long slotTime = timespec_nsec(&way->nextSlotTime) - slots * way->byteDelay.tv_nsec;
+
+    for (int slot = 0; slot < slots; slot++, way->slot++, slotTime += way->byteDelay.tv_nsec)
+    {
+        // What was read is ignored while the cable is off
+        int entering = par->cableOn && slot >= emptySlots && slot < emptySlots + bytesIn;
+        if (entering)
+        {
+            // Jitter delays a byte further, but not past the one before:
+            // the line stays first in, first out
+            long long leaving = way->slot + way->propSlots + draw_jitter(way);
+            if (leaving <= way->lastOut)
+            {
+                leaving = way->lastOut + 1;
+            }
+            way->buf[leaving % way->bufSize] = in[slot];
+            way->valid[leaving % way->bufSize] = TRUE;
+            way->lastOut = leaving;
+        }
+        long index = way->slot % way->bufSize;
+        int leaving = way->valid[index];
+        way->valid[index] = FALSE;
+
+        // The log and the capture show the first receiver
+        struct Impaired first = { .count = 0, .dropped = FALSE, .inserted = FALSE };
+        if (par->cableOn)
+        {
+            // Every receiver gets what was sent, with its own impairments
+            for (int i = 0; i < numOut; i++)
+            {
+                struct Impaired imp = impair(dir, dir == TX2RX ? &par->tx2rxLine[i] : &par->rx2txLine,
+                                             way->buf[index], leaving);
+                memcpy(out[i] + outCount[i], imp.bytes, imp.count);
+                outCount[i] += imp.count;
+                if (i == 0)
+                {
+                    first = imp;
+                }
+            }
+        }
+
+        struct Stats *stats = &way->stats;
+        stats->slots++;
+        if (entering)
+        {
+            stats->bytesIn++;
+            if (in[slot] == FLAG)
+            {
+                // A flag closes a frame, and may open the next one
+                stats->frames += stats->frameLength > 0;
+                stats->frameLength = 0;
+            }
+            else if (stats->frameLength >= 0)
+            {
+                stats->frameLength++;
+            }
+        }
+        stats->bytesOut += first.count;
+        stats->corrupted += first.count > first.inserted && first.bytes[0] != way->buf[index];
+        stats->dropped += first.dropped;
+        stats->inserted += first.inserted;
+
+        if (par->capture != NULL && (entering || first.count > 0 || first.dropped))
+        {
+            int flags = (dir == RX2TX ? CAP_RX2TX : 0) | (entering ? CAP_IN : 0) | (first.dropped ? CAP_DROPPED : 0);
+            if (first.count > first.inserted || first.dropped)
+            {
+                flags |= CAP_OUT;
+                flags |= !first.dropped && first.bytes[0] != way->buf[index] ? CAP_CORRUPTED : 0;
+            }
+            flags |= first.inserted ? CAP_INSERTED : 0;
+            capture_slot(slotTime, flags, entering ? in[slot] : 0, first.dropped ? way->buf[index] : first.bytes[0],
+                         first.inserted ? first.bytes[first.count - 1] : 0);
+        }
+
+        if (par->logfile != NULL)  // Currently logging
+        {
+            if (entering)
+            {
+                sprintf(inText, "%02hhX", in[slot]);
+            }
+            else
+            {
+                memcpy(inText, "  ", 3);
+            }
+            describe_slot(&first, outText, extraText);
+            log_slot(dir, inText, outText, extraText);
+        }
+    }
+
+    for (int i = 0; i < numOut; i++)
+    {
+        if (outCount[i] > 0)
+        {
+            write(dir == TX2RX ? fdRx[i] : fdTx, out[i], outCount[i]);
+        }
+    }
+}
+
+
+// Returns the number of bytes waiting to enter a direction of the cable (the
+// largest at any port)
+int pending_bytes(int dir, int fdTx, const int *fdRx)
+{
+    int pending = 0;
+    if (dir == TX2RX)
+    {
+        ioctl(fdTx, FIONREAD, &pending);
+        return pending;
+    }
+    for (int i = 0; i < par->numRx; i++)
+    {
+        int bytes = 0;
+        ioctl(fdRx[i], FIONREAD, &bytes);
+        if (bytes > pending)
+        {
+            pending = bytes;
+        }
+    }
+    return pending;
+}
+
+
+// Wait until a port or stdin, registered with epollFd, has input, but not
+// past "until"
+void wait_for_input(int epollFd, const struct timespec *until)
+{
+    struct epoll_event events[MAX_LINKS * (MAX_RX + 1) + 1];
+    struct timespec now, wait;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    wait = timespec_diff(until, &now);
+    if (!timespec_is_negative(&wait))
+    {
+        // Rounded up to whole milliseconds
+        epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]),
+                   wait.tv_sec * 1000 + (wait.tv_nsec + 999999) / 1000000);
+    }
+}
+
+
+// Show help
+void help()
+{
+    printf("\n\n");
+    for (int link = 0; link < numLinks; link++)
+    {
+        char port[32], emulator[32];
+        if (numLinks > 1)
+        {
+            printf("Link %d:\n", link + 1);
+        }
+        tx_port_names(link, port, emulator);
+        printf("Transmitter must open %s\n", port);
+        for (int i = 0; i < links[link].numRx; i++)
+        {
+            rx_port_names(link, i, port, emulator);
+            if (i == 0)
+            {
+                printf("Receiver must open %s\n", port);
+            }
+            else
+            {
+                printf("Receiver %d must open %s\n", i + 1, port);
+            }
+        }
+    }
+    printf("\n"
+           "With -n <count> (1-%d), the Tx is fanned out to count receivers, each\n"
+           "with its own noise; bytes sent by several receivers at once collide.\n"
+           "With -k <count> (1-%d), count independent links are served, each with its\n"
+           "own settings, counters and files; the link command selects the one the\n"
+           "commands that follow apply to. Options apply to every link; the files of\n"
+           "-l, -c, -t and -p are those of link 1, and <file>.<k> those of link k.\n"
+           "\n"
+           "Options -b <rate>, -d <delay>, -e <ber>, -l <file>, -c <file>, -r <seed>,\n"
+           "-t <file> and -p <file> do as the baud, prop, ber, log, capture, seed, record\n"
+           "and replay commands at startup. With -s <file>, the commands of a scenario\n"
+           "file run at set times since the first byte entered the cable, e.g.\n"
+           "   t=2s ber 1e-5; t=10s off; t=11s on; t=60s quit\n"
+           "(events separated by ';' or newlines, times in s, ms or us, '#' comments).\n"
+           "\n"
+           "The cable program is sensible to the following interactive commands:\n"
+           "--- help         : show this help\n"
+           "--- link <n>     : apply the commands that follow to link n (default=1)\n"
+           "--- on           : connect the cable and data is exchanged (default state)\n"
+           "--- off          : disconnect the cable disabling data to be exchanged\n"
+           "--- ber <ber> [dir]\n"
+           "                 : add noise to data bits at a specified BER (default=0)\n"
+           "--- burst <p> <r> <ber> [dir]\n"
+           "                 : burst errors (Gilbert-Elliott): in every byte slot, a\n"
+           "                   burst starts with probability p and ends with probability\n"
+           "                   r; the BER is <ber> during bursts (burst 0 0 0 disables)\n"
+           "--- drop <rate> [dir]\n"
+           "                 : lose bytes with this probability (default=0)\n"
+           "--- insert <rate> [dir]\n"
+           "                 : add spurious bytes in byte slots with this probability\n"
+           "                   (default=0)\n"
+           "--- baud <rate> [dir]\n"
+           "                 : set baud rate, between 50 and 4000000 (default=9600)\n"
+           "                   note that 10 bits are sent per byte (8-N-1)\n"
+           "--- prop <delay> [dir]\n"
+           "                 : set the propagation delay in usec (0-1000000, default=0)\n"
+           "                   will be approximated to an integer multiple of the byte\n"
+           "                   delay (10 / baud_rate)\n"
+           "--- jitter <usec> [uniform|exp] [dir]\n"
+           "                 : delay every byte further, by up to usec (uniform, the\n"
+           "                   default) or by usec on average (exp, at most 10 times\n"
+           "                   as much); bytes are never reordered (default=0)\n"
+           "                   dir is tx2rx or rx2tx, both directions when left out\n"
+           "--- seed <seed>  : restart the random impairments from this seed (a random\n"
+           "                   one is printed at startup); runs with the same seed and\n"
+           "                   the same traffic get the same impairments\n"
+           "--- log <file>   : log transmitted data to file\n"
+           "--- endlog       : stop logging transmitted data\n"
+           "--- record <file>\n"
+           "                 : record the impairments of every byte to a trace file\n"
+           "--- endrecord    : stop recording\n"
+           "--- replay <file>\n"
+           "                 : impair the bytes exactly as recorded in a trace file, by\n"
+           "                   their position in the traffic, instead of at random\n"
+           "--- endreplay    : go back to random impairments\n"
+           "--- stats [reset]\n"
+           "                 : show (or restart) the counters of each direction: bytes\n"
+           "                   carried and impaired, frames, idle slots, utilization\n"
+           "--- statslog <file> [period]\n"
+           "                 : write the counters to file every period seconds\n"
+           "                   (default=1)\n"
+           "--- endstatslog  : stop writing the counters\n"
+           "--- capture <file>\n"
+           "                 : capture the bytes entering and leaving the cable, with\n"
+           "                   their impairments, in binary; decode with -x <file>\n"
+           "                   (-w <pcap file> also exports the frames for Wireshark)\n"
+           "--- endcapture   : stop capturing\n"
+           "--- quit         : terminate the program\n"
+           "\n"
+           "IMPORTANT: Changing the baud rate, propagation delay or jitter while a\n"
+           "           transmission is ongoing will result in losses.\n"
+           "\n", MAX_RX, MAX_LINKS);
+}
+
+// Parse an optional direction, "tx2rx" or "rx2tx" (both if empty), into the
+// range of directions first..last
+// Returns FALSE if it is not one
+int parse_direction(const char *text, int *first, int *last)
+{
+    if (*text == '\0')
+    {
+        *first = TX2RX;
+        *last = RX2TX;
+    }
+    else if (strcmp(text, "tx2rx") == 0 || strcmp(text, "rx2tx") == 0)
+    {
+        *first = *last = text[0] == 't' ? TX2RX : RX2TX;
+    }
+    else
+    {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+// Run one of the interactive commands (also given by options and scenarios)
+// Returns TRUE if the program must terminate
+int run_command(const char *command)
+{
+    if (strcmp(command, "off") == 0)
+    {
+        printf("CONNECTION OFF\n");
+        if (par->cableOn && par->logfile != NULL)
+        {
+            fputs("CABLE OFF\n", par->logfile);
+        }
+        par->cableOn = FALSE;
+    }
+    else if (strcmp(command, "on") == 0)
+    {
+        printf("CONNECTION ON\n");
+        par->cableOn = TRUE;
+    }
+    else if (strncmp(command, "ber ", 4) == 0)
+    {
+        double ber = -1;
+        char dir[16] = "";
+        int first, last;
+        if (sscanf(command + 4, "%lf %15s", &ber, dir) < 1 || ber < 0.0 || ber >= 1.0 ||
+            !parse_direction(dir, &first, &last))
+        {
+            printf("BAD BER VALUE OR DIRECTION (MUST BE 0 <= BER < 1.0)\n");
+            return FALSE;
+        }
+        for (int d = first; d <= last; d++)
+        {
+            par->impair[d].ber[0] = ber;
+            printf("BER SET TO %lf (%s)\n", ber, DIRECTION_NAME(d));
+        }
+        reset_lines();
+    }
+    else if (strncmp(command, "burst ", 6) == 0)
+    {
+        double enter = -1, leave = -1, ber = -1;
+        char dir[16] = "";
+        int first, last;
+        if (sscanf(command + 6, "%lf %lf %lf %15s", &enter, &leave, &ber, dir) < 3 ||
+            enter < 0.0 || enter > 1.0 || leave < 0.0 || leave > 1.0 || ber < 0.0 || ber >= 1.0 ||
+            (enter != 0.0 && leave == 0.0) || !parse_direction(dir, &first, &last))
+        {
+            printf("BAD BURST PARAMETERS OR DIRECTION\n");
+            return FALSE;
+        }
+        for (int d = first; d <= last; d++)
+        {
+            par->impair[d].enterBurst = enter;
+            par->impair[d].leaveBurst = leave;
+            par->impair[d].ber[1] = ber;
+            if (enter == 0.0)
+            {
+                printf("BURSTS DISABLED (%s)\n", DIRECTION_NAME(d));
+            }
+            else
+            {
+                printf("BURSTS OF %.1f BYTES ON AVERAGE, %.2f%% OF THE TIME, BER %lf (%s)\n",
+                       1.0 / leave, 100.0 * enter / (enter + leave), ber, DIRECTION_NAME(d));
+            }
+        }
+        reset_lines();
+    }
+    else if (strncmp(command, "drop ", 5) == 0 || strncmp(command, "insert ", 7) == 0)
+    {
+        int drop = command[0] == 'd';
+        double rate = -1;
+        char dir[16] = "";
+        int first, last;
+        if (sscanf(command + (drop ? 5 : 7), "%lf %15s", &rate, dir) < 1 || rate < 0.0 || rate >= 1.0 ||
+            !parse_direction(dir, &first, &last))
+        {
+            printf("BAD RATE OR DIRECTION (MUST BE 0 <= RATE < 1.0)\n");
+            return FALSE;
+        }
+        for (int d = first; d <= last; d++)
+        {
+            *(drop ? &par->impair[d].dropRate : &par->impair[d].insertRate) = rate;
+            printf("%s RATE SET TO %lf (%s)\n", drop ? "DROP" : "INSERTION", rate, DIRECTION_NAME(d));
+        }
+        reset_lines();
+    }
+    else if (strncmp(command, "seed ", 5) == 0)
+    {
+        unsigned long long seed;
+        if (sscanf(command + 5, "%llu", &seed) < 1)
+        {
+            printf("BAD SEED\n");
+            return FALSE;
+        }
+        seed_lines(seed);
+        printf("RANDOM SEED: %llu\n", seed);
+    }
+    else if (strncmp(command, "baud ", 5) == 0)
+    {
+        unsigned long baud = 0;
+        char dir[16] = "";
+        int first, last;
+        sscanf(command + 5, "%lu %15s", &baud, dir);
+        if (!parse_direction(dir, &first, &last))
+        {
+            printf("BAD DIRECTION\n");
+            return FALSE;
+        }
+        if (baud < MIN_BAUDRATE || baud > MAX_BAUDRATE)
+        {
+            printf("UNSUPPORTED BAUD RATE: must be between %d and %d\n", MIN_BAUDRATE, MAX_BAUDRATE);
+            return FALSE;
+        }
+        for (int d = first; d <= last; d++)
+        {
+            set_baud_rate(d, baud);
+        }
+    }
+    else if (strncmp(command, "prop ", 5) == 0)
+    {
+        unsigned long propDelay;
+        char dir[16] = "";
+        int first, last;
+        if (sscanf(command + 5, "%lu %15s", &propDelay, dir) < 1 || propDelay > 1000000 ||
+            !parse_direction(dir, &first, &last))
+        {
+            printf("BAD OR OUT OF RANGE PROPAGATION DELAY, OR BAD DIRECTION\n");
+            return FALSE;
+        }
+        for (int d = first; d <= last; d++)
+        {
+            par->direction[d].propDelay = propDelay;
+            init_ring_buffer(d);
+        }
+    }
+    else if (strncmp(command, "jitter ", 7) == 0)
+    {
+        unsigned long jitter;
+        char kind[16] = "", dir[16] = "";
+        int first, last;
+        int n = sscanf(command + 7, "%lu %15s %15s", &jitter, kind, dir);
+        // The distribution may be left out
+        if (n == 2 && strcmp(kind, "uniform") != 0 && strcmp(kind, "exp") != 0)
+        {
+            strcpy(dir, kind);
+            strcpy(kind, "uniform");
+        }
+        if (n < 1 || jitter > 1000000 || (n >= 2 && strcmp(kind, "uniform") != 0 && strcmp(kind, "exp") != 0) ||
+            !parse_direction(dir, &first, &last))
+        {
+            printf("BAD OR OUT OF RANGE JITTER, OR BAD DISTRIBUTION OR DIRECTION\n");
+            return FALSE;
+        }
+        for (int d = first; d <= last; d++)
+        {
+            par->direction[d].jitter = jitter;
+            par->direction[d].jitterExp = strcmp(kind, "exp") == 0;
+            init_ring_buffer(d);
+            if (jitter == 0)
+            {
+                printf("NO JITTER (%s)\n", DIRECTION_NAME(d));
+            }
+        }
+    }
+    else if (strncmp(command, "log ", 4) == 0)
+    {
+        startlog(command + 4);
+    }
+    else if (strcmp(command, "endlog") == 0)
+    {
+        endlog();
+        printf("NOT LOGGING\n");
+    }
+    else if (strncmp(command, "record ", 7) == 0)
+    {
+        startrecord(command + 7);
+    }
+    else if (strcmp(command, "endrecord") == 0)
+    {
+        endrecord();
+        printf("NOT RECORDING\n");
+    }
+    else if (strncmp(command, "replay ", 7) == 0)
+    {
+        startreplay(command + 7);
+    }
+    else if (strcmp(command, "endreplay") == 0)
+    {
+        par->replaying = FALSE;
+        printf("IMPAIRMENTS DRAWN AT RANDOM\n");
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        print_stats();
+    }
+    else if (strcmp(command, "stats reset") == 0)
+    {
+        reset_stats();
+        printf("STATS RESET\n");
+    }
+    else if (strncmp(command, "statslog ", 9) == 0)
+    {
+        char filename[BUF_SIZE];
+        double period = 1.0;
+        if (sscanf(command + 9, "%s %lf", filename, &period) < 1 || period < 0.01)
+        {
+            printf("BAD STATS FILE OR PERIOD (AT LEAST 0.01 s)\n");
+            return FALSE;
+        }
+        startstatslog(filename, period);
+    }
+    else if (strcmp(command, "endstatslog") == 0)
+    {
+        endstatslog();
+        printf("NOT WRITING STATS\n");
+    }
+    else if (strncmp(command, "capture ", 8) == 0)
+    {
+        startcapture(command + 8);
+    }
+    else if (strcmp(command, "endcapture") == 0)
+    {
+        endcapture();
+        printf("NOT CAPTURING\n");
+    }
+    else if (strcmp(command, "quit") == 0)
+    {
+        printf("END OF THE PROGRAM\n");
+        return TRUE;
+    }
+    else if (strncmp(command, "link ", 5) == 0)
+    {
+        int link = atoi(command + 5);
+        if (link < 1 || link > numLinks)
+        {
+            printf("BAD LINK: must be between 1 and %d\n", numLinks);
+            return FALSE;
+        }
+        commandLink = link - 1;
+        par = &links[commandLink];
+        printf("COMMANDS APPLY TO LINK %d\n", link);
+    }
+    else if (strcmp(command, "help") == 0) {
+        help();
+    }
+    else {
+        printf("BAD COMMAND OR MISSING PARAMETERS\n");
+    }
+    return FALSE;
+}
+
+
+int main(int argc, char *argv[])
+{
+    // Settings given by options, applied as commands once the cable is set up
+    const char *seedOption = NULL, *baudOption = NULL, *propOption = NULL, *berOption = NULL, *logOption = NULL;
+    const char *captureOption = NULL, *recordOption = NULL, *replayOption = NULL;
+    const char *scenarioFile = NULL;
+    const char *decodeFile = NULL, *pcapFile = NULL;
+    int numRx = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:k:b:c:d:e:l:p:r:s:t:w:x:")) != -1)
+    {
+        if (opt == 'n' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_RX)
+        {
+            numRx = atoi(optarg);
+        }
+        else if (opt == 'k' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_LINKS)
+        {
+            numLinks = atoi(optarg);
+        }
+        else if (opt == 's')
+        {
+            scenarioFile = optarg;
+        }
+        else if (opt == 'b')
+        {
+            baudOption = optarg;
+        }
+        else if (opt == 'd')
+        {
+            propOption = optarg;
+        }
+        else if (opt == 'e')
+        {
+            berOption = optarg;
+        }
+        else if (opt == 'l')
+        {
+            logOption = optarg;
+        }
+        else if (opt == 'r')
+        {
+            seedOption = optarg;
+        }
+        else if (opt == 'c')
+        {
+            captureOption = optarg;
+        }
+        else if (opt == 't')
+        {
+            recordOption = optarg;
+        }
+        else if (opt == 'p')
+        {
+            replayOption = optarg;
+        }
+        else if (opt == 'x')
+        {
+            decodeFile = optarg;
+        }
+        else if (opt == 'w')
+        {
+            pcapFile = optarg;
+        }
+        else
+        {
+            printf("Usage: %s [-n <receivers, 1-%d>] [-k <links, 1-%d>] [-b <baud rate>]\n"
+                   "       [-d <propagation delay>] [-e <ber>] [-l <log file>] [-c <capture file>]\n"
+                   "       [-r <seed>] [-s <scenario file>] [-t <trace to record>] [-p <trace to replay>]\n"
+                   "       %s -x <capture file> [-w <pcap file>]\n", argv[0], MAX_RX, MAX_LINKS, argv[0]);
+            exit(-1);
+        }
+    }
+    if (decodeFile != NULL)
+    {
+        exit(decode_capture(decodeFile, pcapFile) == 0 ? 0 : -1);
+    }
+    if (scenarioFile != NULL && load_scenario(scenarioFile) != 0)
+    {
+        exit(-1);
+    }
+
+    char port[32], emulator[32], command[160];
+    for (int link = 0; link < numLinks; link++)
+    {
+        links[link].cableOn = TRUE;
+        links[link].numRx = numRx;
+        for (int i = 0; i <= numRx; i++)
+        {
+            printf("\n");
+            if (i == 0)
+            {
+                tx_port_names(link, port, emulator);
+            }
+            else
+            {
+                rx_port_names(link, i - 1, port, emulator);
+            }
+            sprintf(command, "socat -dd PTY,link=%s,mode=777,raw,echo=0 PTY,link=%s,mode=777,raw,echo=0 &",
+                    port, emulator);
+            system(command);
+            sleep(1);
+        }
+    }
+
+    help();
+
+    // Configure serial ports, and wait for input on any of them (and stdin)
+    // with a single epoll set
+    struct termios oldtioTx[MAX_LINKS];
+    struct termios newtioTx;
+    struct termios oldtioRx[MAX_LINKS][MAX_RX];
+    struct termios newtioRx;
+
+    int epollFd = epoll_create1(0);
+    struct epoll_event event = { .events = EPOLLIN };
+    for (int link = 0; link < numLinks; link++)
+    {
+        par = &links[link];
+        tx_port_names(link, port, emulator);
+        par->fdTx = openSerialPort(emulator, &oldtioTx[link], &newtioTx);
+
+        if (par->fdTx < 0)
+        {
+            perror("Opening Tx emulator serial port");
+            exit(-1);
+        }
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, par->fdTx, &event);
+
+        for (int i = 0; i < par->numRx; i++)
+        {
+            rx_port_names(link, i, port, emulator);
+            par->fdRx[i] = openSerialPort(emulator, &oldtioRx[link][i], &newtioRx);
+
+            if (par->fdRx[i] < 0)
+            {
+                perror("Opening Rx emulator serial port");
+                exit(-1);
+            }
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, par->fdRx[i], &event);
+        }
+    }
+
+    // Configure stdin to receive commands to this program
+    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
+    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+    // Fails if stdin is a file, which is read up to its end anyway
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &event);
+
+    char rxStdin[BUF_SIZE] = {0};
+    int stdinLength = 0;
+    int stdinOpen = TRUE;
+
+    int STOP = FALSE;
+
+    // A different seed every run and link, unless given: print it so the run
+    // can be repeated
+    unsigned long long seed = (unsigned long long) time(NULL) * 1000003 ^ getpid();
+    if (seedOption != NULL)
+    {
+        seed = strtoull(seedOption, NULL, 10);
+    }
+    char setting[BUF_SIZE + 8];
+    for (int link = 0; link < numLinks; link++)
+    {
+        par = &links[link];
+        if (numLinks > 1)
+        {
+            printf("\nLINK %d\n", link + 1);
+        }
+        set_baud_rate(TX2RX, DEFAULT_BAUDRATE);
+        set_baud_rate(RX2TX, DEFAULT_BAUDRATE);
+        reset_stats();
+        snprintf(setting, sizeof(setting), "seed %llu", seed + link);
+        run_command(setting);
+
+        // The baud rate goes first: the propagation delay depends on it.
+        // Files are per link: link k (but the first) gets <file>.<k>
+        const char *names[] = { "baud", "prop", "ber", "log", "capture", "record", "replay" };
+        const char *values[] = { baudOption, propOption, berOption, logOption, captureOption,
+                                 recordOption, replayOption };
+        for (int i = 0; i < 7; i++)
+        {
+            if (values[i] == NULL)
+            {
+                continue;
+            }
+            if (i < 3 || link == 0)
+            {
+                snprintf(setting, sizeof(setting), "%s %s", names[i], values[i]);
+            }
+            else
+            {
+                snprintf(setting, sizeof(setting), "%s %s.%d", names[i], values[i], link + 1);
+            }
+            run_command(setting);
+        }
+    }
+    par = &links[commandLink];
+
+    set_rt_priority();
+
+    printf("\nCable ready\n\n");
+
+    // Bytes are moved once per quantum, as many byte slots as elapsed since
+    // the last batch: the schedule of the slots doesn't drift with wakeup
+    // delays. While the ports are drained, the cable waits for input instead,
+    // so that the first byte of a burst doesn't wait for the quantum to end.
+    // Each direction of each link has slots of its own, at its own baud rate.
+    struct timespec currentTime, timeDiff, nextWake;
+    const struct timespec quantum = { .tv_sec = 0, .tv_nsec = QUANTUM_NSEC };
+    int unreliableRate = FALSE;
+    int drained[MAX_LINKS][2] = {{ FALSE }};
+    int pending[MAX_LINKS][2];
+    clock_gettime(CLOCK_MONOTONIC, &currentTime);
+    for (int link = 0; link < numLinks; link++)
+    {
+        links[link].direction[TX2RX].nextSlotTime = currentTime;
+        links[link].direction[RX2TX].nextSlotTime = currentTime;
+    }
+
+    while (STOP == FALSE)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &currentTime);
+
+        int behind = FALSE;
+        for (int link = 0; link < numLinks; link++)
+        {
+            par = &links[link];
+            if (!scenario.started && scenario.count > 0 &&
+                (pending_bytes(TX2RX, par->fdTx, par->fdRx) > 0 || pending_bytes(RX2TX, par->fdTx, par->fdRx) > 0))
+            {
+                scenario.started = TRUE;
+                scenario.start = currentTime;
+                printf("SCENARIO STARTED\n");
+            }
+
+            for (int d = TX2RX; d <= RX2TX; d++)
+            {
+                struct Direction *way = &par->direction[d];
+                long long late = timespec_nsec(&currentTime) - timespec_nsec(&way->nextSlotTime);
+                int slots = late < 0 ? 0 : late / way->byteDelay.tv_nsec + 1;
+                slots = slots < MAX_BATCH ? slots : MAX_BATCH;
+                way->nextSlotTime = timespec_after(&way->nextSlotTime, (long long) slots * way->byteDelay.tv_nsec);
+                timeDiff = timespec_diff(&currentTime, &way->nextSlotTime);
+                if (timeDiff.tv_sec >= 1)
+                {
+                    if (unreliableRate == FALSE)
+                    {
+                        printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
+                               "No further warnings will be issued\n");
+                        unreliableRate = TRUE;
+                    }
+                }
+
+                if (slots > 0)
+                {
+                    // Bytes found after an idle wait just arrived: they take the
+                    // current slot, not the ones that went by meanwhile
+                    move_bytes(d, par->fdTx, par->fdRx, slots, drained[link][d] ? slots - 1 : 0);
+                }
+                pending[link][d] = pending_bytes(d, par->fdTx, par->fdRx);
+                drained[link][d] = pending[link][d] == 0;
+                behind |= slots == MAX_BATCH;
+            }
+            write_stats(&currentTime);
+        }
+        par = &links[commandLink];
+
+        // Read commands from STDIN to control the cable mode, one per line
+        if (stdinOpen)
+        {
+            int fromStdin = read(STDIN_FILENO, rxStdin + stdinLength, BUF_SIZE - 1 - stdinLength);
+            if (fromStdin == 0)
+            {
+                stdinOpen = FALSE;  // Running unattended
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            }
+            stdinLength += fromStdin > 0 ? fromStdin : 0;
+            rxStdin[stdinLength] = '\0';
+            char *line = rxStdin, *newline;
+            while (STOP == FALSE && (newline = strchr(line, '\n')) != NULL)
+            {
+                *newline = '\0';
+                STOP = run_command(line);
+                line = newline + 1;
+            }
+            stdinLength = strlen(line);
+            memmove(rxStdin, line, stdinLength + 1);
+            if (stdinLength == BUF_SIZE - 1)
+            {
+                stdinLength = 0;  // Line too long, drop it
+            }
+        }
+
+        // Commands of the scenario that are due
+        while (STOP == FALSE && scenario.started && scenario.next < scenario.count)
+        {
+            struct timespec elapsed = timespec_diff(&currentTime, &scenario.start);
+            struct Event *event = &scenario.events[scenario.next];
+            if (elapsed.tv_sec * 1000000LL + elapsed.tv_nsec / 1000 < event->at)
+            {
+                break;
+            }
+            printf("t=%lld.%06lld s: %s\n", event->at / 1000000, event->at % 1000000, event->command);
+            STOP = run_command(event->command);
+            ++scenario.next;
+        }
+
+        // Sleep for a quantum, or until the slot of the last byte waiting in
+        // any direction if that is sooner, or until the next slot if that is
+        // later; a full batch means we are behind, so carry on at once
+        if (!behind)
+        {
+            nextWake = timespec_sum(&currentTime, &quantum);
+            struct timespec *firstSlot = &links[0].direction[TX2RX].nextSlotTime;
+            int allDrained = TRUE;
+            for (int link = 0; link < numLinks; link++)
+            {
+                for (int d = TX2RX; d <= RX2TX; d++)
+                {
+                    struct Direction *way = &links[link].direction[d];
+                    if (timespec_comp(&way->nextSlotTime, firstSlot) < 0)
+                    {
+                        firstSlot = &way->nextSlotTime;
+                    }
+                    struct timespec lastByteSlot =
+                        timespec_after(&way->nextSlotTime, (pending[link][d] - 1LL) * way->byteDelay.tv_nsec);
+                    if (!drained[link][d] && timespec_comp(&lastByteSlot, &nextWake) < 0)
+                    {
+                        nextWake = lastByteSlot;
+                    }
+                    allDrained &= drained[link][d];
+                }
+            }
+            if (timespec_comp(firstSlot, &nextWake) > 0)
+            {
+                nextWake = *firstSlot;
+            }
+            if (allDrained)
+            {
+                wait_for_input(epollFd, &nextWake);
+            }
+            else
+            {
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &nextWake, NULL);
+            }
+        }
+    }
+
+    for (int link = 0; link < numLinks; link++)
+    {
+        par = &links[link];
+        endlog();
+        endcapture();
+        endrecord();
+        endstatslog();
+
+        // Restore the old port settings
+        for (int i = 0; i < par->numRx; i++)
+        {
+            if (tcsetattr(par->fdRx[i], TCSANOW, &oldtioRx[link][i]) == -1)
+            {
+                perror("tcsetattr");
+                exit(-1);
+            }
+        }
+
+        if (tcsetattr(par->fdTx, TCSANOW, &oldtioTx[link]) == -1)
+        {
+            perror("tcsetattr");
+            exit(-1);
+        }
+
+        close(par->fdTx);
+        for (int i = 0; i < par->numRx; i++)
+        {
+            close(par->fdRx[i]);
+        }
+    }
+    close(epollFd);
 
     system("killall socat");
 
@@ -0,0 +1,60 @@
+// Lock-free single-producer/single-consumer queue of file chunks.
+
+#ifndef _CHUNK_QUEUE_H_
+#define _CHUNK_QUEUE_H_
+
+#include "link_layer.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Number of chunks that can be prepared ahead of the consumer (power of 2)
+#define CHUNK_QUEUE_SLOTS 64
+
+typedef enum
+{
+    ChunkData,   // The bytes are in data
+    ChunkCopy,   // The bytes come from copyFrom in another file
+    ChunkStored, // The bytes come from a chunk store, data holds the chunk id
+    ChunkHole,   // The bytes are all zero
+    ChunkIdle,   // No bytes: nothing new to send for a while (follow mode)
+} ChunkKind;
+
+typedef struct
+{
+    ChunkKind kind;
+    int64_t offset;   // Position of the bytes in the file
+    int size;         // Number of bytes, 0 on end of file, -1 on error
+    int64_t copyFrom; // ChunkCopy only
+    unsigned char data[MAX_PAYLOAD_SIZE];
+} Chunk;
+
+typedef struct
+{
+    Chunk slots[CHUNK_QUEUE_SLOTS];
+    atomic_uint head; // Next slot to be consumed (written only by the consumer)
+    atomic_uint tail; // Next slot to be produced (written only by the producer)
+} ChunkQueue;
+
+// Empty the queue. Must not be called while a producer or consumer is running.
+void chunkQueueInit(ChunkQueue *queue);
+
+// Producer: wait for a free slot and return it, to be filled in place.
+Chunk *chunkQueueAcquire(ChunkQueue *queue);
+
+// Producer: make the slot returned by chunkQueueAcquire visible to the consumer.
+void chunkQueuePublish(ChunkQueue *queue);
+
+// Consumer: wait for the oldest published chunk and return it.
+Chunk *chunkQueuePeek(ChunkQueue *queue);
+
+// Consumer: check, without waiting, whether there is nothing to consume.
+int chunkQueueIsEmpty(ChunkQueue *queue);
+
+// Consumer: give the slot returned by chunkQueuePeek back to the producer.
+void chunkQueueRelease(ChunkQueue *queue);
+
+// Producer: wait until the consumer has released every published chunk.
+void chunkQueueDrain(ChunkQueue *queue);
+
+#endif // _CHUNK_QUEUE_H_
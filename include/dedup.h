@@ -0,0 +1,48 @@
+// Content-defined chunking and chunk store header.
+// Files are cut into variable size chunks at content-defined boundaries
+// (FastCDC), so that identical regions produce identical chunks wherever
+// they are. The receiver keeps the chunks it has seen in a directory and
+// the transmitter only sends those it doesn't have.
+
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define CDC_MIN_SIZE 2048
+#define CDC_AVG_SIZE 8192
+#define CDC_MAX_SIZE 65536
+
+#define CHUNK_ID_BYTES 16
+
+typedef struct
+{
+    unsigned char bytes[CHUNK_ID_BYTES];
+} ChunkId;
+
+typedef struct
+{
+    char dir[256];
+} ChunkStore;
+
+// Length of the chunk starting at data (size bytes left in the file).
+int cdcNextChunk(const unsigned char *data, int64_t size);
+
+// Content hash identifying a chunk.
+ChunkId chunkIdOf(const unsigned char *data, int size);
+
+// Open (creating it if needed) the store kept in directory dir.
+// Returns 0 on success, -1 on error.
+int chunkStoreOpen(ChunkStore *store, const char *dir);
+
+// Returns 1 if the store holds the chunk with the given size, 0 otherwise.
+int chunkStoreHas(const ChunkStore *store, const ChunkId *id, int size);
+
+// Open a stored chunk for reading. Returns NULL if it isn't stored.
+FILE *chunkStoreRead(const ChunkStore *store, const ChunkId *id);
+
+// Add a chunk to the store. Returns 0 on success, -1 on error.
+int chunkStorePut(const ChunkStore *store, const ChunkId *id, const unsigned char *data, int size);
+
+#endif // _DEDUP_H_
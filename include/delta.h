@@ -0,0 +1,67 @@
+// Rsync-style delta encoding header.
+// The receiver describes its copy of a file with one signature (weak rolling
+// checksum + strong hash) per block; the transmitter then expresses its file
+// as literal runs and copies of those blocks.
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint32_t weak;
+    uint64_t strong;
+} BlockSignature;
+
+typedef struct
+{
+    int blockSize;
+    uint32_t count;
+    uint32_t capacity;
+    BlockSignature *blocks;
+} DeltaSignatures;
+
+typedef enum
+{
+    DeltaLiteral, // length bytes of the new file, starting at src in it
+    DeltaCopy,    // length bytes of the old file, starting at src in it
+} DeltaOpType;
+
+typedef struct
+{
+    DeltaOpType type;
+    int64_t dst; // Position in the new file
+    int64_t src;
+    int64_t length;
+} DeltaOp;
+
+typedef struct
+{
+    DeltaOp *ops;
+    int count;
+    int capacity;
+    int64_t literalBytes;
+    int64_t copiedBytes;
+} DeltaScript;
+
+// Signature of one block of the old file.
+BlockSignature deltaBlockSignature(const unsigned char *block, int blockSize);
+
+// Prepare an empty signature set for the given block size.
+void deltaSignaturesInit(DeltaSignatures *sigs, int blockSize);
+
+// Append the signature of the next block of the old file.
+// Returns 0 on success, -1 on allocation failure.
+int deltaSignaturesAdd(DeltaSignatures *sigs, BlockSignature sig);
+
+void deltaSignaturesFree(DeltaSignatures *sigs);
+
+// Express data (the new file) in terms of the old file's blocks. Consecutive
+// copies are merged. Returns 0 on success, -1 on allocation failure.
+int deltaEncode(const DeltaSignatures *sigs, const unsigned char *data, int64_t size,
+                DeltaScript *script);
+
+void deltaScriptFree(DeltaScript *script);
+
+#endif // _DELTA_H_
@@ -0,0 +1,70 @@
+// Fountain (LT) code header.
+// The file is cut into numBlocks source blocks of the same size and the
+// transmitter sends an endless stream of encoded symbols, each the XOR of
+// a few source blocks chosen from its 32-bit encoding symbol id (esi), with
+// a degree drawn from the robust soliton distribution. A set of symbols
+// somewhat larger than numBlocks decodes; the excess is largest for small
+// files (a third or more with a few tens of blocks) and shrinks as
+// numBlocks grows.
+
+#ifndef _FOUNTAIN_H_
+#define _FOUNTAIN_H_
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint32_t numBlocks;
+    double *cdf;           // Cumulative degree distribution, cdf[d - 1] = P(degree <= d)
+    unsigned char *marks;  // Scratch space for picking distinct blocks
+} FountainCode;
+
+typedef struct
+{
+    unsigned char *data;  // symbolSize bytes, XOR of the blocks still unknown
+    uint32_t remaining;   // Number of unknown blocks in data
+    uint32_t indexXor;    // XOR of the indexes of those blocks
+} FountainSymbol;
+
+typedef struct
+{
+    uint32_t *symbols;
+    uint32_t count;
+    uint32_t capacity;
+} FountainList;
+
+typedef struct
+{
+    FountainCode code;
+    int symbolSize;
+    unsigned char *blocks;  // numBlocks * symbolSize decoded bytes
+    unsigned char *known;   // known[i]: block i is decoded
+    uint32_t numKnown;
+    FountainSymbol *pending; // Symbols with 2 or more unknown blocks
+    uint32_t numPending;
+    uint32_t pendingCapacity;
+    FountainList *waiting;  // waiting[i]: pending symbols that include block i
+    uint32_t *neighbours;   // Scratch space, numBlocks entries
+    uint32_t *stack;        // Blocks decoded but not yet removed from pending symbols
+} FountainDecoder;
+
+// Prepare the degree distribution for numBlocks source blocks.
+// Returns 0 on success, -1 on error.
+int fountainInit(FountainCode *code, uint32_t numBlocks);
+
+void fountainFree(FountainCode *code);
+
+// Store in neighbours the source blocks of symbol esi and return their number.
+// neighbours must have room for numBlocks entries.
+uint32_t fountainNeighbours(FountainCode *code, uint32_t esi, uint32_t *neighbours);
+
+// Returns 0 on success, -1 on error.
+int fountainDecoderInit(FountainDecoder *decoder, uint32_t numBlocks, int symbolSize);
+
+// Add the received symbol esi (symbolSize bytes of data).
+// Returns 1 once every source block is decoded, 0 otherwise.
+int fountainDecoderAdd(FountainDecoder *decoder, uint32_t esi, const unsigned char *data);
+
+void fountainDecoderFree(FountainDecoder *decoder);
+
+#endif // _FOUNTAIN_H_
@@ -0,0 +1,70 @@
+// Link layer extensions header.
+// Additions to the interface of link_layer.h, which must not be changed.
+
+#ifndef _LINK_LAYER_EXT_H_
+#define _LINK_LAYER_EXT_H_
+
+#include "link_layer.h"
+
+// Address of the UI frames meant for every receiver on a shared line
+#define LL_ADDR_BROADCAST 0xFF
+
+// Send data in buf with size bufSize in an unnumbered (UI) frame: it isn't
+// acknowledged and the sequence of I frames is left untouched. llread
+// returns the data of the UI frames it receives like that of I frames,
+// without answering them; corrupted UI frames are dropped.
+// Return number of chars written, or "-1" on error.
+int llwriteUnacked(const unsigned char *buf, int bufSize);
+
+// Check, without waiting, whether a UI frame has been received, for a side
+// that is only sending with llwriteUnacked. Partially received frames are
+// kept for the next call.
+// Return the size of its data (stored in packet), "0" if there is none yet,
+// or "-1" on error.
+int llpollUnacked(unsigned char *packet);
+
+// Queue the packet in buf with size bufSize to be sent along with the next
+// ones in a single I frame, each preceded by its 16-bit length, so that a
+// burst of small packets pays for one frame and one RR. The queue is sent
+// when the next packet doesn't fit, by llflush, and before anything else is
+// sent or read with llwrite, llwriteUnacked, llwriteTo, llread or llclose.
+// llread hands the packets of such frames out one by one.
+// Return bufSize, or the (negative) result of llwrite if sending failed.
+int llwriteQueued(const unsigned char *buf, int bufSize);
+
+// Send the packets queued by llwriteQueued (as a plain I frame if there is
+// only one).
+// Return the number of packets sent, or the (negative) result of llwrite.
+int llflush();
+
+// Open the serial port for a shared (multi-drop) line, where several
+// receivers listen to one transmitter: no SET/UA handshake, and only UI
+// frames are exchanged. A receiver only gets the frames sent to address or
+// to LL_ADDR_BROADCAST, and its own frames carry address; the transmitter
+// gets every frame, and its own llwriteUnacked frames are broadcast.
+// Return "1" on success or "-1" on error.
+int llopenShared(LinkLayer connectionParameters, unsigned char address);
+
+// Send data in buf with size bufSize in a UI frame with the given address.
+// Return number of chars written, or "-1" on error.
+int llwriteTo(unsigned char address, const unsigned char *buf, int bufSize);
+
+// Wait up to timeoutMs milliseconds for a UI frame, storing its address.
+// On a link opened by llopen, a repeated SET is answered with UA and a DISC
+// closes the link like llread does.
+// Return the size of its data (stored in packet), "0" on timeout, "-2" once
+// the link was closed by the other side, or "-1" on error.
+int llreadUnacked(unsigned char *packet, unsigned char *address, int timeoutMs);
+
+// Set a check that llread runs on the data of each I frame (each packet of
+// an aggregated frame) before acknowledging it. A frame whose data the check
+// rejects, by returning "0", is answered with REJ like one with a wrong BCC2,
+// so that it is sent again: a byte lost on the line may leave the BCC2
+// right. NULL, the default, accepts everything.
+void llsetDataCheck(int (*check)(const unsigned char *data, int size));
+
+// Close a port opened by llopenShared.
+// Return "1" on success or "-1" on error.
+int llcloseShared(int showStatistics);
+
+#endif // _LINK_LAYER_EXT_H_
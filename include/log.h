@@ -0,0 +1,60 @@
+// Logging header.
+// Messages are formatted into a lock-free in-memory ring and written to the
+// console by a background thread, so logging costs no terminal I/O on the
+// caller's path.
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdio.h>
+
+typedef enum
+{
+    LogTrace, // Every byte and state machine transition
+    LogDebug, // Every frame and packet
+    LogInfo,
+    LogWarn,
+    LogError,
+    LogOff,
+} LogLevel;
+
+// Messages below this level are removed at compile time.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LogTrace
+#endif
+
+// Messages below this level are discarded at run time. Set from the
+// FTA_LOG_LEVEL environment variable (trace, debug, info, warn, error, off)
+// by logInit; defaults to info.
+extern LogLevel logLevel;
+
+#define LOG(level, ...)                                               \
+    do                                                                \
+    {                                                                 \
+        if ((level) >= LOG_COMPILE_LEVEL && (level) >= logLevel)      \
+            logWrite(level, __VA_ARGS__);                             \
+    } while (0)
+
+#define LOG_TRACE(...) LOG(LogTrace, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG(LogDebug, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LogInfo, __VA_ARGS__)
+#define LOG_WARN(...) LOG(LogWarn, __VA_ARGS__)
+#define LOG_ERROR(...) LOG(LogError, __VA_ARGS__)
+
+// Read the run time level and start the flusher thread. Pending messages are
+// flushed on exit. Messages logged before this call are printed directly.
+void logInit();
+
+// Format a message (printf style) into the ring. Never blocks: if the ring is
+// full the message is dropped and counted.
+void logWrite(LogLevel level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Write out every pending message and stop the flusher thread.
+void logShutdown();
+
+// Send the messages to stream instead of stdout (e.g. when stdout carries
+// data).
+void logSetOutput(FILE *stream);
+
+#endif // _LOG_H_
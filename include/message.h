@@ -0,0 +1,58 @@
+// Message (request/response) layer header.
+// Short messages exchanged over a link kept open by llopen, for status polls
+// and the like: every message is a single UI frame, so an exchange costs one
+// frame each way and no RR. A response carries the id of its request and
+// acknowledges it. The client sends a request again when its response doesn't
+// come, and the server answers a repeated request from a copy of its last
+// response instead of handling it twice; a request with a new id
+// acknowledges the previous response.
+
+#ifndef _MESSAGE_H_
+#define _MESSAGE_H_
+
+#include "link_layer.h"
+
+#include <stdint.h>
+
+#define MSG_HEADER_BYTES 3
+#define MSG_MAX_SIZE (MAX_PAYLOAD_SIZE - MSG_HEADER_BYTES)
+
+typedef struct
+{
+    uint16_t nextId;
+    int timeoutMs;    // Longest wait before sending a request again
+    int tries;
+    int64_t srttUs;   // Smoothed round trip time, 0 until measured
+    int64_t rttvarUs; // Its mean deviation
+} MsgClient;
+
+typedef struct
+{
+    int hasLast;
+    uint16_t lastId;                      // Last request answered...
+    unsigned char last[MAX_PAYLOAD_SIZE]; // ...and the response message sent
+    int lastSize;
+} MsgServer;
+
+// The client waits for a response about as long as the round trips measured
+// so far suggest (doubling on every try), and timeoutMs on the last try.
+void msgClientInit(MsgClient *client, int timeoutMs, int tries);
+
+// Send a request of size bytes and wait for its response, stored in response
+// (room for MSG_MAX_SIZE bytes).
+// Returns the size of the response, "-2" if it didn't come after every try,
+// or "-1" on error.
+int msgRequest(MsgClient *client, const unsigned char *request, int size, unsigned char *response);
+
+void msgServerInit(MsgServer *server);
+
+// Wait for the next new request, answering repeated ones on the way.
+// Returns its size (stored in request, with its id in id), "-2" once the
+// client closed the link, or "-1" on error.
+int msgReceive(MsgServer *server, unsigned char *request, uint16_t *id);
+
+// Answer request id with size bytes of response.
+// Returns "0" on success or "-1" on error.
+int msgRespond(MsgServer *server, uint16_t id, const unsigned char *response, int size);
+
+#endif // _MESSAGE_H_
@@ -0,0 +1,43 @@
+// Weighted packet scheduler header.
+// Deficit round robin between logical channels: each turn a channel may
+// send up to weight * quantum bytes (carrying over what it didn't use), so
+// over time every busy channel gets a share of the link proportional to its
+// weight, whatever the size of its packets.
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <stdint.h>
+
+#define SCHEDULER_MAX_CHANNELS 16
+
+typedef struct
+{
+    int weight;
+    int64_t deficit; // Bytes the channel may still send in its turn
+    int active;      // The channel has something to send
+} SchedulerChannel;
+
+typedef struct
+{
+    SchedulerChannel channels[SCHEDULER_MAX_CHANNELS];
+    int numChannels;
+    int current; // Channel whose turn it is
+    int quantum; // Bytes per turn and unit of weight
+} Scheduler;
+
+void schedulerInit(Scheduler *scheduler, int quantum);
+
+// Add an active channel. Returns its number, or -1 if there are too many.
+int schedulerAddChannel(Scheduler *scheduler, int weight);
+
+// Mark a channel as having nothing more to send (or something again).
+void schedulerSetActive(Scheduler *scheduler, int channel, int active);
+
+// Returns the channel that should send the next packet, or -1 if none is active.
+int schedulerNext(Scheduler *scheduler);
+
+// Account for a packet of the given size sent by channel.
+void schedulerCharge(Scheduler *scheduler, int channel, int size);
+
+#endif // _SCHEDULER_H_
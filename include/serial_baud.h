@@ -0,0 +1,15 @@
+// Serial port rates beyond the termios constants.
+// Linux only: the rate is set through termios2 (BOTHER), whose header clashes
+// with <termios.h>, hence a module of its own.
+
+#ifndef _SERIAL_BAUD_H_
+#define _SERIAL_BAUD_H_
+
+#define MAX_BAUD_RATE 4000000
+
+// Set any rate (up to MAX_BAUD_RATE) on the open serial port fd, input and
+// output alike.
+// Returns "0" on success or "-1" on error.
+int setArbitraryBaudRate(int fd, int baudRate);
+
+#endif // _SERIAL_BAUD_H_
@@ -0,0 +1,27 @@
+// XXH64 streaming hash header.
+
+#ifndef _XXHASH64_H_
+#define _XXHASH64_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+    uint64_t totalLength;
+    uint64_t v[4];
+    unsigned char mem[32]; // Input not yet consumed by a full 32 byte stripe
+    unsigned int memSize;
+    uint64_t seed;
+} Xxh64State;
+
+// Reset the hash state, using the given seed.
+void xxh64Reset(Xxh64State *state, uint64_t seed);
+
+// Feed size bytes of data into the hash.
+void xxh64Update(Xxh64State *state, const void *data, size_t size);
+
+// Return the hash of all data fed so far (the state is left unchanged).
+uint64_t xxh64Digest(const Xxh64State *state);
+
+#endif // _XXHASH64_H_
@@ -1,161 +1,2706 @@
 // Application layer protocol implementation
 
+#define _GNU_SOURCE // fallocate
+
 #include "application_layer.h"
+#include "chunk_queue.h"
+#include "dedup.h"
+#include "delta.h"
+#include "fountain.h"
 #include "link_layer.h"
+#include "link_layer_ext.h"
+#include "log.h"
+#include "message.h"
+#include "scheduler.h"
+#include "xxhash64.h"
 
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <stdio_ext.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #define MIN(x,y) ((x)<(y)?(x):(y))
+#define MAX(x,y) ((x)>(y)?(x):(y))
 
 #define SLEEP_AMOUNT 0
 #define SEND_BUFFER_SIZE 16
 // do not change the num header bytes should be 4
 #define NUM_HEADER_BYTES 4
 #define RECEIVE_BUFFER_SIZE 2048
-unsigned char buf[SEND_BUFFER_SIZE];
+// packet types (C field)
+#define PACKET_START 1
+#define PACKET_DATA 2 // 8-bit sequence number, 16-bit length
+#define PACKET_END 3
+#define PACKET_DATA_OFFSET 4 // 64-bit file offset, 32-bit length
+#define PACKET_SIGNATURES 5 // rx -> tx: block signatures of the old file
+#define PACKET_SIGNATURES_END 6 // rx -> tx: block size and number of blocks
+#define PACKET_COPY 7 // copy a range of the old file into the new one
+#define OFFSET_HEADER_BYTES 13
+#define SIGNATURES_HEADER_BYTES 7
+#define SIGNATURE_BYTES 12 // weak (4) + strong (8)
+#define PACKET_CHUNK_LIST 8 // tx -> rx: ids and sizes of the file's chunks
+#define PACKET_CHUNK_LIST_END 9 // tx -> rx: number of chunks
+#define PACKET_CHUNK_NEED 10 // rx -> tx: bitmap of the chunks it doesn't have
+#define PACKET_CHUNK_NEED_END 11 // rx -> tx: number of chunks, number missing
+#define PACKET_HOLE 12 // 64-bit file offset, 64-bit length of zeros
+#define PACKET_KEEPALIVE 13 // no payload: the file hasn't grown (follow mode)
+#define PACKET_SYMBOL 14 // 32-bit encoding symbol id, fountain coded symbol (UI frame)
+#define PACKET_FOUNTAIN_DONE 15 // rx -> tx, UI frame: the file is decoded
+#define SYMBOL_HEADER_BYTES 5
+#define PACKET_NAK_POLL 16 // tx -> one rx: 8-bit round, report the missing blocks
+#define PACKET_NAK 17 // rx -> tx: first block, count, bitmap (bit set: missing)
+#define PACKET_NAK_END 18 // rx -> tx: round, number missing, status
+#define PACKET_MULTICAST_CLOSE 19 // tx -> every rx: the transfer is over
+#define PACKET_BLOCK 20 // tx -> every rx: 32-bit block number, 32-bit check, block data
+#define PACKET_CHANNEL 21 // 8-bit logical channel, then a packet of that channel
+#define NAK_HEADER_BYTES 7
+#define NAK_END_BYTES 7
+#define BLOCK_HEADER_BYTES 9
+#define CHANNEL_HEADER_BYTES 2
+#define COPY_PACKET_BYTES 21
+#define COPY_MAX_LENGTH (1 << 30)
+#define CHUNK_LIST_HEADER_BYTES 7
+#define CHUNK_LIST_ENTRY_BYTES (CHUNK_ID_BYTES + 4)
+#define CHUNK_NEED_HEADER_BYTES 7
+#define HOLE_PACKET_BYTES 17
+#define HOLE_MAX_LENGTH (1 << 30) // per chunk in the queues
+#define SPARSE_BLOCK_SIZE 4096 // granularity of the zero run detection
+#define DEFAULT_CHUNK_DIR ".fta-chunks"
+// delta transfers (FTA_DELTA)
+#define DELTA_DEFAULT_BLOCK_SIZE 512
+#define DELTA_MIN_BLOCK_SIZE 64
+#define DELTA_MAX_BLOCK_SIZE (1 << 20)
+// fountain transfers (FTA_FOUNTAIN)
+#define FOUNTAIN_DEFAULT_SYMBOL_SIZE 512
+#define FOUNTAIN_MIN_SYMBOL_SIZE 16
+#define FOUNTAIN_MAX_SYMBOL_SIZE (MAX_PAYLOAD_SIZE - SYMBOL_HEADER_BYTES)
+#define FOUNTAIN_MAX_OVERHEAD 8 // tx: give up after this many times the file in symbols
+#define FOUNTAIN_DONE_REPEAT_MS 1000 // rx: repeat PACKET_FOUNTAIN_DONE while symbols keep coming
+// logical channels (FTA_CHANNELS)
+#define CHANNEL_MAX_WEIGHT 100
+#define CHANNEL_PAYLOAD_SIZE (MAX_PAYLOAD_SIZE - CHANNEL_HEADER_BYTES - OFFSET_HEADER_BYTES)
+// multicast transfers (FTA_MULTICAST, FTA_ADDRESS)
+#define MULTICAST_BLOCK_SIZE 512 // unit of the NAK bitmaps
+#define MULTICAST_MAX_RECEIVERS 254
+#define MULTICAST_MAX_ROUNDS 64
+#define MULTICAST_CLOSE_REPEAT 3
+#define MULTICAST_SILENCE_FACTOR 8 // rx: the transmitter may be waiting for dead receivers
+#define NAK_STATUS_INCOMPLETE 0
+#define NAK_STATUS_VERIFIED 1
+#define NAK_STATUS_NO_START 2 // the start packet was missed
+#define PART_SUFFIX ".part"
+#define STREAM_FILENAME "-" // stdin (tx) or stdout (rx)
+// follow mode (FTA_FOLLOW)
+#define FOLLOW_DEFAULT_DELAY_MS 50
+#define FOLLOW_MAX_DELAY_MS 10000
+#define FOLLOW_POLL_MS 250 // how often a stop request is noticed while idle
+// control packet parameter types (T of the TLV)
+#define CTRL_PARAM_FILE_SIZE 0
+#define CTRL_PARAM_FILE_NAME 1
+#define CTRL_PARAM_FILE_HASH 2 // XXH64 of the whole file, end packet only
+#define CTRL_PARAM_DELTA 3 // block size, start packet only: rx should send signatures
+#define CTRL_PARAM_DEDUP 4 // no value, start packet only: a chunk list follows
+#define CTRL_PARAM_FOUNTAIN 5 // symbol size, start packet only: symbols follow
+#define CTRL_PARAM_MULTICAST 6 // block size, start packet only: NAK repair rounds follow
+#define FILE_HASH_SEED 0
 unsigned char receivedbuf[RECEIVE_BUFFER_SIZE]; // could be more
 int bytes;
 int bufindex = 0;
 int S = 0; // number of current packet
+int64_t sentOffset; // tx: file position following the last data or hole packet
 FILE *fptr;
-long filesize;
+long filesize; // -1 while unknown (tx streaming from stdin)
+int streaming = FALSE; // the file is stdin (tx) or stdout (rx): no seeking
+Xxh64State filehash; // running hash of the bytes read (tx) or written (rx)
+int64_t hashedBytes; // rx: the hash covers the file up to here...
+int hashContiguous; // ...as long as the chunks were written in order
+int64_t sequentialOffset; // rx: file position following the last data or hole packet
+int64_t writePosition; // rx: current position of fptr (writer thread)
+int64_t fileEnd; // rx: size of the file as written so far (writer thread)
+int deltaBlockSize = 0; // tx: delta transfer block size, 0 if disabled
+FILE *basis; // rx: existing copy of the file, source of PACKET_COPY
+int dedup = FALSE; // tx: send only the chunks the receiver doesn't store
+int fountainSymbolSize = 0; // tx: fountain transfer symbol size, 0 if disabled
+int multicast = FALSE; // tx: transfer to several receivers on a shared line
+int aggregate = FALSE; // pack packets sent in a burst into shared frames
+FountainDecoder decoder; // rx: fountain transfer in progress
+int decoding = FALSE; // rx: decoder is initialized
+uint32_t symbolsReceived; // rx: fountain symbols received (including useless ones)
+int fountainDone; // rx: the whole file was decoded
+int64_t lastDoneSent; // rx: when PACKET_FOUNTAIN_DONE was last sent (ms)
+const char *followPath; // tx: file to keep sending as it grows, NULL if disabled
+int followDelay; // tx: ms to wait for a partial frame to fill up
+int keepAliveInterval; // tx: ms without news before PACKET_KEEPALIVE
+volatile sig_atomic_t followStop = FALSE; // tx: SIGINT/SIGTERM ends follow mode
+
+typedef struct
+{
+    ChunkId id;
+    int64_t offset;
+    int size;
+    int missing;
+} FileChunk;
+
+FileChunk *fileChunks; // content-defined chunks of the file (dedup transfers)
+uint32_t numFileChunks;
+ChunkStore chunkStore; // rx
+ChunkQueue readAhead; // tx: chunks read from the file, waiting for llwrite
+ChunkQueue writeBehind; // rx: chunks received by llread, waiting for fwrite
+
+typedef struct
+{
+    unsigned char *pointer;
+    int size;
+} PointerIntPair;
+
+typedef struct
+{
+    int hasSize;
+    long size;
+    int hasName;
+    char name[256];
+    int hasHash;
+    uint64_t hash;
+    int deltaBlockSize;
+    int dedup;
+    int fountainSymbolSize;
+    int multicastBlockSize;
+} ControlInfo;
+
+ControlInfo startInfo; // rx: contents of the last start control packet
+
+// Extra files multiplexed with the main one, which is channel 0
+typedef struct
+{
+    char path[512];
+    FILE *file;
+    long size;          // tx
+    int64_t offset;     // tx: next byte to send
+    int started;        // tx: start packet sent
+    Xxh64State hash;    // tx: hash of the bytes sent so far
+    ControlInfo start;  // rx
+    int ignored;        // rx: its file would clash with another one
+} Channel;
+
+Channel channels[SCHEDULER_MAX_CHANNELS];
+int otherChannels = 0; // tx: channels other than 0 still sending
+Scheduler scheduler; // tx: shares the link between the channels
+char channelDir[256]; // rx: where the files of the other channels go
+const char *receivedPath = NULL; // rx: the main file, none when streaming
+int channelErrors = 0; // rx: files of other channels not received correctly
+
+void putBigEndian(unsigned char *dst, uint64_t value, int numBytes)
+{
+    for (int i = numBytes - 1; i >= 0; i--)
+    {
+        dst[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+uint64_t getBigEndian(const unsigned char *src, int numBytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < numBytes; i++)
+    {
+        value = (value << 8) | src[i];
+    }
+    return value;
+}
+
+void readFileSize()
+{
+    fseek(fptr, 0, SEEK_END);
+    filesize = ftell(fptr);
+    fseek(fptr, 0, SEEK_SET);
+}
+
+unsigned char zeros[SPARSE_BLOCK_SIZE];
+
+// True if the size bytes at data are all zero. memcmp of the buffer against
+// itself shifted by one byte runs at the speed of the vectorized libc memcmp.
+int isZero(const unsigned char *data, int size)
+{
+    return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+// Queues a block read from the file, split into data chunks.
+void splitFile(int64_t offset, const unsigned char *data, int size)
+{
+    xxh64Update(&filehash, data, size);
+    for (int done = 0; done < size;)
+    {
+        Chunk *chunk = chunkQueueAcquire(&readAhead);
+        chunk->kind = ChunkData;
+        chunk->offset = offset + done;
+        chunk->size = MIN(SEND_BUFFER_SIZE, size - done);
+        memcpy(chunk->data, data + done, chunk->size);
+        done += chunk->size;
+        chunkQueuePublish(&readAhead);
+    }
+}
+
+// Reads from a pipe until size bytes or the end of the input.
+// Returns the number of bytes read, or -1 on error.
+ssize_t readFull(int fd, unsigned char *data, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = read(fd, data + done, size - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// Queues a run of zeros (a hole or zero filled blocks) of the file.
+void queueHole(int64_t offset, int64_t length)
+{
+    for (int64_t done = 0; done < length;)
+    {
+        int size = MIN(HOLE_MAX_LENGTH, length - done);
+        for (int hashed = 0; hashed < size; hashed += SPARSE_BLOCK_SIZE)
+        {
+            xxh64Update(&filehash, zeros, MIN(SPARSE_BLOCK_SIZE, size - hashed));
+        }
+        Chunk *chunk = chunkQueueAcquire(&readAhead);
+        chunk->kind = ChunkHole;
+        chunk->offset = offset + done;
+        chunk->size = size;
+        done += size;
+        chunkQueuePublish(&readAhead);
+    }
+}
+
+void blockLinkSignals()
+{
+    // The link layer timeouts (SIGALRM) belong to the main thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+int64_t monotonicMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void stopFollowing(int signal)
+{
+    followStop = TRUE;
+}
+
+// Follow mode: waits until the file has grown past pos and returns how many
+// bytes to read there, at most SPARSE_BLOCK_SIZE. Whole frames are sent right
+// away; a partial frame waits up to followDelay for the rest of its bytes.
+// The current size of the file is stored in size.
+// Returns 0 once the file is removed, renamed, truncated or the transfer is
+// interrupted, -1 on error.
+int waitForGrowth(int fd, int64_t pos, int64_t *size)
+{
+    static int watch = -1;
+    static int rotated = FALSE;
+    if (watch < 0)
+    {
+        watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch < 0 || inotify_add_watch(watch, followPath, IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) < 0)
+        {
+            LOG_ERROR("Error watching %s\n", followPath);
+            return -1;
+        }
+    }
+
+    int64_t deadline = -1; // when the pending partial frame must be sent
+    int64_t idleSince = monotonicMs();
+    while (TRUE)
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            return -1;
+        }
+        if (st.st_size < pos)
+        {
+            LOG_WARN("%s was truncated, no longer following it\n", followPath);
+            return 0;
+        }
+        *size = st.st_size; // ends SEEK_DATA holes in readAheadThread
+        int64_t pending = st.st_size - pos;
+        int64_t now = monotonicMs();
+        if (pending >= SEND_BUFFER_SIZE)
+        {
+            return MIN(SPARSE_BLOCK_SIZE, pending - pending % SEND_BUFFER_SIZE);
+        }
+        if (pending > 0 && (rotated || followStop || (deadline >= 0 && now >= deadline)))
+        {
+            return pending;
+        }
+        if (rotated || followStop || st.st_nlink == 0)
+        {
+            LOG_INFO("No longer following %s\n", followPath);
+            return 0;
+        }
+        if (pending > 0 && deadline < 0)
+        {
+            deadline = now + followDelay;
+        }
+
+        if (pending == 0 && now - idleSince >= keepAliveInterval)
+        {
+            Chunk *chunk = chunkQueueAcquire(&readAhead);
+            chunk->kind = ChunkIdle;
+            chunk->offset = pos;
+            chunk->size = 0;
+            chunkQueuePublish(&readAhead);
+            idleSince = now;
+        }
+
+        int timeout = pending > 0 ? deadline - now : MIN(FOLLOW_POLL_MS, idleSince + keepAliveInterval - now);
+        struct pollfd waiting = {.fd = watch, .events = POLLIN};
+        if (poll(&waiting, 1, MAX(timeout, 0)) > 0)
+        {
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t length;
+            while ((length = read(watch, events, sizeof(events))) > 0)
+            {
+                for (char *p = events; p < events + length;)
+                {
+                    struct inotify_event *event = (struct inotify_event *)p;
+                    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+                    {
+                        rotated = TRUE;
+                    }
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        }
+    }
+}
+
+// Read-ahead thread: keeps the queue filled with chunks so that llwrite never
+// waits for the disk. Stops after queuing the end of file (or error) chunk.
+void *readAheadThread(void *arg)
+{
+    blockLinkSignals();
+
+    int fd = fileno(fptr);
+    unsigned char block[SPARSE_BLOCK_SIZE];
+    int64_t pos = 0;
+    int64_t end = filesize; // grows in follow mode
+    int64_t holeStart = -1; // start of the pending run of zeros, if any
+    int error = FALSE;
+    while (TRUE)
+    {
+        ssize_t n;
+        int readSize = SPARSE_BLOCK_SIZE;
+        if (followPath != NULL)
+        {
+            if (holeStart >= 0)
+            {
+                // Don't hold back a run of zeros while waiting
+                queueHole(holeStart, pos - holeStart);
+                holeStart = -1;
+            }
+            readSize = waitForGrowth(fd, pos, &end);
+            if (readSize <= 0)
+            {
+                error = readSize < 0;
+                break;
+            }
+        }
+
+        if (streaming)
+        {
+            n = readFull(fd, block, SPARSE_BLOCK_SIZE);
+        }
+        else
+        {
+            // Skip the unallocated regions of sparse files
+            off_t data = lseek(fd, pos, SEEK_DATA);
+            if (data < 0)
+            {
+                data = errno == ENXIO ? end : pos; // ENXIO: hole up to the end
+            }
+            if (data > pos)
+            {
+                if (holeStart < 0)
+                {
+                    holeStart = pos;
+                }
+                pos = data;
+            }
+
+            n = pread(fd, block, readSize, pos);
+        }
+        if (n <= 0)
+        {
+            error = n < 0;
+            break;
+        }
+
+        if (isZero(block, n))
+        {
+            if (holeStart < 0)
+            {
+                holeStart = pos;
+            }
+        }
+        else
+        {
+            if (holeStart >= 0)
+            {
+                queueHole(holeStart, pos - holeStart);
+                holeStart = -1;
+            }
+            splitFile(pos, block, n);
+        }
+        pos += n;
+    }
+    if (holeStart >= 0 && !error)
+    {
+        queueHole(holeStart, pos - holeStart);
+    }
+
+    // The offset of the end of file chunk is the size of the file
+    Chunk *chunk = chunkQueueAcquire(&readAhead);
+    chunk->kind = ChunkData;
+    chunk->offset = pos;
+    chunk->size = error ? -1 : 0;
+    chunkQueuePublish(&readAhead);
+    return NULL;
+}
+
+// Keeps the running hash of the received file, if the bytes at offset
+// continue it.
+void hashReceivedData(int64_t offset, const unsigned char *data, int size)
+{
+    if (offset == hashedBytes)
+    {
+        xxh64Update(&filehash, data, size);
+        hashedBytes += size;
+    }
+    else
+    {
+        hashContiguous = FALSE; // verifyEndPacket will hash the file instead
+    }
+}
+
+// Writes size bytes at offset of the received file, keeping the running hash.
+void writeReceivedData(int64_t offset, const unsigned char *data, int size)
+{
+    if (offset != writePosition && (streaming || fseeko(fptr, offset, SEEK_SET) != 0))
+    {
+        LOG_ERROR("Error seeking in the file (offset %lld)\n", (long long)offset);
+        exit(-1);
+    }
+    if (fwrite(data, 1, size, fptr) != size)
+    {
+        LOG_ERROR("Error writing the file\n");
+        exit(-1);
+    }
+    writePosition = offset + size;
+    fileEnd = MAX(fileEnd, writePosition);
+    hashReceivedData(offset, data, size);
+}
+
+// Makes size bytes at offset of the received file zero. Beyond the end of
+// the file nothing needs to be written: extending it leaves a hole.
+void writeReceivedHole(int64_t offset, int size)
+{
+    if (streaming)
+    {
+        // No seeking on stdout: the zeros must be written out
+        for (int done = 0; done < size; done += SPARSE_BLOCK_SIZE)
+        {
+            writeReceivedData(offset + done, zeros, MIN(SPARSE_BLOCK_SIZE, size - done));
+        }
+        return;
+    }
+
+    int64_t overlap = MIN(offset + size, fileEnd) - offset;
+    if (overlap > 0)
+    {
+        // Bytes were already written there: deallocate them, or overwrite
+        // them if the file system can't
+        fflush(fptr);
+        if (fallocate(fileno(fptr), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, overlap) != 0)
+        {
+            fseeko(fptr, offset, SEEK_SET);
+            for (int64_t done = 0; done < overlap; done += SPARSE_BLOCK_SIZE)
+            {
+                fwrite(zeros, 1, MIN(SPARSE_BLOCK_SIZE, overlap - done), fptr);
+            }
+            writePosition = offset + overlap;
+        }
+    }
+    if (offset + size > fileEnd)
+    {
+        // The file size must count it even if no data follows: a streamed
+        // transfer only gets the size in the end packet
+        fflush(fptr);
+        if (ftruncate(fileno(fptr), offset + size) != 0)
+        {
+            LOG_ERROR("Error extending the file to %lld bytes\n", (long long)(offset + size));
+            exit(-1);
+        }
+        fileEnd = offset + size;
+    }
+    for (int done = 0; done < size; done += SPARSE_BLOCK_SIZE)
+    {
+        hashReceivedData(offset + done, zeros, MIN(SPARSE_BLOCK_SIZE, size - done));
+    }
+}
+
+// Writer thread: writes the received chunks to the file so that a slow disk
+// doesn't delay the next llread. An empty chunk stops it.
+void *writeBehindThread(void *arg)
+{
+    blockLinkSignals();
+
+    while (TRUE)
+    {
+        if (chunkQueueIsEmpty(&writeBehind))
+        {
+            fflush(fptr); // nothing else to write for now: make it visible
+        }
+        Chunk *chunk = chunkQueuePeek(&writeBehind);
+        if (chunk->size == 0)
+        {
+            chunkQueueRelease(&writeBehind);
+            break;
+        }
+        if (chunk->kind == ChunkData)
+        {
+            writeReceivedData(chunk->offset, chunk->data, chunk->size);
+        }
+        else if (chunk->kind == ChunkHole)
+        {
+            writeReceivedHole(chunk->offset, chunk->size);
+        }
+        else
+        {
+            // Range of the old file (delta transfer) or a stored chunk (dedup)
+            FILE *source = basis;
+            if (chunk->kind == ChunkStored)
+            {
+                source = chunkStoreRead(&chunkStore, (const ChunkId *)chunk->data);
+            }
+            else
+            {
+                fseeko(source, chunk->copyFrom, SEEK_SET);
+            }
+
+            unsigned char block[4096];
+            int64_t done = 0;
+            while (done < chunk->size)
+            {
+                size_t n = source == NULL ? 0 : fread(block, 1, MIN(sizeof(block), chunk->size - done), source);
+                if (n == 0)
+                {
+                    LOG_ERROR("Error reading %s\n", chunk->kind == ChunkStored ? "a stored chunk" : "the old copy of the file");
+                    exit(-1);
+                }
+                writeReceivedData(chunk->offset + done, block, n);
+                done += n;
+            }
+            if (chunk->kind == ChunkStored)
+            {
+                fclose(source);
+            }
+        }
+        chunkQueueRelease(&writeBehind);
+    }
+    return NULL;
+}
+
+// Hands a received chunk over to the writer thread, waiting while the queue
+// is full (which in turn holds back the next llread and its RR).
+void queueReceivedChunk(int64_t offset, const unsigned char *data, int size)
+{
+    Chunk *chunk = chunkQueueAcquire(&writeBehind);
+    chunk->kind = ChunkData;
+    chunk->offset = offset;
+    if (size > 0)
+    {
+        memcpy(chunk->data, data, size);
+    }
+    chunk->size = size;
+    chunkQueuePublish(&writeBehind);
+}
+
+// Hands a range of the old copy of the file over to the writer thread.
+void queueCopiedChunk(int64_t offset, int64_t copyFrom, int size)
+{
+    Chunk *chunk = chunkQueueAcquire(&writeBehind);
+    chunk->kind = ChunkCopy;
+    chunk->offset = offset;
+    chunk->copyFrom = copyFrom;
+    chunk->size = size;
+    chunkQueuePublish(&writeBehind);
+}
+
+// Hands a run of zeros over to the writer thread.
+void queueHoleChunk(int64_t offset, int size)
+{
+    Chunk *chunk = chunkQueueAcquire(&writeBehind);
+    chunk->kind = ChunkHole;
+    chunk->offset = offset;
+    chunk->size = size;
+    chunkQueuePublish(&writeBehind);
+}
+
+// Hands a chunk of the chunk store over to the writer thread.
+void queueStoredChunk(const FileChunk *fileChunk)
+{
+    Chunk *chunk = chunkQueueAcquire(&writeBehind);
+    chunk->kind = ChunkStored;
+    chunk->offset = fileChunk->offset;
+    chunk->size = fileChunk->size;
+    memcpy(chunk->data, &fileChunk->id, sizeof(ChunkId));
+    chunkQueuePublish(&writeBehind);
+}
+
+// rx: waits for the writer thread and starts the file over.
+void resetReceivedFile()
+{
+    chunkQueueDrain(&writeBehind);
+    if (streaming)
+    {
+        if (writePosition > 0)
+        {
+            LOG_ERROR("Transfer restarted after %lld bytes were written to stdout\n", (long long)writePosition);
+            exit(-1);
+        }
+    }
+    else
+    {
+        rewind(fptr);
+        if (ftruncate(fileno(fptr), 0) != 0)
+        {
+            LOG_WARN("Could not truncate the received file\n");
+        }
+    }
+    writePosition = 0;
+    fileEnd = 0;
+    sequentialOffset = 0;
+    xxh64Reset(&filehash, FILE_HASH_SEED);
+    hashedBytes = 0;
+    hashContiguous = TRUE;
+}
+
+// Hashes the whole of a file opened for reading and writing.
+uint64_t hashWholeFile(FILE *file)
+{
+    Xxh64State state;
+    unsigned char block[4096];
+    size_t n;
+    xxh64Reset(&state, FILE_HASH_SEED);
+    fflush(file);
+    fseeko(file, 0, SEEK_SET);
+    while ((n = fread(block, 1, sizeof(block), file)) > 0)
+    {
+        xxh64Update(&state, block, n);
+    }
+    return xxh64Digest(&state);
+}
+
+// rx: hashes the file as written so far, when the chunks didn't arrive in
+// order and the running hash couldn't be kept. Must be called with the
+// writer thread idle.
+uint64_t hashReceivedFile()
+{
+    uint64_t hash = hashWholeFile(fptr);
+    fseeko(fptr, writePosition, SEEK_SET);
+    return hash;
+}
+
+// Data packet with the 64-bit offset of its chunk, for chunks that don't
+// follow the previous data.
+PointerIntPair createOffsetDataPacket(const Chunk *chunk)
+{
+    LOG_DEBUG("data packet: offset %lld\n", (long long)chunk->offset);
+    unsigned char *datapacket = (unsigned char *)malloc((chunk->size + OFFSET_HEADER_BYTES) * sizeof(unsigned char));
+    datapacket[0] = PACKET_DATA_OFFSET;
+    putBigEndian(&datapacket[1], chunk->offset, 8);
+    putBigEndian(&datapacket[9], chunk->size, 4);
+    memcpy(&datapacket[OFFSET_HEADER_BYTES], chunk->data, chunk->size);
+    sentOffset = chunk->offset + chunk->size;
+
+    PointerIntPair result;
+    result.pointer = datapacket;
+    result.size = OFFSET_HEADER_BYTES + chunk->size;
+    return result;
+}
+
+// Chunks that continue where the previous data or hole packet left off are
+// sent in the compact, sequence numbered packet; the others need the offset.
+PointerIntPair createDataPacket(const Chunk *chunk) // returns data packet
+{
+    if (chunk->offset != sentOffset || chunk->size > SEND_BUFFER_SIZE)
+    {
+        return createOffsetDataPacket(chunk);
+    }
+    S++;
+    LOG_DEBUG("packet number: %d (as a byte:%d)\n", S, S % 256);
+    unsigned char *datapacket = (unsigned char *)malloc((chunk->size + NUM_HEADER_BYTES) * sizeof(unsigned char));
+    datapacket[0] = PACKET_DATA;
+    datapacket[1] = S;
+    datapacket[2] = chunk->size / 256; // L2
+    datapacket[3] = chunk->size % 256; // L1
+    memcpy(&datapacket[NUM_HEADER_BYTES], chunk->data, chunk->size);
+    sentOffset += chunk->size;
+
+    PointerIntPair result;
+    result.pointer = datapacket;
+    result.size = NUM_HEADER_BYTES + chunk->size;
+    return result;
+}
+
+// Appends a TLV parameter at idx of a control packet.
+// Returns the index following it.
+int appendControlParameter(unsigned char *controlpacket, int idx, unsigned char type, uint64_t value, unsigned char length)
+{
+    controlpacket[idx] = type;
+    controlpacket[idx + 1] = length;
+    putBigEndian(&controlpacket[idx + 2], value, length);
+    return idx + 2 + length;
+}
+
+PointerIntPair createKeepAlivePacket()
+{
+    LOG_DEBUG("keepalive\n");
+    PointerIntPair result;
+    result.pointer = (unsigned char *)malloc(1);
+    result.pointer[0] = PACKET_KEEPALIVE;
+    result.size = 1;
+    return result;
+}
+
+PointerIntPair createHolePacket(const Chunk *chunk)
+{
+    LOG_DEBUG("hole: offset %lld, %d bytes\n", (long long)chunk->offset, chunk->size);
+    PointerIntPair result;
+    result.pointer = (unsigned char *)malloc(HOLE_PACKET_BYTES);
+    result.pointer[0] = PACKET_HOLE;
+    putBigEndian(&result.pointer[1], chunk->offset, 8);
+    putBigEndian(&result.pointer[9], chunk->size, 8);
+    sentOffset = chunk->offset + chunk->size;
+    result.size = HOLE_PACKET_BYTES;
+    return result;
+}
+
+PointerIntPair createControlPacket(int option, const char *filename) // option is 0 for start packet 1 for end packet
+{
+    unsigned char lenfilename = (unsigned char)strlen(filename);
+    // file size and name, plus room for the optional parameters
+    unsigned char *controlpacket = (unsigned char *)malloc((13 + lenfilename + 32) * sizeof(unsigned char));
+    if (option == 0) // start control packet
+    {
+        controlpacket[0] = PACKET_START;
+        sentOffset = 0; // the receiver starts the file over
+    }
+    else
+        controlpacket[0] = PACKET_END;
+
+    // bytes of length (filesize): 8, left out while unknown
+    int idx = 1;
+    if (filesize >= 0)
+    {
+        idx = appendControlParameter(controlpacket, idx, CTRL_PARAM_FILE_SIZE, filesize, 8);
+    }
+    controlpacket[idx] = CTRL_PARAM_FILE_NAME;
+    controlpacket[idx + 1] = lenfilename;
+    memcpy(&controlpacket[idx + 2], filename, lenfilename);
+    idx += 2 + lenfilename;
+
+    if (option == 0 && deltaBlockSize > 0)
+    {
+        idx = appendControlParameter(controlpacket, idx, CTRL_PARAM_DELTA, deltaBlockSize, 4);
+    }
+
+    if (option == 0 && dedup)
+    {
+        idx = appendControlParameter(controlpacket, idx, CTRL_PARAM_DEDUP, 0, 0);
+    }
+
+    if (option == 0 && fountainSymbolSize > 0)
+    {
+        idx = appendControlParameter(controlpacket, idx, CTRL_PARAM_FOUNTAIN, fountainSymbolSize, 4);
+    }
+
+    if (option == 0 && multicast)
+    {
+        idx = appendControlParameter(controlpacket, idx, CTRL_PARAM_MULTICAST, MULTICAST_BLOCK_SIZE, 4);
+    }
+
+    if (option == 1) // the hash is only known once the whole file was read
+    {
+        idx = appendControlParameter(controlpacket, idx, CTRL_PARAM_FILE_HASH, xxh64Digest(&filehash), 8);
+    }
+
+    PointerIntPair result;
+    result.pointer = controlpacket;
+    result.size = idx;
+
+    return result;
+}
+
+// Reads the TLV parameters of a start or end control packet into info.
+// Unknown parameter types are skipped.
+void parseControlPacket(const unsigned char *packet, int size, ControlInfo *info)
+{
+    memset(info, 0, sizeof(*info));
+    int idx = 1;
+    while (idx + 2 <= size)
+    {
+        unsigned char type = packet[idx];
+        unsigned char length = packet[idx + 1];
+        const unsigned char *value = &packet[idx + 2];
+        if (idx + 2 + length > size)
+        {
+            LOG_WARN("Truncated control packet parameter (type %u)\n", type);
+            break;
+        }
+
+        if (type == CTRL_PARAM_FILE_SIZE)
+        {
+            info->hasSize = TRUE;
+            info->size = 0;
+            for (int i = 0; i < length; i++)
+            {
+                info->size = (info->size << 8) | value[i];
+            }
+        }
+        else if (type == CTRL_PARAM_FILE_NAME)
+        {
+            info->hasName = TRUE;
+            memcpy(info->name, value, length);
+            info->name[length] = '\0';
+        }
+        else if (type == CTRL_PARAM_DELTA && length == 4)
+        {
+            info->deltaBlockSize = getBigEndian(value, 4);
+        }
+        else if (type == CTRL_PARAM_DEDUP)
+        {
+            info->dedup = TRUE;
+        }
+        else if (type == CTRL_PARAM_FOUNTAIN && length == 4)
+        {
+            info->fountainSymbolSize = getBigEndian(value, 4);
+        }
+        else if (type == CTRL_PARAM_MULTICAST && length == 4)
+        {
+            info->multicastBlockSize = getBigEndian(value, 4);
+        }
+        else if (type == CTRL_PARAM_FILE_HASH && length == 8)
+        {
+            info->hasHash = TRUE;
+            info->hash = 0;
+            for (int i = 0; i < 8; i++)
+            {
+                info->hash = (info->hash << 8) | value[i];
+            }
+        }
+        idx += 2 + length;
+    }
+}
+
+// Checks the end control packet against the start one and the received data.
+// Returns TRUE if everything matches.
+int verifyEndPacket(const ControlInfo *endInfo)
+{
+    int ok = TRUE;
+    if (!startInfo.hasSize)
+    {
+        // Streamed: the size is only known at the end
+        if (!endInfo->hasSize || endInfo->size != fileEnd)
+        {
+            LOG_ERROR("End packet file size (%ld) differs from the received size (%lld)\n",
+                      endInfo->size, (long long)fileEnd);
+            ok = FALSE;
+        }
+    }
+    else if (startInfo.hasSize != endInfo->hasSize || startInfo.size != endInfo->size)
+    {
+        LOG_ERROR("End packet file size (%ld) differs from the start packet (%ld)\n", endInfo->size, startInfo.size);
+        ok = FALSE;
+    }
+    if (startInfo.hasName != endInfo->hasName || strcmp(startInfo.name, endInfo->name) != 0)
+    {
+        LOG_ERROR("End packet file name differs from the start packet\n");
+        ok = FALSE;
+    }
+    if (endInfo->hasHash && !hashContiguous && streaming)
+    {
+        LOG_ERROR("Data written out of order to stdout: the file can't be verified\n");
+        ok = FALSE;
+    }
+    else if (endInfo->hasHash)
+    {
+        uint64_t hash = hashContiguous ? xxh64Digest(&filehash) : hashReceivedFile();
+        if (hash != endInfo->hash)
+        {
+            LOG_ERROR("File hash mismatch: received %016llx, sent %016llx\n",
+                   (unsigned long long)hash, (unsigned long long)endInfo->hash);
+            ok = FALSE;
+        }
+        else
+        {
+            LOG_INFO("File hash verified: %016llx\n", (unsigned long long)hash);
+        }
+    }
+    return ok;
+}
+
+// rx: prepares the decoder for the fountain transfer announced by the start
+// packet. Returns -1 if it can't be done.
+int startFountain()
+{
+    if (decoding)
+    {
+        fountainDecoderFree(&decoder);
+        decoding = FALSE;
+    }
+    if (!startInfo.hasSize || startInfo.fountainSymbolSize < FOUNTAIN_MIN_SYMBOL_SIZE ||
+        startInfo.fountainSymbolSize > FOUNTAIN_MAX_SYMBOL_SIZE)
+    {
+        LOG_ERROR("Unsupported fountain transfer (symbol size %d)\n", startInfo.fountainSymbolSize);
+        return -1;
+    }
+
+    uint32_t numBlocks = (startInfo.size + startInfo.fountainSymbolSize - 1) / startInfo.fountainSymbolSize;
+    symbolsReceived = 0;
+    fountainDone = numBlocks == 0;
+    if (numBlocks > 0)
+    {
+        if (fountainDecoderInit(&decoder, numBlocks, startInfo.fountainSymbolSize) < 0)
+        {
+            LOG_ERROR("Out of memory for the fountain decoder (%u blocks)\n", numBlocks);
+            return -1;
+        }
+        decoding = TRUE;
+    }
+    return 0;
+}
+
+// rx: queues the decoded file for writing.
+void finishFountain()
+{
+    LOG_INFO("Fountain: %u blocks decoded from %u symbols\n", decoder.code.numBlocks, symbolsReceived);
+    for (int64_t done = 0; done < startInfo.size;)
+    {
+        int size = MIN(MAX_PAYLOAD_SIZE, startInfo.size - done);
+        queueReceivedChunk(done, decoder.blocks + done, size);
+        done += size;
+    }
+    chunkQueueDrain(&writeBehind); // the chunks were copied from decoder.blocks
+    fountainDecoderFree(&decoder);
+    decoding = FALSE;
+    fountainDone = TRUE;
+}
+
+// rx: tells the transmitter to stop sending symbols.
+void sendFountainDone()
+{
+    unsigned char packet[1] = {PACKET_FOUNTAIN_DONE};
+    if (llwriteUnacked(packet, 1) < 0)
+    {
+        LOG_ERROR("Error sending the fountain completion\n");
+        exit(-1);
+    }
+    lastDoneSent = monotonicMs();
+}
+
+// Logical channels: FTA_CHANNELS sends extra files along with the main one,
+// each in packets tagged with its channel number (PACKET_CHANNEL). The
+// packets of every channel are interleaved by a weighted scheduler, so that
+// a small file doesn't wait for the end of a big one. The main file stays
+// on channel 0, whose packets aren't tagged.
+
+// File name part of a path.
+const char *baseName(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash == NULL ? path : slash + 1;
+}
+
+// Whether two received files would share a path, counting the temporary
+// one (PART_SUFFIX) of each.
+int samePart(const char *a, const char *b)
+{
+    size_t length = strlen(b);
+    return strcmp(a, b) == 0 || (strncmp(a, b, length) == 0 && strcmp(a + length, PART_SUFFIX) == 0);
+}
+
+// rx: whether the file of channel number would be the main file or that of
+// another channel, which it would then truncate or overwrite.
+int channelPathTaken(int number, const char *path)
+{
+    if (receivedPath != NULL && (samePart(path, receivedPath) || samePart(receivedPath, path)))
+    {
+        return TRUE;
+    }
+    for (int i = 1; i < SCHEDULER_MAX_CHANNELS; i++)
+    {
+        if (i != number && channels[i].path[0] != '\0' &&
+            (samePart(path, channels[i].path) || samePart(channels[i].path, path)))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// rx: handles a packet of one of the other channels. Their files are small
+// and written directly, without the writer thread. Returns like parsePacket.
+int parseChannelPacket(int number, const unsigned char *packet, int size)
+{
+    if (number < 1 || number >= SCHEDULER_MAX_CHANNELS || size < 1)
+    {
+        LOG_WARN("Malformed channel packet received(channel %d, size=%d)\n", number, size);
+        return -2;
+    }
+    Channel *channel = &channels[number];
+    char partname[sizeof(channel->path) + sizeof(PART_SUFFIX)];
+    sprintf(partname, "%s" PART_SUFFIX, channel->path);
+
+    if (packet[0] == PACKET_START)
+    {
+        if (channel->file != NULL)
+        {
+            fclose(channel->file); // started over
+        }
+        parseControlPacket(packet, size, &channel->start);
+        const char *name = baseName(channel->start.name);
+        if (!channel->start.hasSize || strcmp(name, "") == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        {
+            LOG_ERROR("Channel %d: bad start packet\n", number);
+            channel->file = NULL;
+            channelErrors++;
+            return -2;
+        }
+        snprintf(channel->path, sizeof(channel->path), "%s%s", channelDir, name);
+        if (channelPathTaken(number, channel->path))
+        {
+            LOG_ERROR("Channel %d: %s is already being received, ignored\n", number, channel->path);
+            channel->path[0] = '\0';
+            channel->file = NULL;
+            channel->ignored = TRUE;
+            channelErrors++;
+            return -2;
+        }
+        channel->ignored = FALSE;
+        sprintf(partname, "%s" PART_SUFFIX, channel->path);
+        channel->file = fopen(partname, "w+b");
+        if (channel->file == NULL)
+        {
+            LOG_ERROR("Error opening %s\n", partname);
+            channelErrors++;
+            return -2;
+        }
+        LOG_INFO("Channel %d: receiving %s (%ld bytes)\n", number, channel->path, channel->start.size);
+        return 2;
+    }
+
+    if (channel->file == NULL)
+    {
+        if (!channel->ignored)
+        {
+            LOG_WARN("Channel %d: packet received before the start packet\n", number);
+        }
+        return -2;
+    }
+
+    if (packet[0] == PACKET_DATA_OFFSET && size >= OFFSET_HEADER_BYTES)
+    {
+        int64_t offset = (int64_t)getBigEndian(&packet[1], 8);
+        uint32_t length = (uint32_t)getBigEndian(&packet[9], 4);
+        if (offset < 0 || length != size - OFFSET_HEADER_BYTES || offset + length > channel->start.size)
+        {
+            LOG_WARN("Channel %d: malformed data packet received\n", number);
+            return -2;
+        }
+        if (fseeko(channel->file, offset, SEEK_SET) != 0 ||
+            fwrite(&packet[OFFSET_HEADER_BYTES], 1, length, channel->file) != length)
+        {
+            LOG_ERROR("Error writing %s\n", partname);
+            exit(-1);
+        }
+        return 2;
+    }
+    else if (packet[0] == PACKET_END)
+    {
+        ControlInfo endInfo;
+        parseControlPacket(packet, size, &endInfo);
+        fseeko(channel->file, 0, SEEK_END);
+        int64_t received = ftello(channel->file);
+        uint64_t hash = hashWholeFile(channel->file);
+        fclose(channel->file);
+        channel->file = NULL;
+        if (received != channel->start.size || !endInfo.hasHash || hash != endInfo.hash)
+        {
+            LOG_ERROR("Channel %d: %s is corrupted (kept as %s)\n", number, channel->path, partname);
+            channelErrors++;
+        }
+        else if (rename(partname, channel->path) != 0)
+        {
+            LOG_ERROR("Error renaming %s to %s\n", partname, channel->path);
+            channelErrors++;
+        }
+        else
+        {
+            LOG_INFO("Channel %d: %s received, hash verified\n", number, channel->path);
+        }
+        return 2;
+    }
+
+    LOG_WARN("Channel %d: unexpected packet type %u\n", number, packet[0]);
+    return -2;
+}
+
+// rx: checked by the link layer before a frame is acknowledged. A data
+// packet whose length field doesn't match its size lost bytes on the line
+// that the BCC2 didn't catch, and must be sent again.
+int dataPacketIsWhole(const unsigned char *packet, int size)
+{
+    if (size > CHANNEL_HEADER_BYTES && packet[0] == PACKET_CHANNEL)
+    {
+        return dataPacketIsWhole(packet + CHANNEL_HEADER_BYTES, size - CHANNEL_HEADER_BYTES);
+    }
+    if (packet[0] == PACKET_DATA)
+    {
+        return size >= NUM_HEADER_BYTES && getBigEndian(&packet[2], 2) == (uint64_t)(size - NUM_HEADER_BYTES);
+    }
+    if (packet[0] == PACKET_DATA_OFFSET)
+    {
+        return size >= OFFSET_HEADER_BYTES && getBigEndian(&packet[9], 4) == (uint64_t)(size - OFFSET_HEADER_BYTES);
+    }
+    return TRUE;
+}
+
+int parsePacket(unsigned char *packet, int size)
+{
+    static unsigned char lastPacketValue = 0;
+    if (packet[0] == PACKET_START)
+    {
+        parseControlPacket(packet, size, &startInfo);
+        resetReceivedFile();
+        free(fileChunks);
+        fileChunks = NULL;
+        numFileChunks = 0;
+        if (startInfo.fountainSymbolSize > 0 && startFountain() < 0)
+        {
+            return -1;
+        }
+        return 1;
+    }
+    else if (packet[0] == PACKET_DATA)
+    {
+        unsigned char current_packet = packet[1];
+        if (size > SEND_BUFFER_SIZE + NUM_HEADER_BYTES)
+        {
+            LOG_WARN("Too large packet received(size=%u)\n",size);
+            return -2;
+        }
+
+        if ((unsigned char)current_packet != (unsigned char)(lastPacketValue + 1))
+        {
+            LOG_ERROR("Out of order(previous %u vs current %u) \n", lastPacketValue, current_packet);
+            return -1;
+        }
+
+        lastPacketValue = current_packet;
+
+        int L1 = packet[3];
+        int L2 = packet[2];
+        int length = MIN(L2 * 256 + L1, SEND_BUFFER_SIZE);
+        if (length > 0)
+        {
+            queueReceivedChunk(sequentialOffset, &packet[4], length);
+            sequentialOffset += length;
+        }
+        LOG_DEBUG("packet number: %u \n\n", packet[1]);
+        return 2;
+    }
+    else if (packet[0] == PACKET_DATA_OFFSET)
+    {
+        if (size < OFFSET_HEADER_BYTES)
+        {
+            LOG_WARN("Too short data packet received(size=%d)\n", size);
+            return -2;
+        }
+        int64_t offset = (int64_t)getBigEndian(&packet[1], 8);
+        uint32_t length = (uint32_t)getBigEndian(&packet[9], 4);
+        if (offset < 0 || length != size - OFFSET_HEADER_BYTES ||
+            (startInfo.hasSize && offset + length > startInfo.size))
+        {
+            LOG_WARN("Malformed data packet received(offset=%lld, length=%u, size=%d)\n",
+                     (long long)offset, length, size);
+            return -2;
+        }
+
+        if (length > 0)
+        {
+            queueReceivedChunk(offset, &packet[OFFSET_HEADER_BYTES], length);
+        }
+        sequentialOffset = offset + length;
+        LOG_DEBUG("data packet: offset %lld, %u bytes\n", (long long)offset, length);
+        return 2;
+    }
+    else if (packet[0] == PACKET_COPY)
+    {
+        if (size != COPY_PACKET_BYTES || basis == NULL)
+        {
+            LOG_WARN("Unexpected copy packet received(size=%d)\n", size);
+            return -2;
+        }
+        int64_t offset = (int64_t)getBigEndian(&packet[1], 8);
+        int64_t copyFrom = (int64_t)getBigEndian(&packet[9], 8);
+        uint32_t length = (uint32_t)getBigEndian(&packet[17], 4);
+        if (offset < 0 || copyFrom < 0 || length > COPY_MAX_LENGTH)
+        {
+            LOG_WARN("Malformed copy packet received\n");
+            return -2;
+        }
+        queueCopiedChunk(offset, copyFrom, length);
+        LOG_DEBUG("copy packet: offset %lld, %u bytes from %lld\n", (long long)offset, length, (long long)copyFrom);
+        return 2;
+    }
+    else if (packet[0] == PACKET_CHUNK_LIST)
+    {
+        uint32_t first = size >= CHUNK_LIST_HEADER_BYTES ? getBigEndian(&packet[1], 4) : 0;
+        int count = size >= CHUNK_LIST_HEADER_BYTES ? getBigEndian(&packet[5], 2) : 0;
+        if (!startInfo.dedup || first != numFileChunks || CHUNK_LIST_HEADER_BYTES + count * CHUNK_LIST_ENTRY_BYTES != size)
+        {
+            LOG_WARN("Unexpected chunk list packet received(size=%d)\n", size);
+            return -2;
+        }
+        fileChunks = (FileChunk *)realloc(fileChunks, (numFileChunks + count) * sizeof(FileChunk));
+        for (int i = 0; i < count; i++)
+        {
+            const unsigned char *entry = &packet[CHUNK_LIST_HEADER_BYTES + i * CHUNK_LIST_ENTRY_BYTES];
+            FileChunk *chunk = &fileChunks[numFileChunks];
+            memcpy(chunk->id.bytes, entry, CHUNK_ID_BYTES);
+            chunk->size = getBigEndian(entry + CHUNK_ID_BYTES, 4);
+            chunk->offset = numFileChunks == 0 ? 0 : chunk[-1].offset + chunk[-1].size;
+            numFileChunks++;
+        }
+        return 2;
+    }
+    else if (packet[0] == PACKET_CHUNK_LIST_END)
+    {
+        if (size != 5 || getBigEndian(&packet[1], 4) != numFileChunks)
+        {
+            LOG_ERROR("Chunk list end packet doesn't match the received list\n");
+            return -1;
+        }
+        return 5;
+    }
+    else if (packet[0] == PACKET_HOLE)
+    {
+        if (size != HOLE_PACKET_BYTES)
+        {
+            LOG_WARN("Malformed hole packet received(size=%d)\n", size);
+            return -2;
+        }
+        int64_t offset = (int64_t)getBigEndian(&packet[1], 8);
+        int64_t length = (int64_t)getBigEndian(&packet[9], 8);
+        if (offset < 0 || length < 0)
+        {
+            LOG_WARN("Malformed hole packet received\n");
+            return -2;
+        }
+        for (int64_t done = 0; done < length;)
+        {
+            int chunkSize = MIN(HOLE_MAX_LENGTH, length - done);
+            queueHoleChunk(offset + done, chunkSize);
+            done += chunkSize;
+        }
+        sequentialOffset = offset + length;
+        LOG_DEBUG("hole packet: offset %lld, %lld bytes\n", (long long)offset, (long long)length);
+        return 2;
+    }
+    else if (packet[0] == PACKET_END)
+    {
+        ControlInfo endInfo;
+        parseControlPacket(packet, size, &endInfo);
+        chunkQueueDrain(&writeBehind); // the hash must cover every queued chunk
+        return verifyEndPacket(&endInfo) ? 3 : -3;
+    }
+    else if (packet[0] == PACKET_SYMBOL)
+    {
+        if (!decoding && !fountainDone)
+        {
+            LOG_WARN("Unexpected symbol packet\n");
+            return -2;
+        }
+        if (size != SYMBOL_HEADER_BYTES + startInfo.fountainSymbolSize)
+        {
+            LOG_WARN("Symbol packet of the wrong size (%d)\n", size);
+            return -2;
+        }
+        symbolsReceived++;
+        if (fountainDone)
+        {
+            // The completion was lost, or the transmitter hasn't seen it yet
+            return monotonicMs() - lastDoneSent >= FOUNTAIN_DONE_REPEAT_MS ? 6 : 2;
+        }
+        if (fountainDecoderAdd(&decoder, getBigEndian(&packet[1], 4), &packet[SYMBOL_HEADER_BYTES]))
+        {
+            finishFountain();
+            return 6;
+        }
+        return 2;
+    }
+    else if (packet[0] == PACKET_KEEPALIVE)
+    {
+        LOG_DEBUG("keepalive packet\n");
+        return 2;
+    }
+    else if (packet[0] == PACKET_CHANNEL && size > CHANNEL_HEADER_BYTES)
+    {
+        return parseChannelPacket(packet[1], &packet[CHANNEL_HEADER_BYTES], size - CHANNEL_HEADER_BYTES);
+    }
+
+    return 4;
+}
+
+// Checks the result of llwrite, llwriteQueued or llflush. Exits on
+// unrecoverable errors.
+void checkWriteResult(int res)
+{
+    if (res == -1)
+    {
+        LOG_ERROR("Error in llwrite\n");
+        exit(-1);
+    }
+    else if (res == -2)
+    { // the dirtiest thing so far in this code :/
+        LOG_WARN("Error: unexpected RR or REJ code -> skipping to next packet\n\n");
+    }
+    else if (res == -3)
+    {
+        LOG_ERROR("Randomly dissapearing bytes error :)\n");
+        exit(-1);
+    }
+}
+
+// Sends a packet with llwrite (or queues it with llwriteQueued) and frees
+// it. Exits on unrecoverable errors.
+void sendPacket(PointerIntPair packet)
+{
+    checkWriteResult(aggregate ? llwriteQueued(packet.pointer, packet.size) : llwrite(packet.pointer, packet.size));
+    usleep(SLEEP_AMOUNT);
+    free(packet.pointer);
+}
+
+// Sends the packets queued by sendPacket, when nothing else is ready to go
+// with them. Reading or sending anything else does it too.
+void flushPackets()
+{
+    if (aggregate)
+    {
+        checkWriteResult(llflush());
+    }
+}
+
+// rx: sends the signatures of the blocks of the existing copy of the file
+// (none if there is no such file), followed by PACKET_SIGNATURES_END.
+void sendSignatures(const char *filename, int blockSize)
+{
+    basis = streaming ? NULL : fopen(filename, "rb"); // no basis when writing to stdout
+    unsigned char *block = (unsigned char *)malloc(blockSize);
+    uint32_t numBlocks = 0;
+
+    PointerIntPair packet;
+    packet.pointer = NULL;
+    while (basis != NULL && fread(block, 1, blockSize, basis) == blockSize)
+    {
+        if (packet.pointer == NULL)
+        {
+            packet.pointer = (unsigned char *)malloc(MAX_PAYLOAD_SIZE);
+            packet.pointer[0] = PACKET_SIGNATURES;
+            putBigEndian(&packet.pointer[1], numBlocks, 4);
+            packet.size = SIGNATURES_HEADER_BYTES;
+        }
+
+        BlockSignature sig = deltaBlockSignature(block, blockSize);
+        putBigEndian(&packet.pointer[packet.size], sig.weak, 4);
+        putBigEndian(&packet.pointer[packet.size + 4], sig.strong, 8);
+        packet.size += SIGNATURE_BYTES;
+        numBlocks++;
+
+        if (packet.size + SIGNATURE_BYTES > MAX_PAYLOAD_SIZE)
+        {
+            putBigEndian(&packet.pointer[5], (packet.size - SIGNATURES_HEADER_BYTES) / SIGNATURE_BYTES, 2);
+            sendPacket(packet);
+            packet.pointer = NULL;
+        }
+    }
+    if (packet.pointer != NULL)
+    {
+        putBigEndian(&packet.pointer[5], (packet.size - SIGNATURES_HEADER_BYTES) / SIGNATURE_BYTES, 2);
+        sendPacket(packet);
+    }
+    free(block);
+
+    packet.pointer = (unsigned char *)malloc(9);
+    packet.pointer[0] = PACKET_SIGNATURES_END;
+    putBigEndian(&packet.pointer[1], blockSize, 4);
+    putBigEndian(&packet.pointer[5], numBlocks, 4);
+    packet.size = 9;
+    sendPacket(packet);
+    LOG_INFO("Sent the signatures of %u blocks of %d bytes\n", numBlocks, blockSize);
+}
+
+// tx: receives the block signatures sent by sendSignatures.
+void receiveSignatures(DeltaSignatures *sigs)
+{
+    deltaSignaturesInit(sigs, deltaBlockSize);
+    while (TRUE)
+    {
+        int res = llread(receivedbuf);
+        if (res < 0)
+        {
+            LOG_ERROR("Error receiving the block signatures (%d)\n", res);
+            exit(-1);
+        }
+
+        if (receivedbuf[0] == PACKET_SIGNATURES && res >= SIGNATURES_HEADER_BYTES)
+        {
+            uint32_t first = getBigEndian(&receivedbuf[1], 4);
+            int count = getBigEndian(&receivedbuf[5], 2);
+            if (first != sigs->count || SIGNATURES_HEADER_BYTES + count * SIGNATURE_BYTES != res)
+            {
+                LOG_ERROR("Malformed signatures packet (first block %u, expected %u)\n", first, sigs->count);
+                exit(-1);
+            }
+            for (int i = 0; i < count; i++)
+            {
+                const unsigned char *entry = &receivedbuf[SIGNATURES_HEADER_BYTES + i * SIGNATURE_BYTES];
+                BlockSignature sig = {.weak = getBigEndian(entry, 4), .strong = getBigEndian(entry + 4, 8)};
+                if (deltaSignaturesAdd(sigs, sig) < 0)
+                {
+                    LOG_ERROR("Out of memory for the block signatures\n");
+                    exit(-1);
+                }
+            }
+        }
+        else if (receivedbuf[0] == PACKET_SIGNATURES_END && res == 9)
+        {
+            if (getBigEndian(&receivedbuf[1], 4) != deltaBlockSize || getBigEndian(&receivedbuf[5], 4) != sigs->count)
+            {
+                LOG_ERROR("Signatures end packet doesn't match the received signatures\n");
+                exit(-1);
+            }
+            LOG_INFO("Received the signatures of %u blocks\n", sigs->count);
+            return;
+        }
+        else
+        {
+            LOG_WARN("Unexpected packet while waiting for signatures (type %u)\n", receivedbuf[0]);
+        }
+    }
+}
+
+PointerIntPair createCopyPacket(int64_t offset, int64_t copyFrom, uint32_t length)
+{
+    PointerIntPair result;
+    result.pointer = (unsigned char *)malloc(COPY_PACKET_BYTES);
+    result.pointer[0] = PACKET_COPY;
+    putBigEndian(&result.pointer[1], offset, 8);
+    putBigEndian(&result.pointer[9], copyFrom, 8);
+    putBigEndian(&result.pointer[17], length, 4);
+    result.size = COPY_PACKET_BYTES;
+    return result;
+}
+
+// tx: maps the whole file in memory (NULL if it is empty) and hashes it.
+const unsigned char *mapFile()
+{
+    const unsigned char *data = NULL;
+    if (filesize > 0)
+    {
+        data = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fileno(fptr), 0);
+        if (data == MAP_FAILED)
+        {
+            LOG_ERROR("Error mapping the file\n");
+            exit(-1);
+        }
+        xxh64Update(&filehash, data, filesize);
+    }
+    return data;
+}
+
+void unmapFile(const unsigned char *data)
+{
+    if (data != NULL)
+    {
+        munmap((void *)data, filesize);
+    }
+}
+
+// tx: sends size bytes of data, to be written at offset, as data packets.
+void sendData(int64_t offset, const unsigned char *data, int64_t size)
+{
+    Chunk chunk;
+    for (int64_t done = 0; done < size; done += chunk.size)
+    {
+        chunk.kind = ChunkData;
+        chunk.offset = offset + done;
+        chunk.size = MIN(SEND_BUFFER_SIZE, size - done);
+        memcpy(chunk.data, data + done, chunk.size);
+        sendPacket(createDataPacket(&chunk));
+    }
+}
+
+// tx: sends the file as literal data packets and copies of the receiver's
+// blocks.
+void sendDelta()
+{
+    DeltaSignatures sigs;
+    receiveSignatures(&sigs);
+
+    const unsigned char *data = mapFile();
+
+    DeltaScript script;
+    if (deltaEncode(&sigs, data, filesize, &script) < 0)
+    {
+        LOG_ERROR("Out of memory while computing the delta\n");
+        exit(-1);
+    }
+    LOG_INFO("Delta: %lld literal bytes, %lld bytes copied from the receiver's copy\n",
+             (long long)script.literalBytes, (long long)script.copiedBytes);
+
+    for (int i = 0; i < script.count; i++)
+    {
+        const DeltaOp *op = &script.ops[i];
+        if (op->type == DeltaLiteral)
+        {
+            sendData(op->dst, data + op->src, op->length);
+            continue;
+        }
+        for (int64_t done = 0; done < op->length;)
+        {
+            uint32_t length = MIN(COPY_MAX_LENGTH, op->length - done);
+            sendPacket(createCopyPacket(op->dst + done, op->src + done, length));
+            done += length;
+        }
+    }
+
+    deltaScriptFree(&script);
+    deltaSignaturesFree(&sigs);
+    unmapFile(data);
+}
+
+// tx: sends fountain coded symbols of the file in unacknowledged frames
+// until the receiver reports that it could decode it.
+void sendFountain()
+{
+    const unsigned char *data = mapFile();
+    int symbolSize = fountainSymbolSize;
+    uint32_t numBlocks = (filesize + symbolSize - 1) / symbolSize;
+    FountainCode code;
+    uint32_t *neighbours = (uint32_t *)malloc(MAX(numBlocks, 1) * sizeof(uint32_t));
+    if (numBlocks > 0 && fountainInit(&code, numBlocks) < 0)
+    {
+        LOG_ERROR("Out of memory for the fountain encoder\n");
+        exit(-1);
+    }
+
+    unsigned char symbol[SYMBOL_HEADER_BYTES + FOUNTAIN_MAX_SYMBOL_SIZE];
+    unsigned char reply[RECEIVE_BUFFER_SIZE];
+    uint32_t esi = 0;
+    int done = numBlocks == 0;
+    while (!done && esi < (uint64_t)numBlocks * FOUNTAIN_MAX_OVERHEAD)
+    {
+        symbol[0] = PACKET_SYMBOL;
+        putBigEndian(&symbol[1], esi, 4);
+        unsigned char *payload = &symbol[SYMBOL_HEADER_BYTES];
+        memset(payload, 0, symbolSize); // the last block is padded with zeros
+        uint32_t degree = fountainNeighbours(&code, esi, neighbours);
+        for (uint32_t i = 0; i < degree; i++)
+        {
+            int64_t offset = (int64_t)neighbours[i] * symbolSize;
+            int length = MIN(symbolSize, filesize - offset);
+            for (int j = 0; j < length; j++)
+            {
+                payload[j] ^= data[offset + j];
+            }
+        }
+        if (llwriteUnacked(symbol, SYMBOL_HEADER_BYTES + symbolSize) < 0)
+        {
+            LOG_ERROR("Error in llwriteUnacked\n");
+            exit(-1);
+        }
+        esi++;
+
+        int res = llpollUnacked(reply);
+        if (res < 0)
+        {
+            LOG_ERROR("Error waiting for the fountain completion\n");
+            exit(-1);
+        }
+        done = res > 0 && reply[0] == PACKET_FOUNTAIN_DONE;
+    }
+    if (done)
+    {
+        LOG_INFO("Fountain: %u symbols sent for %u blocks\n", esi, numBlocks);
+    }
+    else
+    {
+        LOG_WARN("Fountain: no completion after %u symbols, giving up\n", esi);
+    }
+
+    if (numBlocks > 0)
+    {
+        fountainFree(&code);
+    }
+    free(neighbours);
+    unmapFile(data);
+}
+
+// tx: sends the list of the file's chunks, then only the chunks the receiver
+// reports missing from its chunk store.
+void sendDeduplicated()
+{
+    const unsigned char *data = mapFile();
+
+    // Content-defined chunking
+    uint32_t capacity = filesize / CDC_AVG_SIZE + 16;
+    fileChunks = (FileChunk *)malloc(capacity * sizeof(FileChunk));
+    numFileChunks = 0;
+    for (int64_t offset = 0; offset < filesize;)
+    {
+        if (numFileChunks == capacity)
+        {
+            capacity *= 2;
+            fileChunks = (FileChunk *)realloc(fileChunks, capacity * sizeof(FileChunk));
+        }
+        FileChunk *chunk = &fileChunks[numFileChunks++];
+        chunk->offset = offset;
+        chunk->size = cdcNextChunk(data + offset, filesize - offset);
+        chunk->id = chunkIdOf(data + offset, chunk->size);
+        chunk->missing = TRUE;
+        offset += chunk->size;
+    }
+
+    // Chunk list
+    PointerIntPair packet;
+    for (uint32_t first = 0; first < numFileChunks;)
+    {
+        int count = MIN((MAX_PAYLOAD_SIZE - CHUNK_LIST_HEADER_BYTES) / CHUNK_LIST_ENTRY_BYTES, numFileChunks - first);
+        packet.size = CHUNK_LIST_HEADER_BYTES + count * CHUNK_LIST_ENTRY_BYTES;
+        packet.pointer = (unsigned char *)malloc(packet.size);
+        packet.pointer[0] = PACKET_CHUNK_LIST;
+        putBigEndian(&packet.pointer[1], first, 4);
+        putBigEndian(&packet.pointer[5], count, 2);
+        for (int i = 0; i < count; i++)
+        {
+            unsigned char *entry = &packet.pointer[CHUNK_LIST_HEADER_BYTES + i * CHUNK_LIST_ENTRY_BYTES];
+            memcpy(entry, fileChunks[first + i].id.bytes, CHUNK_ID_BYTES);
+            putBigEndian(entry + CHUNK_ID_BYTES, fileChunks[first + i].size, 4);
+        }
+        sendPacket(packet);
+        first += count;
+    }
+    packet.pointer = (unsigned char *)malloc(5);
+    packet.pointer[0] = PACKET_CHUNK_LIST_END;
+    putBigEndian(&packet.pointer[1], numFileChunks, 4);
+    packet.size = 5;
+    sendPacket(packet);
+
+    // Bitmap of the missing chunks
+    while (TRUE)
+    {
+        int res = llread(receivedbuf);
+        if (res < 0)
+        {
+            LOG_ERROR("Error receiving the missing chunks (%d)\n", res);
+            exit(-1);
+        }
+
+        if (receivedbuf[0] == PACKET_CHUNK_NEED && res >= CHUNK_NEED_HEADER_BYTES)
+        {
+            uint32_t first = getBigEndian(&receivedbuf[1], 4);
+            int count = getBigEndian(&receivedbuf[5], 2);
+            if (first + count > numFileChunks || CHUNK_NEED_HEADER_BYTES + (count + 7) / 8 != res)
+            {
+                LOG_ERROR("Malformed missing chunks packet\n");
+                exit(-1);
+            }
+            for (int i = 0; i < count; i++)
+            {
+                fileChunks[first + i].missing = (receivedbuf[CHUNK_NEED_HEADER_BYTES + i / 8] >> (i % 8)) & 1;
+            }
+        }
+        else if (receivedbuf[0] == PACKET_CHUNK_NEED_END && res == 9)
+        {
+            LOG_INFO("Receiver has %u of %u chunks\n",
+                     numFileChunks - (uint32_t)getBigEndian(&receivedbuf[5], 4), numFileChunks);
+            break;
+        }
+        else
+        {
+            LOG_WARN("Unexpected packet while waiting for missing chunks (type %u)\n", receivedbuf[0]);
+        }
+    }
+
+    int64_t sent = 0;
+    for (uint32_t i = 0; i < numFileChunks; i++)
+    {
+        if (fileChunks[i].missing)
+        {
+            sendData(fileChunks[i].offset, data + fileChunks[i].offset, fileChunks[i].size);
+            sent += fileChunks[i].size;
+        }
+    }
+    LOG_INFO("Dedup: sent %lld of %ld bytes\n", (long long)sent, filesize);
+
+    free(fileChunks);
+    unmapFile(data);
+}
+
+// rx: rebuilds the chunks the store already has and tells the transmitter
+// which ones it must send.
+void answerChunkList()
+{
+    const char *dir = getenv("FTA_CHUNK_DIR");
+    int storeOpen = FALSE;
+    if (streaming)
+    {
+        // Stored chunks would be written out of order: request every chunk
+        LOG_WARN("Writing to stdout, not using the chunk store\n");
+    }
+    else if (chunkStoreOpen(&chunkStore, dir != NULL ? dir : DEFAULT_CHUNK_DIR) < 0)
+    {
+        LOG_WARN("Could not open the chunk store, requesting every chunk\n");
+    }
+    else
+    {
+        storeOpen = TRUE;
+    }
+
+    uint32_t missing = 0;
+    for (uint32_t i = 0; i < numFileChunks; i++)
+    {
+        fileChunks[i].missing = !storeOpen || !chunkStoreHas(&chunkStore, &fileChunks[i].id, fileChunks[i].size);
+        if (fileChunks[i].missing)
+        {
+            missing++;
+        }
+        else
+        {
+            queueStoredChunk(&fileChunks[i]);
+        }
+    }
+
+    PointerIntPair packet;
+    int perPacket = (MAX_PAYLOAD_SIZE - CHUNK_NEED_HEADER_BYTES) * 8;
+    for (uint32_t first = 0; first < numFileChunks;)
+    {
+        int count = MIN(perPacket, numFileChunks - first);
+        packet.size = CHUNK_NEED_HEADER_BYTES + (count + 7) / 8;
+        packet.pointer = (unsigned char *)calloc(packet.size, 1);
+        packet.pointer[0] = PACKET_CHUNK_NEED;
+        putBigEndian(&packet.pointer[1], first, 4);
+        putBigEndian(&packet.pointer[5], count, 2);
+        for (int i = 0; i < count; i++)
+        {
+            packet.pointer[CHUNK_NEED_HEADER_BYTES + i / 8] |= fileChunks[first + i].missing << (i % 8);
+        }
+        sendPacket(packet);
+        first += count;
+    }
+    packet.pointer = (unsigned char *)malloc(9);
+    packet.pointer[0] = PACKET_CHUNK_NEED_END;
+    putBigEndian(&packet.pointer[1], numFileChunks, 4);
+    putBigEndian(&packet.pointer[5], missing, 4);
+    packet.size = 9;
+    sendPacket(packet);
+    LOG_INFO("Dedup: %u of %u chunks found in the chunk store\n", numFileChunks - missing, numFileChunks);
+}
+
+// rx: adds the chunks that had to be transferred to the store. Must be
+// called with the writer thread idle.
+void storeNewChunks()
+{
+    unsigned char *data = (unsigned char *)malloc(CDC_MAX_SIZE);
+    for (uint32_t i = 0; i < numFileChunks; i++)
+    {
+        FileChunk *chunk = &fileChunks[i];
+        if (!chunk->missing)
+        {
+            continue;
+        }
+        fseeko(fptr, chunk->offset, SEEK_SET);
+        ChunkId id;
+        if (chunk->size > CDC_MAX_SIZE || fread(data, 1, chunk->size, fptr) != chunk->size ||
+            (id = chunkIdOf(data, chunk->size), memcmp(&id, &chunk->id, sizeof(id)) != 0) ||
+            chunkStorePut(&chunkStore, &chunk->id, data, chunk->size) < 0)
+        {
+            LOG_WARN("Could not store chunk %u\n", i);
+        }
+    }
+    free(data);
+    free(fileChunks);
+    fileChunks = NULL;
+    numFileChunks = 0;
+}
+
+// tx: opens the files listed in FTA_CHANNELS ("path[:weight],..."), each on
+// a channel of its own. The main file has weight 1.
+void openChannels(const char *list)
+{
+    schedulerInit(&scheduler, MAX_PAYLOAD_SIZE);
+    schedulerAddChannel(&scheduler, 1);
+    char copy[strlen(list) + 1];
+    strcpy(copy, list);
+    for (char *entry = strtok(copy, ","); entry != NULL; entry = strtok(NULL, ","))
+    {
+        int weight = 1;
+        char *colon = strrchr(entry, ':');
+        if (colon != NULL)
+        {
+            char *end;
+            weight = strtol(colon + 1, &end, 10);
+            if (end == colon + 1 || *end != '\0' || weight < 1 || weight > CHANNEL_MAX_WEIGHT)
+            {
+                LOG_ERROR("Bad channel weight in FTA_CHANNELS: %s\n", entry);
+                exit(-1);
+            }
+            *colon = '\0';
+        }
+        if (strlen(entry) >= sizeof(channels[0].path) || strlen(baseName(entry)) > 255)
+        {
+            LOG_ERROR("Channel file name too long: %s\n", entry);
+            exit(-1);
+        }
+
+        int number = schedulerAddChannel(&scheduler, weight);
+        if (number < 0)
+        {
+            LOG_ERROR("Too many channels (at most %d)\n", SCHEDULER_MAX_CHANNELS - 1);
+            exit(-1);
+        }
+        Channel *channel = &channels[number];
+        strcpy(channel->path, entry);
+        channel->file = fopen(entry, "rb");
+        struct stat st;
+        if (channel->file == NULL || fstat(fileno(channel->file), &st) != 0)
+        {
+            LOG_ERROR("Error opening %s\n", entry);
+            exit(-1);
+        }
+        channel->size = st.st_size;
+        xxh64Reset(&channel->hash, FILE_HASH_SEED);
+        otherChannels++;
+        LOG_INFO("Channel %d: %s (%ld bytes, weight %d)\n", number, entry, channel->size, weight);
+    }
+}
+
+PointerIntPair createChannelControlPacket(Channel *channel, int option)
+{
+    const char *name = baseName(channel->path);
+    unsigned char length = (unsigned char)strlen(name);
+    unsigned char *controlpacket = (unsigned char *)malloc(12 + length + 10);
+    controlpacket[0] = option == 0 ? PACKET_START : PACKET_END;
+    int idx = appendControlParameter(controlpacket, 1, CTRL_PARAM_FILE_SIZE, channel->size, 8);
+    controlpacket[idx] = CTRL_PARAM_FILE_NAME;
+    controlpacket[idx + 1] = length;
+    memcpy(&controlpacket[idx + 2], name, length);
+    idx += 2 + length;
+    if (option == 1)
+    {
+        idx = appendControlParameter(controlpacket, idx, CTRL_PARAM_FILE_HASH, xxh64Digest(&channel->hash), 8);
+    }
+
+    PointerIntPair result;
+    result.pointer = controlpacket;
+    result.size = idx;
+    return result;
+}
+
+// Tags a packet with its channel number. Frees the original.
+PointerIntPair createChannelPacket(int number, PointerIntPair packet)
+{
+    PointerIntPair result;
+    result.size = CHANNEL_HEADER_BYTES + packet.size;
+    result.pointer = (unsigned char *)malloc(result.size);
+    result.pointer[0] = PACKET_CHANNEL;
+    result.pointer[1] = number;
+    memcpy(&result.pointer[CHANNEL_HEADER_BYTES], packet.pointer, packet.size);
+    free(packet.pointer);
+    return result;
+}
+
+// tx: sends the next packet of a channel other than 0. Returns its size.
+int sendChannelPacket(int number)
+{
+    Channel *channel = &channels[number];
+    PointerIntPair packet;
+    if (!channel->started)
+    {
+        packet = createChannelControlPacket(channel, 0);
+        channel->started = TRUE;
+    }
+    else if (channel->offset < channel->size)
+    {
+        Chunk chunk;
+        chunk.kind = ChunkData;
+        chunk.offset = channel->offset;
+        chunk.size = fread(chunk.data, 1, MIN(CHANNEL_PAYLOAD_SIZE, channel->size - channel->offset), channel->file);
+        if (chunk.size <= 0)
+        {
+            LOG_ERROR("Error reading %s\n", channel->path);
+            exit(-1);
+        }
+        xxh64Update(&channel->hash, chunk.data, chunk.size);
+        channel->offset += chunk.size;
+        packet = createOffsetDataPacket(&chunk);
+    }
+    else
+    {
+        packet = createChannelControlPacket(channel, 1);
+        fclose(channel->file);
+        channel->file = NULL;
+        schedulerSetActive(&scheduler, number, FALSE);
+        otherChannels--;
+        LOG_INFO("Channel %d: %s sent\n", number, channel->path);
+    }
+
+    packet = createChannelPacket(number, packet);
+    int size = packet.size;
+    sendPacket(packet);
+    return size;
+}
+
+// tx: lets the other channels send until it's the main file's turn again.
+// While the main file has nothing ready (or is done), they have the link to
+// themselves.
+void serveChannels(int mainDone)
+{
+    while (otherChannels > 0)
+    {
+        schedulerSetActive(&scheduler, 0, !mainDone && !chunkQueueIsEmpty(&readAhead));
+        int number = schedulerNext(&scheduler);
+        if (number <= 0)
+        {
+            break;
+        }
+        schedulerCharge(&scheduler, number, sendChannelPacket(number));
+    }
+    schedulerSetActive(&scheduler, 0, !mainDone);
+}
+
+// tx: sends the whole file as data packets, read ahead by another thread.
+void sendFile()
+{
+    chunkQueueInit(&readAhead);
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, readAheadThread, NULL) != 0)
+    {
+        LOG_ERROR("Error starting the read-ahead thread\n");
+        exit(-1);
+    }
+
+    ChunkKind kind;
+    do
+    {
+        Chunk *chunk = chunkQueuePeek(&readAhead);
+        bytes = chunk->size;
+        kind = chunk->kind;
+        if (bytes < 0)
+        {
+            LOG_ERROR("Error reading the file\n");
+            exit(-1);
+        }
+        if (bytes == 0 && kind == ChunkData && filesize < 0)
+        {
+            filesize = chunk->offset; // end of file: sent in the end packet
+        }
+        PointerIntPair datapacket = kind == ChunkIdle ? createKeepAlivePacket()
+                                    : kind == ChunkHole ? createHolePacket(chunk)
+                                                        : createDataPacket(chunk);
+        chunkQueueRelease(&readAhead);
+        schedulerCharge(&scheduler, 0, datapacket.size);
+        sendPacket(datapacket);
+        serveChannels(FALSE);
+        if (chunkQueueIsEmpty(&readAhead))
+        {
+            flushPackets(); // don't hold the data back while the file is read
+        }
+    } while (bytes > 0 || kind == ChunkIdle);
+    pthread_join(reader, NULL);
+}
+
+// rx: opens the file being received and starts the writer thread. The file
+// is received under a temporary name, so that the old copy stays available
+// to delta transfers until the new one is complete.
+pthread_t startReceiving(const char *filename)
+{
+    // Files of the other channels go next to this one
+    int dirLength = streaming ? 0 : baseName(filename) - filename;
+    snprintf(channelDir, sizeof(channelDir), "%.*s", dirLength, filename);
+    receivedPath = streaming ? NULL : filename;
+
+    char partname[strlen(filename) + sizeof(PART_SUFFIX)];
+    sprintf(partname, "%s" PART_SUFFIX, filename);
+    fptr = streaming ? stdout : fopen(partname, "w+b"); // read back by hashReceivedFile
+    if (fptr == NULL)
+    {
+        LOG_ERROR("Error opening %s\n", partname);
+        exit(-1);
+    }
+
+    chunkQueueInit(&writeBehind);
+    resetReceivedFile();
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, writeBehindThread, NULL) != 0)
+    {
+        LOG_ERROR("Error starting the writer thread\n");
+        exit(-1);
+    }
+    return writer;
+}
+
+// rx: stops the writer thread and keeps the file under its own name if it
+// was verified. Exits on failure.
+void finishReceiving(const char *filename, pthread_t writer, int verified)
+{
+    char partname[strlen(filename) + sizeof(PART_SUFFIX)];
+    sprintf(partname, "%s" PART_SUFFIX, filename);
+    queueReceivedChunk(0, NULL, 0);
+    pthread_join(writer, NULL);
+    if (verified && startInfo.dedup && !streaming)
+    {
+        storeNewChunks();
+    }
+    // A trailing hole isn't written at all: extend the file over it
+    fflush(fptr);
+    if (streaming)
+    {
+        if (!verified)
+        {
+            LOG_ERROR("Received stream is corrupted.\n");
+            exit(-1);
+        }
+        return; // stdout is closed on exit
+    }
+    if (verified && startInfo.hasSize && startInfo.size > fileEnd &&
+        ftruncate(fileno(fptr), startInfo.size) != 0)
+    {
+        LOG_ERROR("Error extending the file to %ld bytes\n", startInfo.size);
+        verified = FALSE;
+    }
+    fclose(fptr);
+    if (basis != NULL)
+    {
+        fclose(basis);
+    }
+    if (!verified)
+    {
+        LOG_ERROR("Received file is corrupted (kept as %s).\n", partname);
+        exit(-1);
+    }
+    if (rename(partname, filename) != 0)
+    {
+        LOG_ERROR("Error renaming %s to %s\n", partname, filename);
+        exit(-1);
+    }
+}
+
+// Multicast transfers: the transmitter broadcasts the file once in UI
+// frames, then polls every receiver in turn for a bitmap of the blocks it
+// missed and broadcasts their union again, until every receiver has
+// verified the file.
+
+typedef struct
+{
+    unsigned char address;
+    int status; // NAK_STATUS_*, or -1 while unreachable
+} Receiver;
+
+// Parses a list of receiver addresses such as "1,2,5-8".
+// Returns the number of receivers, or -1 if the list is malformed.
+int parseReceivers(const char *list, Receiver *receivers)
+{
+    int count = 0;
+    while (*list != '\0')
+    {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (*end == '-')
+        {
+            last = strtol(end + 1, &end, 10);
+        }
+        if (end == list || first < 1 || last < first || last >= LL_ADDR_BROADCAST ||
+            count + (last - first + 1) > MULTICAST_MAX_RECEIVERS || (*end != ',' && *end != '\0'))
+        {
+            return -1;
+        }
+        for (long address = first; address <= last; address++)
+        {
+            receivers[count].address = address;
+            receivers[count].status = NAK_STATUS_INCOMPLETE;
+            count++;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+void broadcastPacket(PointerIntPair packet)
+{
+    if (llwriteTo(LL_ADDR_BROADCAST, packet.pointer, packet.size) < 0)
+    {
+        LOG_ERROR("Error in llwriteTo\n");
+        exit(-1);
+    }
+    free(packet.pointer);
+}
+
+// Check of a multicast block: the XOR BCC2 of the link layer lets some
+// multi-byte errors through, and receivers can't ask for a frame again.
+uint32_t blockCheck(uint32_t block, const unsigned char *data, int size)
+{
+    Xxh64State state;
+    xxh64Reset(&state, block);
+    xxh64Update(&state, data, size);
+    return (uint32_t)xxh64Digest(&state);
+}
+
+PointerIntPair createBlockPacket(uint32_t block, const unsigned char *data, int size)
+{
+    unsigned char *packet = (unsigned char *)malloc(BLOCK_HEADER_BYTES + size);
+    packet[0] = PACKET_BLOCK;
+    putBigEndian(&packet[1], block, 4);
+    putBigEndian(&packet[5], blockCheck(block, data, size), 4);
+    memcpy(&packet[BLOCK_HEADER_BYTES], data, size);
+
+    PointerIntPair result;
+    result.pointer = packet;
+    result.size = BLOCK_HEADER_BYTES + size;
+    return result;
+}
+
+// tx: asks a receiver for its missing blocks, adding them to resend.
+// Returns its status, or -1 if it didn't answer.
+int pollReceiver(unsigned char address, unsigned char round, unsigned char *resend, uint32_t numBlocks,
+                 int nTries, int timeout)
+{
+    unsigned char poll[2] = {PACKET_NAK_POLL, round};
+    unsigned char reply[RECEIVE_BUFFER_SIZE];
+    for (int try = 0; try < nTries; try++)
+    {
+        if (llwriteTo(address, poll, sizeof(poll)) < 0)
+        {
+            LOG_ERROR("Error in llwriteTo\n");
+            exit(-1);
+        }
+        int size;
+        unsigned char from;
+        while ((size = llreadUnacked(reply, &from, timeout * 1000)) > 0)
+        {
+            if (from != address)
+            {
+                continue;
+            }
+            if (reply[0] == PACKET_NAK && size >= NAK_HEADER_BYTES)
+            {
+                uint32_t first = getBigEndian(&reply[1], 4);
+                int count = getBigEndian(&reply[5], 2);
+                for (int i = 0; i < count && NAK_HEADER_BYTES + i / 8 < size && first + i < numBlocks; i++)
+                {
+                    if (reply[NAK_HEADER_BYTES + i / 8] & (1 << (i % 8)))
+                    {
+                        resend[first + i] = TRUE;
+                    }
+                }
+            }
+            else if (reply[0] == PACKET_NAK_END && size == NAK_END_BYTES && reply[1] == round)
+            {
+                LOG_INFO("Receiver %u: %u blocks missing, status %u\n", address,
+                         (unsigned)getBigEndian(&reply[2], 4), reply[6]);
+                return reply[6];
+            }
+        }
+        if (size < 0)
+        {
+            LOG_ERROR("Error in llreadUnacked\n");
+            exit(-1);
+        }
+        LOG_WARN("Receiver %u didn't answer (try %d/%d)\n", address, try + 1, nTries);
+    }
+    return -1;
+}
 
-typedef struct
+// tx: sends the file to every receiver in receivers. Returns the number of
+// receivers that didn't verify it.
+int sendMulticast(const char *filename, Receiver *receivers, int numReceivers, int nTries, int timeout)
 {
-    unsigned char *pointer;
-    int size;
-} PointerIntPair;
+    const unsigned char *data = mapFile();
+    uint32_t numBlocks = (filesize + MULTICAST_BLOCK_SIZE - 1) / MULTICAST_BLOCK_SIZE;
+    unsigned char *resend = (unsigned char *)malloc(numBlocks + 1);
+    memset(resend, TRUE, numBlocks);
+    int sendStart = TRUE;
+    int pending = numReceivers;
+    uint64_t blocksSent = 0;
 
-void readFileSize()
-{
-    fseek(fptr, 0, SEEK_END);
-    filesize = ftell(fptr);
-    fseek(fptr, 0, SEEK_SET);
+    for (int round = 0; pending > 0 && round < MULTICAST_MAX_ROUNDS; round++)
+    {
+        if (sendStart)
+        {
+            broadcastPacket(createControlPacket(0, filename));
+            sendStart = FALSE;
+        }
+        for (uint32_t i = 0; i < numBlocks; i++)
+        {
+            if (!resend[i])
+            {
+                continue;
+            }
+            int64_t offset = (int64_t)i * MULTICAST_BLOCK_SIZE;
+            broadcastPacket(createBlockPacket(i, data + offset, MIN(MULTICAST_BLOCK_SIZE, filesize - offset)));
+            resend[i] = FALSE;
+            blocksSent++;
+        }
+        broadcastPacket(createControlPacket(1, filename));
+
+        pending = 0;
+        for (int r = 0; r < numReceivers; r++)
+        {
+            if (receivers[r].status != NAK_STATUS_INCOMPLETE && receivers[r].status != NAK_STATUS_NO_START)
+            {
+                continue;
+            }
+            receivers[r].status = pollReceiver(receivers[r].address, round, resend, numBlocks, nTries, timeout);
+            if (receivers[r].status == NAK_STATUS_NO_START)
+            {
+                memset(resend, TRUE, numBlocks);
+                sendStart = TRUE;
+            }
+            if (receivers[r].status == NAK_STATUS_INCOMPLETE || receivers[r].status == NAK_STATUS_NO_START)
+            {
+                pending++;
+            }
+        }
+    }
+
+    for (int i = 0; i < MULTICAST_CLOSE_REPEAT; i++)
+    {
+        unsigned char close = PACKET_MULTICAST_CLOSE;
+        if (llwriteTo(LL_ADDR_BROADCAST, &close, 1) < 0)
+        {
+            LOG_ERROR("Error in llwriteTo\n");
+            exit(-1);
+        }
+    }
+
+    int failed = 0;
+    for (int r = 0; r < numReceivers; r++)
+    {
+        if (receivers[r].status != NAK_STATUS_VERIFIED)
+        {
+            LOG_ERROR("Receiver %u didn't get the file (status %d)\n", receivers[r].address, receivers[r].status);
+            failed++;
+        }
+    }
+    LOG_INFO("Multicast: %llu blocks sent for %u blocks, %d of %d receivers verified the file\n",
+             (unsigned long long)blocksSent, numBlocks, numReceivers - failed, numReceivers);
+    free(resend);
+    unmapFile(data);
+    return failed;
 }
 
-void splitFile()
+// rx: answers a NAK poll with the bitmap of the missing blocks.
+void answerPoll(unsigned char round, const unsigned char *received, uint32_t numBlocks, int status)
 {
-    bytes = fread(buf, 1, SEND_BUFFER_SIZE, fptr);
+    uint32_t missing = 0;
+    int perPacket = (MAX_PAYLOAD_SIZE - NAK_HEADER_BYTES) * 8;
+    for (uint32_t first = 0; first < numBlocks; first += perPacket)
+    {
+        int count = MIN(perPacket, numBlocks - first);
+        unsigned char packet[NAK_HEADER_BYTES + (count + 7) / 8];
+        memset(packet, 0, sizeof(packet));
+        packet[0] = PACKET_NAK;
+        putBigEndian(&packet[1], first, 4);
+        putBigEndian(&packet[5], count, 2);
+        int any = FALSE;
+        for (int i = 0; i < count; i++)
+        {
+            if (!received[first + i])
+            {
+                packet[NAK_HEADER_BYTES + i / 8] |= 1 << (i % 8);
+                missing++;
+                any = TRUE;
+            }
+        }
+        if (any && llwriteUnacked(packet, sizeof(packet)) < 0)
+        {
+            LOG_ERROR("Error in llwriteUnacked\n");
+            exit(-1);
+        }
+    }
+
+    unsigned char end[NAK_END_BYTES];
+    end[0] = PACKET_NAK_END;
+    end[1] = round;
+    putBigEndian(&end[2], missing, 4);
+    end[6] = status;
+    if (llwriteUnacked(end, sizeof(end)) < 0)
+    {
+        LOG_ERROR("Error in llwriteUnacked\n");
+        exit(-1);
+    }
 }
 
-PointerIntPair createDataPacket() // returns data packet
+// rx: receives a multicast transfer until the transmitter closes it (or
+// goes silent). Returns TRUE if the file was verified.
+int receiveMulticast(int nTries, int timeout)
 {
-    S++;
-    printf("packet number: %d (as a byte:%d)\n", S, S % 256);
-    unsigned char *datapacket = (unsigned char *)malloc((bytes + NUM_HEADER_BYTES) * sizeof(unsigned char));
-    datapacket[0] = 2;
-    datapacket[1] = S;
-    datapacket[2] = bytes / 256; // L2
-    datapacket[3] = bytes % 256; // L3
+    unsigned char packet[RECEIVE_BUFFER_SIZE];
+    unsigned char *received = NULL;
+    uint32_t numBlocks = 0, numReceived = 0;
+    int started = FALSE;
+    int status = NAK_STATUS_INCOMPLETE;
+    ControlInfo endInfo;
+    int hasEnd = FALSE;
 
-    for (int i = 0; i < bytes; i++)
+    while (TRUE)
     {
-        datapacket[4 + i] = buf[i];
-    }
+        unsigned char from;
+        int silence = nTries * timeout * 1000;
+        if (status != NAK_STATUS_VERIFIED)
+        {
+            silence *= MULTICAST_SILENCE_FACTOR;
+        }
+        int size = llreadUnacked(packet, &from, silence);
+        if (size < 0)
+        {
+            LOG_ERROR("Error in llreadUnacked\n");
+            exit(-1);
+        }
+        if (size == 0)
+        {
+            LOG_WARN("The transmitter went silent\n");
+            break;
+        }
 
-    PointerIntPair result;
-    result.pointer = datapacket;
-    result.size = 4 + bytes;
-    return result;
+        if (packet[0] == PACKET_START && !started)
+        {
+            parseControlPacket(packet, size, &startInfo);
+            if (!startInfo.hasSize || startInfo.multicastBlockSize <= 0 ||
+                startInfo.multicastBlockSize > MAX_PAYLOAD_SIZE - BLOCK_HEADER_BYTES)
+            {
+                LOG_ERROR("Unsupported multicast transfer\n");
+                exit(-1);
+            }
+            numBlocks = (startInfo.size + startInfo.multicastBlockSize - 1) / startInfo.multicastBlockSize;
+            received = (unsigned char *)calloc(numBlocks + 1, 1);
+            started = TRUE;
+            LOG_INFO("Multicast of %s: %ld bytes\n", startInfo.name, startInfo.size);
+        }
+        else if (packet[0] == PACKET_BLOCK && started && size >= BLOCK_HEADER_BYTES)
+        {
+            uint32_t block = getBigEndian(&packet[1], 4);
+            int64_t offset = (int64_t)block * startInfo.multicastBlockSize;
+            int length = size - BLOCK_HEADER_BYTES;
+            if (block >= numBlocks || length != MIN(startInfo.multicastBlockSize, startInfo.size - offset) ||
+                getBigEndian(&packet[5], 4) != blockCheck(block, &packet[BLOCK_HEADER_BYTES], length))
+            {
+                LOG_WARN("Corrupted block received\n");
+                continue;
+            }
+            if (!received[block])
+            {
+                queueReceivedChunk(offset, &packet[BLOCK_HEADER_BYTES], length);
+                received[block] = TRUE;
+                numReceived++;
+            }
+        }
+        else if (packet[0] == PACKET_END)
+        {
+            parseControlPacket(packet, size, &endInfo);
+            hasEnd = TRUE;
+        }
+        else if (packet[0] == PACKET_NAK_POLL && size == 2)
+        {
+            if (!started)
+            {
+                answerPoll(packet[1], NULL, 0, NAK_STATUS_NO_START);
+                continue;
+            }
+            if (status == NAK_STATUS_INCOMPLETE && hasEnd && numReceived == numBlocks)
+            {
+                chunkQueueDrain(&writeBehind);
+                if (verifyEndPacket(&endInfo))
+                {
+                    status = NAK_STATUS_VERIFIED;
+                }
+                else
+                {
+                    // A bad block got through: ask for the whole file again
+                    LOG_WARN("Requesting the whole file again\n");
+                    resetReceivedFile();
+                    memset(received, FALSE, numBlocks);
+                    numReceived = 0;
+                }
+            }
+            answerPoll(packet[1], received, numBlocks, status);
+        }
+        else if (packet[0] == PACKET_MULTICAST_CLOSE)
+        {
+            LOG_INFO("Multicast closed by the transmitter\n");
+            break;
+        }
+    }
+    free(received);
+    return status == NAK_STATUS_VERIFIED;
 }
 
-PointerIntPair createControlPacket(int option, const char *filename) // option is 0 for start packet 1 for end packet
+// Runs a multicast transfer instead of the point-to-point protocol.
+void multicastLayer(LinkLayer connectionParameters, const char *filename, const char *option)
 {
-    unsigned char lenfilename = (unsigned char)strlen(filename);
-    unsigned char *controlpacket = (unsigned char *)malloc((13 + lenfilename) * sizeof(unsigned char));
-    if (option == 0) // start control packet
+    if (streaming)
     {
-        controlpacket[0] = 1;
+        LOG_ERROR("Multicast transfers can't use stdin or stdout\n");
+        exit(-1);
     }
-    else
-        controlpacket[0] = 3;
 
-    controlpacket[1] = 0; // file size
-    controlpacket[2] = 8; // bytes of length (filesize)
-    int tmp = 56;
-    for (int i = 0; i < 8; i++)
+    if (connectionParameters.role == LlTx)
     {
-        controlpacket[i + 3] = (filesize >> tmp) & 0xFF;
-        tmp -= 8;
+        Receiver receivers[MULTICAST_MAX_RECEIVERS];
+        int numReceivers = parseReceivers(option, receivers);
+        if (numReceivers <= 0)
+        {
+            LOG_ERROR("Bad receiver list in FTA_MULTICAST: %s\n", option);
+            exit(-1);
+        }
+        fptr = fopen(filename, "rb");
+        if (fptr == NULL)
+        {
+            LOG_ERROR("Error opening %s\n", filename);
+            exit(-1);
+        }
+        readFileSize();
+        xxh64Reset(&filehash, FILE_HASH_SEED);
+        multicast = TRUE;
+        if (llopenShared(connectionParameters, LL_ADDR_BROADCAST) < 0)
+        {
+            exit(-1);
+        }
+
+        int failed = sendMulticast(filename, receivers, numReceivers,
+                                   connectionParameters.nRetransmissions, connectionParameters.timeout);
+        fclose(fptr);
+        llcloseShared(TRUE);
+        if (failed > 0)
+        {
+            exit(-1);
+        }
     }
-    controlpacket[11] = 1; // file name
-    controlpacket[12] = lenfilename;
-    memcpy(&controlpacket[13], filename, lenfilename);
+    else
+    {
+        int address = atoi(option);
+        if (address < 1 || address >= LL_ADDR_BROADCAST)
+        {
+            LOG_ERROR("Bad receiver address in FTA_ADDRESS: %s\n", option);
+            exit(-1);
+        }
+        if (llopenShared(connectionParameters, address) < 0)
+        {
+            exit(-1);
+        }
 
-    PointerIntPair result;
-    result.pointer = controlpacket;
-    result.size = 13 + lenfilename;
+        pthread_t writer = startReceiving(filename);
+        int verified = receiveMulticast(connectionParameters.nRetransmissions, connectionParameters.timeout);
+        llcloseShared(FALSE);
+        finishReceiving(filename, writer, verified);
+    }
+    LOG_INFO("Terminating application layer!\n");
+}
 
-    return result;
+// Message mode (FTA_RPC): short requests and responses over one open
+// session instead of a file. The transmitter is the client, sending every
+// line of the file (or of stdin) as a request and printing the responses;
+// the receiver is the server, answering with the output of FTA_RPC_HANDLER.
+
+// rx: runs the handler with the request in FTA_REQUEST (or echoes the
+// request without one). Returns the size of the response.
+int handleRequest(const char *handler, const char *request, unsigned char *response)
+{
+    if (handler == NULL || strcmp(handler, "") == 0)
+    {
+        strcpy((char *)response, request);
+        return strlen(request);
+    }
+    setenv("FTA_REQUEST", request, 1);
+    FILE *output = popen(handler, "r");
+    if (output == NULL)
+    {
+        LOG_ERROR("Error running %s\n", handler);
+        return 0;
+    }
+    int size = fread(response, 1, MSG_MAX_SIZE, output);
+    while (fgetc(output) != EOF)
+    {
+        // the rest doesn't fit: let the handler finish anyway
+    }
+    pclose(output);
+    if (size > 0 && response[size - 1] == '\n')
+    {
+        size--; // responses are lines
+    }
+    return size;
 }
 
-int parsePacket(unsigned char *packet, int size)
+void messageLayer(LinkLayer connectionParameters, const char *filename)
 {
-    const static int TOO_SHORT_MAX_NUMBER = 4;
-    static int too_short_counter = FALSE;
-    static unsigned char lastPacketValue = 0;
-    if (packet[0] == 1)
+    if (llopen(connectionParameters) < 0)
     {
-        return 1;
+        exit(-1);
     }
-    else if (packet[0] == 2)
+
+    char request[MSG_MAX_SIZE + 2];
+    unsigned char response[MSG_MAX_SIZE + 1];
+    if (connectionParameters.role == LlTx)
     {
-        unsigned char current_packet = packet[1];
-        if (size > SEND_BUFFER_SIZE + NUM_HEADER_BYTES)
+        FILE *requests = streaming ? stdin : fopen(filename, "r");
+        if (requests == NULL)
         {
-            printf("Too large packet received(size=%u)\n",size);
-            return -2;
+            LOG_ERROR("Error opening %s\n", filename);
+            exit(-1);
         }
-
-        if ((unsigned char)current_packet != (unsigned char)(lastPacketValue + 1))
+        MsgClient client;
+        msgClientInit(&client, connectionParameters.timeout * 1000, connectionParameters.nRetransmissions);
+        int count = 0;
+        int64_t totalUs = 0, maxUs = 0;
+        while (fgets(request, sizeof(request), requests) != NULL)
         {
-            printf("Out of order(previous %u vs current %u) \n", lastPacketValue, current_packet);
-            return -1;
-        }
+            int size = strlen(request);
+            if (size > 0 && request[size - 1] == '\n')
+            {
+                request[--size] = '\0';
+            }
+            else if (size > MSG_MAX_SIZE)
+            {
+                LOG_ERROR("Request longer than %d bytes\n", MSG_MAX_SIZE);
+                exit(-1);
+            }
 
-        // TODO: remove, maybe!!!
-        if (size < SEND_BUFFER_SIZE + NUM_HEADER_BYTES)
-        {
-            if (too_short_counter < TOO_SHORT_MAX_NUMBER)
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            int res = msgRequest(&client, (unsigned char *)request, size, response);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (res < 0)
             {
-                too_short_counter += 1;
-                printf("Too short frame received!!!\n");
+                LOG_ERROR("%s: %s\n", res == -2 ? "Request unanswered" : "Error sending request", request);
+                exit(-1);
             }
-            else
+            int64_t us = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+            LOG_DEBUG("Request answered in %lld us\n", (long long)us);
+            totalUs += us;
+            maxUs = MAX(maxUs, us);
+            count++;
+            fwrite(response, 1, res, stdout);
+            fputc('\n', stdout);
+            fflush(stdout);
+        }
+        if (!streaming)
+        {
+            fclose(requests);
+        }
+        if (count > 0)
+        {
+            LOG_INFO("%d requests answered, round trip %lld us on average, %lld us at most\n", count,
+                     (long long)(totalUs / count), (long long)maxUs);
+        }
+        if (llclose(1) < 0)
+        {
+            LOG_ERROR("Error in llclose.\n");
+            exit(-1);
+        }
+    }
+    else
+    {
+        const char *handler = getenv("FTA_RPC_HANDLER");
+        MsgServer server;
+        msgServerInit(&server);
+        int count = 0;
+        uint16_t id;
+        int size;
+        while ((size = msgReceive(&server, (unsigned char *)request, &id)) >= 0)
+        {
+            request[size] = '\0';
+            LOG_DEBUG("Request %u: %s\n", id, request);
+            if (msgRespond(&server, id, response, handleRequest(handler, request, response)) < 0)
             {
-                printf("Too many short frames in a row! This doesn't make sense.\n\n");
+                LOG_ERROR("Error sending a response\n");
                 exit(-1);
             }
+            count++;
         }
-        else
+        if (size == -1)
         {
-            too_short_counter = 0;
+            LOG_ERROR("Error in llreadUnacked\n");
+            exit(-1);
         }
-
-        lastPacketValue = current_packet;
-
-        int L1 = packet[3];
-        int L2 = packet[2];
-        fwrite(&packet[4], 1, MIN(L2 * 256 + L1,SEND_BUFFER_SIZE), fptr);
-        printf("packet number: %u \n\n", packet[1]);
-        return 2;
+        LOG_INFO("Session closed after %d requests\n", count);
     }
-    else if (packet[0] == 3)
-        return 3;
-
-    return 4;
+    LOG_INFO("Terminating application layer!\n");
 }
 
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename)
 {
+    streaming = strcmp(filename, STREAM_FILENAME) == 0;
+    const char *rpc = getenv("FTA_RPC");
+    int messages = rpc != NULL && strcmp(rpc, "0") != 0 && strcmp(rpc, "") != 0;
+    if ((streaming && strcmp(role, "rx") == 0) || (messages && strcmp(role, "tx") == 0))
+    {
+        // stdout carries the file (or the responses) alone: drop anything
+        // main printed and log to stderr instead
+        __fpurge(stdout);
+        logSetOutput(stderr);
+    }
+    logInit();
+
     LinkLayer connectionParameters;
     strcpy(connectionParameters.serialPort, serialPort);
     connectionParameters.baudRate = baudRate;
+    const char *baudOption = getenv("FTA_BAUDRATE"); // main only accepts up to 115200
+    if (baudOption != NULL && atoi(baudOption) > 0)
+    {
+        connectionParameters.baudRate = atoi(baudOption);
+        LOG_INFO("Baudrate set to %d by FTA_BAUDRATE\n", connectionParameters.baudRate);
+    }
     connectionParameters.nRetransmissions = nTries;
     connectionParameters.timeout = timeout;
     if (strcmp(role, "tx") == 0)
@@ -163,103 +2708,163 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
     else if (strcmp(role, "rx") == 0)
         connectionParameters.role = LlRx;
 
-    // TODO: for safety, check if end info packet has the same information as the start info packet
+    const char *aggregateOption = getenv("FTA_AGGREGATE");
+    aggregate = aggregateOption != NULL && strcmp(aggregateOption, "0") != 0 && strcmp(aggregateOption, "") != 0;
+
+    const char *multicastOption = getenv(connectionParameters.role == LlTx ? "FTA_MULTICAST" : "FTA_ADDRESS");
+    if (multicastOption != NULL && strcmp(multicastOption, "") != 0)
+    {
+        multicastLayer(connectionParameters, filename, multicastOption);
+        return;
+    }
+    if (messages)
+    {
+        messageLayer(connectionParameters, filename);
+        return;
+    }
 
-    printf("llopen try loop called\n");
+    LOG_DEBUG("llopen try loop called\n");
 
     if (llopen(connectionParameters) < 0)
     {
         exit(-1);
     }
+    llsetDataCheck(dataPacketIsWhole);
 
-    printf("connection established.\n\n");
+    LOG_INFO("connection established.\n\n");
 
     if (strcmp(role, "tx") == 0) // transmiter
     {
-        fptr = fopen(filename, "rb");
-        readFileSize();
-
-        // sedning start control packet
-        PointerIntPair controlpacketstart = createControlPacket(0, filename);
-
-        int res;
-        if (llwrite(controlpacketstart.pointer, controlpacketstart.size) < 0)
+        fptr = streaming ? stdin : fopen(filename, "rb");
+        if (fptr == NULL)
         {
-
-            printf("Error in writing start control packet\n");
+            LOG_ERROR("Error opening %s\n", filename);
             exit(-1);
         }
+        const char *follow = getenv("FTA_FOLLOW");
+        if (!streaming && follow != NULL && strcmp(follow, "0") != 0)
+        {
+            followPath = filename;
+            followDelay = atoi(follow);
+            if (followDelay <= 0 || followDelay > FOLLOW_MAX_DELAY_MS)
+            {
+                followDelay = FOLLOW_DEFAULT_DELAY_MS;
+            }
+            keepAliveInterval = timeout * 1000 / 2; // well within the receiver's timeout
+            signal(SIGINT, stopFollowing);
+            signal(SIGTERM, stopFollowing);
+        }
 
-        free(controlpacketstart.pointer);
-
-        // sending data packets
-        do
+        if (streaming || followPath != NULL)
         {
-            splitFile();
-            PointerIntPair datapacket = createDataPacket();
+            filesize = -1; // sent in the end packet
+        }
+        else
+        {
+            readFileSize();
+        }
+        xxh64Reset(&filehash, FILE_HASH_SEED);
 
-            res = llwrite(datapacket.pointer, datapacket.size);
-            if (res == -1)
+        const char *channelList = getenv("FTA_CHANNELS");
+        openChannels(channelList != NULL ? channelList : "");
+
+        const char *dedupOption = getenv("FTA_DEDUP");
+        const char *delta = getenv("FTA_DELTA");
+        const char *fountain = getenv("FTA_FOUNTAIN");
+        dedup = dedupOption != NULL && strcmp(dedupOption, "0") != 0;
+        if ((streaming || followPath != NULL) &&
+            (dedup || (delta != NULL && strcmp(delta, "0") != 0) || (fountain != NULL && strcmp(fountain, "0") != 0)))
+        {
+            // They all need the whole file up front
+            LOG_WARN("Size not known in advance: delta, dedup and fountain transfers are disabled\n");
+            dedup = FALSE;
+        }
+        else if (!dedup && delta != NULL && strcmp(delta, "0") != 0)
+        {
+            deltaBlockSize = atoi(delta);
+            if (deltaBlockSize < DELTA_MIN_BLOCK_SIZE || deltaBlockSize > DELTA_MAX_BLOCK_SIZE)
             {
-                printf("Error in llwrite\n");
-                exit(-1);
-            }
-            else if (res == -2)
-            { // the dirtiest thing so far in this code :/
-                printf("Error: unexpected RR or REJ code -> skipping to next packet\n\n");
+                deltaBlockSize = DELTA_DEFAULT_BLOCK_SIZE;
             }
-            else if (res == -3)
+        }
+        else if (!dedup && fountain != NULL && strcmp(fountain, "0") != 0)
+        {
+            fountainSymbolSize = atoi(fountain);
+            if (fountainSymbolSize < FOUNTAIN_MIN_SYMBOL_SIZE || fountainSymbolSize > FOUNTAIN_MAX_SYMBOL_SIZE)
             {
-                printf("Randomly dissapearing bytes error :)\n");
-                exit(-1);
+                fountainSymbolSize = FOUNTAIN_DEFAULT_SYMBOL_SIZE;
             }
+        }
 
-            usleep(SLEEP_AMOUNT);
-            free(datapacket.pointer);
-        } while (bytes > 0);
+        // sedning start control packet (along with the first data packets
+        // when aggregating)
+        sendPacket(createControlPacket(0, filename));
+
+        if (dedup)
+        {
+            sendDeduplicated();
+        }
+        else if (deltaBlockSize > 0)
+        {
+            sendDelta();
+        }
+        else if (fountainSymbolSize > 0)
+        {
+            sendFountain();
+        }
+        else
+        {
+            sendFile();
+        }
+        serveChannels(TRUE); // the rx stops at the main end packet
 
         // sending end control packet
         PointerIntPair controlpacketend = createControlPacket(1, filename);
 
         if (llwrite(controlpacketend.pointer, controlpacketend.size) < 0)
         {
-            printf("Error in writing end control packet\n");
+            LOG_ERROR("Error in writing end control packet\n");
             exit(-1);
         }
 
         free(controlpacketend.pointer);
-        fclose(fptr);
+        if (!streaming)
+        {
+            fclose(fptr);
+        }
 
         if (llclose(1) < 0)
         {
-            printf("Error in llclose.\n");
+            LOG_ERROR("Error in llclose.\n");
             exit(-1);
         }
     }
     else if (strcmp(role, "rx") == 0) // receiver
     {
-        fptr = fopen(filename, "wb");
+        pthread_t writer = startReceiving(filename);
+
         int end = FALSE;
+        int verified = TRUE;
         while (!end)
         {
 
             int res = llread(receivedbuf);
-            printf("bytes received: %d\n", res);
+            LOG_DEBUG("bytes received: %d\n", res);
             switch (res)
             {
             case -2:
-                printf("Terminated correctly.\n");
+                LOG_INFO("Terminated correctly.\n");
                 end = TRUE;
                 break;
             case -3:
-                printf("terminated with errors!\n");
+                LOG_WARN("terminated with errors!\n");
                 break;
             case -4:
-                printf("SET received: resetting the file.\n");
-                rewind(fptr);
+                LOG_INFO("SET received: resetting the file.\n");
+                resetReceivedFile();
                 break;
             case -1:
-                printf("Error in llread.\n");
+                LOG_ERROR("Error in llread.\n");
                 exit(-1);
                 break;
             default: // should be correct
@@ -267,30 +2872,56 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
                 int resParse = parsePacket(receivedbuf, res);
                 if (resParse == -1)
                 {
-                    printf("Critical frame order error!\n");
+                    LOG_ERROR("Critical frame order error!\n");
                     exit(-1);
                     break;
                 }
                   if (resParse == -2)
                 {
-                    printf("Assumed everything is fine\n");
+                    LOG_WARN("Assumed everything is fine\n");
                     break;
                 }
 
-                if (resParse == 3)
+                if (resParse == 1 && startInfo.deltaBlockSize > 0)
+                {
+                    if (startInfo.deltaBlockSize < DELTA_MIN_BLOCK_SIZE || startInfo.deltaBlockSize > DELTA_MAX_BLOCK_SIZE)
+                    {
+                        LOG_ERROR("Unsupported delta block size %d\n", startInfo.deltaBlockSize);
+                        exit(-1);
+                    }
+                    sendSignatures(filename, startInfo.deltaBlockSize);
+                }
+
+                if (resParse == 5)
+                {
+                    answerChunkList();
+                }
+
+                if (resParse == 6)
+                {
+                    sendFountainDone();
+                }
+
+                if (resParse == -3)
+                {
+                    LOG_ERROR("End control packet verification failed!\n");
+                    verified = FALSE;
+                }
+
+                if (resParse == 3 || resParse == -3)
                 {
 
-                    printf("end packet received\n");
+                    LOG_INFO("end packet received\n");
 
                     int res_ = llread(receivedbuf);
                     if (res_ == -2)
                     {
-                        printf("should end correctly!\n");
+                        LOG_INFO("should end correctly!\n");
                         end = TRUE;
                     }
                     else if (res_ == -3)
                     {
-                        printf("terminated incorrectly!!!\n");
+                        LOG_ERROR("terminated incorrectly!!!\n");
                         exit(-1);
                         break;
                     }
@@ -301,8 +2932,21 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
 
             usleep(SLEEP_AMOUNT);
         }
-        printf("llread ended\n");
-        fclose(fptr);
+        LOG_INFO("llread ended\n");
+        finishReceiving(filename, writer, verified);
+        for (int i = 1; i < SCHEDULER_MAX_CHANNELS; i++)
+        {
+            if (channels[i].file != NULL)
+            {
+                LOG_ERROR("Channel %d: %s was cut short\n", i, channels[i].path);
+                channelErrors++;
+            }
+        }
+        if (channelErrors > 0)
+        {
+            LOG_ERROR("%d files of other channels weren't received\n", channelErrors);
+            exit(-1);
+        }
     }
-    printf("Terminating application layer!\n");
+    LOG_INFO("Terminating application layer!\n");
 }
\ No newline at end of file
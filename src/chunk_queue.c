@@ -0,0 +1,79 @@
+// Lock-free single-producer/single-consumer queue of file chunks
+
+#include "chunk_queue.h"
+
+#include <sched.h>
+#include <time.h>
+
+#define SPIN_TRIES 64
+#define IDLE_WAIT_NSEC 50000 // 50 us, well below the time of a frame
+
+// Back off while the other side catches up: spin first, then sleep so that
+// a stalled disk or link doesn't burn a whole core.
+static void waitTurn(int *tries)
+{
+    if (*tries < SPIN_TRIES)
+    {
+        (*tries)++;
+        sched_yield();
+        return;
+    }
+    struct timespec wait = {.tv_sec = 0, .tv_nsec = IDLE_WAIT_NSEC};
+    nanosleep(&wait, NULL);
+}
+
+void chunkQueueInit(ChunkQueue *queue)
+{
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+Chunk *chunkQueueAcquire(ChunkQueue *queue)
+{
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    int tries = 0;
+    while (tail - atomic_load_explicit(&queue->head, memory_order_acquire) >= CHUNK_QUEUE_SLOTS)
+    {
+        waitTurn(&tries);
+    }
+    return &queue->slots[tail % CHUNK_QUEUE_SLOTS];
+}
+
+void chunkQueuePublish(ChunkQueue *queue)
+{
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
+Chunk *chunkQueuePeek(ChunkQueue *queue)
+{
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    int tries = 0;
+    while (atomic_load_explicit(&queue->tail, memory_order_acquire) == head)
+    {
+        waitTurn(&tries);
+    }
+    return &queue->slots[head % CHUNK_QUEUE_SLOTS];
+}
+
+int chunkQueueIsEmpty(ChunkQueue *queue)
+{
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    return atomic_load_explicit(&queue->tail, memory_order_acquire) == head;
+}
+
+void chunkQueueRelease(ChunkQueue *queue)
+{
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+}
+
+void chunkQueueDrain(ChunkQueue *queue)
+{
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    int tries = 0;
+    while (atomic_load_explicit(&queue->head, memory_order_acquire) != tail)
+    {
+        waitTurn(&tries);
+    }
+}
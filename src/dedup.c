@@ -0,0 +1,156 @@
+// Content-defined chunking and chunk store implementation
+
+#include "dedup.h"
+#include "xxhash64.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// FastCDC normalized chunking: a harder mask (more bits) before the average
+// size and an easier one after it concentrate the sizes around the average
+#define MASK_SMALL 0x0003590703530000ULL
+#define MASK_LARGE 0x0000D90003530000ULL
+#define GEAR_SEED 0x4644434443ULL
+
+static uint64_t gear[256];
+static int gearReady = 0;
+
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// The table must be the same on every run for chunks to repeat
+static void initGear()
+{
+    uint64_t state = GEAR_SEED;
+    for (int i = 0; i < 256; i++)
+    {
+        gear[i] = splitmix64(&state);
+    }
+    gearReady = 1;
+}
+
+int cdcNextChunk(const unsigned char *data, int64_t size)
+{
+    if (!gearReady)
+    {
+        initGear();
+    }
+    if (size <= CDC_MIN_SIZE)
+    {
+        return size;
+    }
+    int n = size > CDC_MAX_SIZE ? CDC_MAX_SIZE : size;
+    int normal = n < CDC_AVG_SIZE ? n : CDC_AVG_SIZE;
+
+    uint64_t fp = 0;
+    int i = CDC_MIN_SIZE;
+    for (; i < normal; i++)
+    {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & MASK_SMALL))
+        {
+            return i;
+        }
+    }
+    for (; i < n; i++)
+    {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & MASK_LARGE))
+        {
+            return i;
+        }
+    }
+    return n;
+}
+
+ChunkId chunkIdOf(const unsigned char *data, int size)
+{
+    // Two independently seeded XXH64 make a 128-bit id
+    ChunkId id;
+    for (int half = 0; half < 2; half++)
+    {
+        Xxh64State state;
+        xxh64Reset(&state, half);
+        xxh64Update(&state, data, size);
+        uint64_t h = xxh64Digest(&state);
+        for (int i = 0; i < 8; i++)
+        {
+            id.bytes[half * 8 + i] = (h >> (56 - 8 * i)) & 0xFF;
+        }
+    }
+    return id;
+}
+
+// Chunks are kept as <dir>/<first byte in hex>/<id in hex>
+static void chunkPath(const ChunkStore *store, const ChunkId *id, char *path, size_t size, int dirOnly)
+{
+    int n = snprintf(path, size, "%s/%02x", store->dir, id->bytes[0]);
+    if (!dirOnly)
+    {
+        n += snprintf(path + n, size - n, "/");
+        for (int i = 0; i < CHUNK_ID_BYTES; i++)
+        {
+            n += snprintf(path + n, size - n, "%02x", id->bytes[i]);
+        }
+    }
+}
+
+int chunkStoreOpen(ChunkStore *store, const char *dir)
+{
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    if (mkdir(store->dir, 0755) != 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int chunkStoreHas(const ChunkStore *store, const ChunkId *id, int size)
+{
+    char path[512];
+    struct stat st;
+    chunkPath(store, id, path, sizeof(path), 0);
+    return stat(path, &st) == 0 && st.st_size == size;
+}
+
+FILE *chunkStoreRead(const ChunkStore *store, const ChunkId *id)
+{
+    char path[512];
+    chunkPath(store, id, path, sizeof(path), 0);
+    return fopen(path, "rb");
+}
+
+int chunkStorePut(const ChunkStore *store, const ChunkId *id, const unsigned char *data, int size)
+{
+    char path[512], tmp[520];
+    chunkPath(store, id, path, sizeof(path), 1);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+    chunkPath(store, id, path, sizeof(path), 0);
+
+    // Write under a temporary name so that a partial chunk is never found
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL)
+    {
+        return -1;
+    }
+    int ok = fwrite(data, 1, size, f) == size;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,211 @@
+// Rsync-style delta encoding implementation
+
+#include "delta.h"
+#include "xxhash64.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define STRONG_HASH_SEED 0x5EED
+
+static uint64_t strongHash(const unsigned char *block, int blockSize)
+{
+    Xxh64State state;
+    xxh64Reset(&state, STRONG_HASH_SEED);
+    xxh64Update(&state, block, blockSize);
+    return xxh64Digest(&state);
+}
+
+// Rolling checksum of rsync: a is the sum of the bytes, b the sum of the
+// partial sums, both modulo 2^16
+static void weakSums(const unsigned char *block, int blockSize, uint32_t *a, uint32_t *b)
+{
+    *a = 0;
+    *b = 0;
+    for (int i = 0; i < blockSize; i++)
+    {
+        *a += block[i];
+        *b += (uint32_t)(blockSize - i) * block[i];
+    }
+    *a &= 0xFFFF;
+    *b &= 0xFFFF;
+}
+
+static uint32_t tableSlot(uint32_t weak, uint32_t mask)
+{
+    return (weak * 0x9E3779B1u) & mask;
+}
+
+BlockSignature deltaBlockSignature(const unsigned char *block, int blockSize)
+{
+    uint32_t a, b;
+    weakSums(block, blockSize, &a, &b);
+    BlockSignature sig = {.weak = a | (b << 16), .strong = strongHash(block, blockSize)};
+    return sig;
+}
+
+void deltaSignaturesInit(DeltaSignatures *sigs, int blockSize)
+{
+    memset(sigs, 0, sizeof(*sigs));
+    sigs->blockSize = blockSize;
+}
+
+int deltaSignaturesAdd(DeltaSignatures *sigs, BlockSignature sig)
+{
+    if (sigs->count == sigs->capacity)
+    {
+        uint32_t capacity = sigs->capacity ? sigs->capacity * 2 : 256;
+        BlockSignature *blocks = realloc(sigs->blocks, capacity * sizeof(BlockSignature));
+        if (blocks == NULL)
+        {
+            return -1;
+        }
+        sigs->blocks = blocks;
+        sigs->capacity = capacity;
+    }
+    sigs->blocks[sigs->count++] = sig;
+    return 0;
+}
+
+void deltaSignaturesFree(DeltaSignatures *sigs)
+{
+    free(sigs->blocks);
+    memset(sigs, 0, sizeof(*sigs));
+}
+
+static int addOp(DeltaScript *script, DeltaOpType type, int64_t dst, int64_t src, int64_t length)
+{
+    if (script->count > 0)
+    {
+        // Merge with the previous operation when both sides are contiguous
+        DeltaOp *last = &script->ops[script->count - 1];
+        if (last->type == type && last->dst + last->length == dst && last->src + last->length == src)
+        {
+            last->length += length;
+            return 0;
+        }
+    }
+
+    if (script->count == script->capacity)
+    {
+        int capacity = script->capacity ? script->capacity * 2 : 64;
+        DeltaOp *ops = realloc(script->ops, capacity * sizeof(DeltaOp));
+        if (ops == NULL)
+        {
+            return -1;
+        }
+        script->ops = ops;
+        script->capacity = capacity;
+    }
+    DeltaOp op = {.type = type, .dst = dst, .src = src, .length = length};
+    script->ops[script->count++] = op;
+    return 0;
+}
+
+static int addLiteral(DeltaScript *script, int64_t start, int64_t end)
+{
+    if (end <= start)
+    {
+        return 0;
+    }
+    script->literalBytes += end - start;
+    return addOp(script, DeltaLiteral, start, start, end - start);
+}
+
+int deltaEncode(const DeltaSignatures *sigs, const unsigned char *data, int64_t size,
+                DeltaScript *script)
+{
+    memset(script, 0, sizeof(*script));
+    int bs = sigs->blockSize;
+    if (sigs->count == 0 || size < bs)
+    {
+        return addLiteral(script, 0, size);
+    }
+
+    // Index the old file's blocks by weak checksum
+    uint32_t tableSize = 1;
+    while (tableSize < 2 * sigs->count)
+    {
+        tableSize *= 2;
+    }
+    uint32_t mask = tableSize - 1;
+    uint32_t *table = calloc(tableSize, sizeof(uint32_t)); // block number + 1, 0 = empty
+    if (table == NULL)
+    {
+        return -1;
+    }
+    for (uint32_t i = 0; i < sigs->count; i++)
+    {
+        uint32_t slot = tableSlot(sigs->blocks[i].weak, mask);
+        while (table[slot] != 0)
+        {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = i + 1;
+    }
+
+    int64_t pos = 0, literalStart = 0;
+    uint32_t a, b;
+    weakSums(data, bs, &a, &b);
+    while (pos + bs <= size)
+    {
+        uint32_t weak = a | (b << 16);
+        int64_t match = -1;
+        int haveStrong = 0;
+        uint64_t strong = 0;
+        for (uint32_t slot = tableSlot(weak, mask); table[slot] != 0; slot = (slot + 1) & mask)
+        {
+            const BlockSignature *candidate = &sigs->blocks[table[slot] - 1];
+            if (candidate->weak != weak)
+            {
+                continue;
+            }
+            if (!haveStrong)
+            {
+                strong = strongHash(data + pos, bs);
+                haveStrong = 1;
+            }
+            if (candidate->strong == strong)
+            {
+                match = table[slot] - 1;
+                break;
+            }
+        }
+
+        if (match >= 0)
+        {
+            if (addLiteral(script, literalStart, pos) < 0 ||
+                addOp(script, DeltaCopy, pos, match * bs, bs) < 0)
+            {
+                free(table);
+                return -1;
+            }
+            script->copiedBytes += bs;
+            pos += bs;
+            literalStart = pos;
+            if (pos + bs <= size)
+            {
+                weakSums(data + pos, bs, &a, &b);
+            }
+        }
+        else
+        {
+            if (pos + bs < size)
+            {
+                // Roll the window one byte forward
+                a = (a - data[pos] + data[pos + bs]) & 0xFFFF;
+                b = (b - (uint32_t)bs * data[pos] + a) & 0xFFFF;
+            }
+            pos++;
+        }
+    }
+    free(table);
+
+    return addLiteral(script, literalStart, size);
+}
+
+void deltaScriptFree(DeltaScript *script)
+{
+    free(script->ops);
+    memset(script, 0, sizeof(*script));
+}
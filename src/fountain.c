@@ -0,0 +1,301 @@
+// Fountain (LT) code implementation
+
+#include "fountain.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Robust soliton parameters (Luby): c scales the number of low degree
+// symbols, delta bounds the probability of a decoding failure
+#define SOLITON_C 0.03
+#define SOLITON_DELTA 0.5
+#define FOUNTAIN_SEED 0x4C54434F4445ULL
+#define LN2 0.69314718055994530942
+
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// The program isn't linked with libm: only needed once per transfer
+static double squareRoot(double x)
+{
+    double r = x > 1 ? x : 1;
+    for (int i = 0; i < 100; i++)
+    {
+        r = (r + x / r) / 2;
+    }
+    return r;
+}
+
+static double naturalLog(double x)
+{
+    int exponent = 0;
+    while (x >= 2)
+    {
+        x /= 2;
+        exponent++;
+    }
+    while (x < 1)
+    {
+        x *= 2;
+        exponent--;
+    }
+    // ln(x) = 2 atanh((x - 1) / (x + 1)), the series converges fast on [1, 2)
+    double t = (x - 1) / (x + 1);
+    double term = t, sum = 0;
+    for (int k = 1; k < 40; k += 2)
+    {
+        sum += term / k;
+        term *= t * t;
+    }
+    return 2 * sum + exponent * LN2;
+}
+
+int fountainInit(FountainCode *code, uint32_t numBlocks)
+{
+    code->numBlocks = numBlocks;
+    code->cdf = (double *)malloc(numBlocks * sizeof(double));
+    code->marks = (unsigned char *)calloc(numBlocks, 1);
+    if (code->cdf == NULL || code->marks == NULL)
+    {
+        fountainFree(code);
+        return -1;
+    }
+
+    double k = numBlocks;
+    double r = SOLITON_C * naturalLog(k / SOLITON_DELTA) * squareRoot(k);
+    uint32_t spike = r > 0 ? (uint32_t)(k / r) : numBlocks;
+    spike = spike < 1 ? 1 : spike > numBlocks ? numBlocks : spike;
+
+    double total = 0;
+    for (uint32_t d = 1; d <= numBlocks; d++)
+    {
+        double p = d == 1 ? 1 / k : 1 / ((double)d * (d - 1)); // ideal soliton
+        if (d < spike)
+        {
+            p += r / (d * k);
+        }
+        else if (d == spike)
+        {
+            p += r * naturalLog(r / SOLITON_DELTA) / k;
+        }
+        total += p > 0 ? p : 0;
+        code->cdf[d - 1] = total;
+    }
+    for (uint32_t d = 0; d < numBlocks; d++)
+    {
+        code->cdf[d] /= total;
+    }
+    return 0;
+}
+
+void fountainFree(FountainCode *code)
+{
+    free(code->cdf);
+    free(code->marks);
+    code->cdf = NULL;
+    code->marks = NULL;
+}
+
+uint32_t fountainNeighbours(FountainCode *code, uint32_t esi, uint32_t *neighbours)
+{
+    uint64_t state = FOUNTAIN_SEED ^ esi;
+    double u = (splitmix64(&state) >> 11) * (1.0 / 9007199254740992.0); // [0, 1)
+    uint32_t low = 0, high = code->numBlocks - 1;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (code->cdf[mid] > u)
+        {
+            high = mid;
+        }
+        else
+        {
+            low = mid + 1;
+        }
+    }
+    uint32_t degree = low + 1;
+
+    // Floyd's sampling of degree distinct blocks
+    for (uint32_t j = code->numBlocks - degree; j < code->numBlocks; j++)
+    {
+        uint32_t t = splitmix64(&state) % (j + 1);
+        if (code->marks[t])
+        {
+            t = j;
+        }
+        code->marks[t] = 1;
+        neighbours[j - (code->numBlocks - degree)] = t;
+    }
+    for (uint32_t i = 0; i < degree; i++)
+    {
+        code->marks[neighbours[i]] = 0;
+    }
+    return degree;
+}
+
+int fountainDecoderInit(FountainDecoder *decoder, uint32_t numBlocks, int symbolSize)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->symbolSize = symbolSize;
+    if (fountainInit(&decoder->code, numBlocks) < 0)
+    {
+        return -1;
+    }
+    decoder->blocks = (unsigned char *)malloc((size_t)numBlocks * symbolSize);
+    decoder->known = (unsigned char *)calloc(numBlocks, 1);
+    decoder->waiting = (FountainList *)calloc(numBlocks, sizeof(FountainList));
+    decoder->neighbours = (uint32_t *)malloc(numBlocks * sizeof(uint32_t));
+    decoder->stack = (uint32_t *)malloc(numBlocks * sizeof(uint32_t));
+    if (decoder->blocks == NULL || decoder->known == NULL || decoder->waiting == NULL ||
+        decoder->neighbours == NULL || decoder->stack == NULL)
+    {
+        fountainDecoderFree(decoder);
+        return -1;
+    }
+    return 0;
+}
+
+static void xorInto(unsigned char *dst, const unsigned char *src, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        dst[i] ^= src[i];
+    }
+}
+
+// Block index is now data: remove it from every pending symbol, which may
+// in turn reveal other blocks (peeling decoder)
+static void resolveBlock(FountainDecoder *decoder, uint32_t index, const unsigned char *data)
+{
+    int size = decoder->symbolSize;
+    uint32_t top = 0;
+    memcpy(decoder->blocks + (size_t)index * size, data, size);
+    decoder->known[index] = 1;
+    decoder->numKnown++;
+    decoder->stack[top++] = index;
+
+    while (top > 0)
+    {
+        uint32_t block = decoder->stack[--top];
+        FountainList *list = &decoder->waiting[block];
+        for (uint32_t i = 0; i < list->count; i++)
+        {
+            FountainSymbol *symbol = &decoder->pending[list->symbols[i]];
+            if (symbol->data == NULL)
+            {
+                continue; // already used up
+            }
+            xorInto(symbol->data, decoder->blocks + (size_t)block * size, size);
+            symbol->indexXor ^= block;
+            if (--symbol->remaining == 1)
+            {
+                uint32_t last = symbol->indexXor;
+                if (!decoder->known[last])
+                {
+                    memcpy(decoder->blocks + (size_t)last * size, symbol->data, size);
+                    decoder->known[last] = 1;
+                    decoder->numKnown++;
+                    decoder->stack[top++] = last;
+                }
+            }
+            if (symbol->remaining <= 1)
+            {
+                free(symbol->data);
+                symbol->data = NULL;
+            }
+        }
+        free(list->symbols);
+        memset(list, 0, sizeof(*list));
+    }
+}
+
+int fountainDecoderAdd(FountainDecoder *decoder, uint32_t esi, const unsigned char *data)
+{
+    uint32_t numBlocks = decoder->code.numBlocks;
+    if (decoder->numKnown == numBlocks)
+    {
+        return 1;
+    }
+
+    int size = decoder->symbolSize;
+    uint32_t degree = fountainNeighbours(&decoder->code, esi, decoder->neighbours);
+    unsigned char *copy = (unsigned char *)malloc(size);
+    memcpy(copy, data, size);
+
+    // Remove the blocks already known, keep the others in neighbours
+    uint32_t remaining = 0, indexXor = 0;
+    for (uint32_t i = 0; i < degree; i++)
+    {
+        uint32_t block = decoder->neighbours[i];
+        if (decoder->known[block])
+        {
+            xorInto(copy, decoder->blocks + (size_t)block * size, size);
+        }
+        else
+        {
+            decoder->neighbours[remaining++] = block;
+            indexXor ^= block;
+        }
+    }
+    if (remaining == 0)
+    {
+        free(copy);
+        return 0; // nothing new
+    }
+
+    if (remaining == 1)
+    {
+        resolveBlock(decoder, indexXor, copy);
+        free(copy);
+        return decoder->numKnown == numBlocks;
+    }
+
+    if (decoder->numPending == decoder->pendingCapacity)
+    {
+        decoder->pendingCapacity = decoder->pendingCapacity ? decoder->pendingCapacity * 2 : 64;
+        decoder->pending = (FountainSymbol *)realloc(decoder->pending, decoder->pendingCapacity * sizeof(FountainSymbol));
+    }
+    uint32_t id = decoder->numPending++;
+    decoder->pending[id].data = copy;
+    decoder->pending[id].remaining = remaining;
+    decoder->pending[id].indexXor = indexXor;
+    for (uint32_t i = 0; i < remaining; i++)
+    {
+        FountainList *list = &decoder->waiting[decoder->neighbours[i]];
+        if (list->count == list->capacity)
+        {
+            list->capacity = list->capacity ? list->capacity * 2 : 4;
+            list->symbols = (uint32_t *)realloc(list->symbols, list->capacity * sizeof(uint32_t));
+        }
+        list->symbols[list->count++] = id;
+    }
+    return 0;
+}
+
+void fountainDecoderFree(FountainDecoder *decoder)
+{
+    for (uint32_t i = 0; i < decoder->numPending; i++)
+    {
+        free(decoder->pending[i].data);
+    }
+    if (decoder->waiting != NULL)
+    {
+        for (uint32_t i = 0; i < decoder->code.numBlocks; i++)
+        {
+            free(decoder->waiting[i].symbols);
+        }
+    }
+    free(decoder->pending);
+    free(decoder->waiting);
+    free(decoder->blocks);
+    free(decoder->known);
+    free(decoder->neighbours);
+    free(decoder->stack);
+    fountainFree(&decoder->code);
+    memset(decoder, 0, sizeof(*decoder));
+}
@@ -1,9 +1,13 @@
 // Link layer protocol implementation
 
 #include "link_layer.h"
+#include "link_layer_ext.h"
+#include "log.h"
 #include "serial_port.h"
 #include <signal.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
@@ -28,6 +32,9 @@ static unsigned int actual_bytes_sent = 0;
 #define CTRL_REJ0 0x54
 #define CTRL_REJ1 0x55
 #define CTRL_DISC 0x0B
+#define CTRL_UI 0x13 // unnumbered information: never acknowledged
+#define CTRL_AGG0 0x20 // I0 frame holding several length-prefixed packets
+#define CTRL_AGG1 0xA0 // I1 frame holding several length-prefixed packets
 #define ADDR_SX 0x03
 #define ADDR_RX 0x01
 
@@ -40,6 +47,7 @@ int MAX_ALARM_REPEATS = 5;
 #define ESCAPE 0x7D
 #define SPECIAL_MASK 0x20
 #define LLWRITE_EXTRA_BIT_NUM 8
+#define AGG_LENGTH_BYTES 2 // before each packet of an aggregated frame
 
 int alarmEnabled = FALSE;
 int alarmCount = 0;
@@ -52,7 +60,7 @@ void alarmHandler(int signal)
 
     alarmCount++;
 
-    printf("Alarm #%d\n", alarmCount);
+    LOG_WARN("Alarm #%d\n", alarmCount);
 }
 
 ////////////////////////////////////////////////
@@ -82,7 +90,7 @@ static int open_port_called = FALSE;
 
 int llopen(LinkLayer connectionParameters)
 {
-    printf("llopen called\n");
+    LOG_DEBUG("llopen called\n");
     if (!open_port_called)
     {
         open_port_called = TRUE;
@@ -97,7 +105,7 @@ int llopen(LinkLayer connectionParameters)
     }
     MAX_ALARM_REPEATS = connectionParameters.nRetransmissions;
     TIMEOUT = connectionParameters.timeout;
-    printf("Alarm set!\n");
+    LOG_DEBUG("Alarm set!\n");
 
     frame_num = 0;
 
@@ -128,7 +136,7 @@ int llopen(LinkLayer connectionParameters)
             {
                 writeBytesSerialPort(SET, SHORT_MESSAGE_SIZE);
 
-                printf("Wrote set message!\n");
+                LOG_DEBUG("Wrote set message!\n");
             }
             alarm(TIMEOUT);
         }
@@ -149,7 +157,7 @@ int llopen(LinkLayer connectionParameters)
                 {
                     state = STATE_FLAG_RCV;
 
-                    printf("read flag\n");
+                    LOG_TRACE("read flag\n");
                 }
                 break;
 
@@ -161,7 +169,7 @@ int llopen(LinkLayer connectionParameters)
                 if (buf == expected_address_flag)
                 {
                     state = STATE_A_RCV;
-                    printf("read address\n");
+                    LOG_TRACE("read address\n");
                     break;
                 }
                 state = STATE_START;
@@ -176,7 +184,7 @@ int llopen(LinkLayer connectionParameters)
                 if (buf == expected_code)
                 {
                     state = STATE_C_RCV;
-                    printf("read code\n");
+                    LOG_TRACE("read code\n");
                     break;
                 }
                 state = STATE_START;
@@ -191,7 +199,7 @@ int llopen(LinkLayer connectionParameters)
                 if (buf == (expected_address_flag ^ expected_code))
                 {
                     state = STATE_BCC_OK;
-                    printf("read error correction\n");
+                    LOG_TRACE("read error correction\n");
                     break;
                 }
                 state = STATE_START;
@@ -200,7 +208,7 @@ int llopen(LinkLayer connectionParameters)
             case STATE_BCC_OK:
                 if (buf == FLAG)
                 {
-                    printf("read final flag\n");
+                    LOG_TRACE("read final flag\n");
                     alarm(0);
                     alarmEnabled = FALSE;
                     if (connectionParameters.role == LlRx)
@@ -243,61 +251,76 @@ enum WRITE_STATE
     STATE_WRITE_REPEAT_UA_BCC_CORRECT = 6
 };
 
-int llwrite(const unsigned char *buf, int bufSize)
+// Frames buf with the given address and control fields, byte stuffing the
+// data and BCC2. frame must have room for 2 * bufSize + LLWRITE_EXTRA_BIT_NUM
+// bytes. Returns the size of the frame.
+static int build_frame(unsigned char address, unsigned char control, const unsigned char *buf, int bufSize, unsigned char *frame)
 {
-    printf("frame ordering: %d\n", frame_num ? 1 : 0);
-    alarmCount = 0;
-
-    unsigned char to_send[bufSize + LLWRITE_EXTRA_BIT_NUM];
-    to_send[0] = FLAG;
-    to_send[1] = ADDR_SX;
-    if (frame_num == 0)
-    {
-        to_send[2] = CTRL_I0;
-    }
-    else
-    {
-        to_send[2] = CTRL_I1;
-    }
-    to_send[3] = to_send[1] ^ to_send[2];
+    frame[0] = FLAG;
+    frame[1] = address;
+    frame[2] = control;
+    frame[3] = frame[1] ^ frame[2];
     int num_bytes = 4;
 
     unsigned char bcc2 = 0;
     for (size_t i = 0; i < bufSize; i++)
     {
-        printf("byte: 0x%2x\n", buf[i]);
+        LOG_TRACE("byte: 0x%2x\n", buf[i]);
         bcc2 ^= buf[i];
         if (buf[i] == ESCAPE || buf[i] == FLAG)
         {
-            to_send[num_bytes] = ESCAPE;
+            frame[num_bytes] = ESCAPE;
             num_bytes++;
-            to_send[num_bytes] = buf[i] ^ SPECIAL_MASK;
+            frame[num_bytes] = buf[i] ^ SPECIAL_MASK;
             num_bytes++;
         }
         else
         {
-            to_send[num_bytes] = buf[i];
+            frame[num_bytes] = buf[i];
             num_bytes++;
         }
     }
 
-    printf("bcc2: %d (0x%2x)\n", bcc2, bcc2);
+    LOG_TRACE("bcc2: %d (0x%2x)\n", bcc2, bcc2);
     if (bcc2 == ESCAPE || bcc2 == FLAG)
     {
-        to_send[num_bytes] = ESCAPE;
+        frame[num_bytes] = ESCAPE;
         num_bytes++;
-        to_send[num_bytes] = bcc2 ^ SPECIAL_MASK;
-        printf("bcc2 transformed: %d\n", bcc2 ^ SPECIAL_MASK);
+        frame[num_bytes] = bcc2 ^ SPECIAL_MASK;
+        LOG_TRACE("bcc2 transformed: %d\n", bcc2 ^ SPECIAL_MASK);
         num_bytes++;
     }
     else
     {
-        to_send[num_bytes] = bcc2;
+        frame[num_bytes] = bcc2;
         num_bytes++;
     }
-    to_send[num_bytes] = FLAG;
+    frame[num_bytes] = FLAG;
     num_bytes++;
 
+    return num_bytes;
+}
+
+// Packets queued by llwriteQueued, length-prefixed as in an aggregated frame
+static unsigned char queued[MAX_PAYLOAD_SIZE];
+static int queued_size = 0;
+static int queued_count = 0;
+
+// Packets of the last aggregated frame received, not yet returned by llread
+static unsigned char unpacked[MAX_PAYLOAD_SIZE + 1];
+static int unpacked_size = 0;
+static int unpacked_index = 0;
+
+static int write_numbered(const unsigned char *buf, int bufSize, int aggregated)
+{
+    LOG_TRACE("frame ordering: %d\n", frame_num ? 1 : 0);
+    alarmCount = 0;
+
+    unsigned char control = aggregated ? (frame_num == 0 ? CTRL_AGG0 : CTRL_AGG1)
+                                       : (frame_num == 0 ? CTRL_I0 : CTRL_I1);
+    unsigned char to_send[2 * bufSize + LLWRITE_EXTRA_BIT_NUM];
+    int num_bytes = build_frame(ADDR_SX, control, buf, bufSize, to_send);
+
     bytes_sent += num_bytes;
 
     enum WRITE_STATE state = STATE_WRITE_START;
@@ -314,7 +337,7 @@ int llwrite(const unsigned char *buf, int bufSize)
             {
                 return -1;
             }
-            printf("sent message\n");
+            LOG_DEBUG("sent message\n");
             actual_bytes_sent += num_bytes;
             alarm(TIMEOUT);
         }
@@ -335,41 +358,47 @@ int llwrite(const unsigned char *buf, int bufSize)
                 if (bt == FLAG)
                 {
                     state = STATE_WRITE_FLAG_RCV;
-                    printf("received flag (0x%2x)\n", bt);
+                    LOG_TRACE("received flag (0x%2x)\n", bt);
                     break;
                 }
-                printf("Should have been flag\n");
+                LOG_WARN("Should have been flag\n");
                 break;
 
             case STATE_WRITE_FLAG_RCV:
                 if (bt == FLAG)
                 {
-                    printf("found flag instead of address\n");
+                    LOG_TRACE("found flag instead of address\n");
                     break;
                 }
                 if (bt == ADDR_SX)
                 {
                     state = STATE_WRITE_A_RCV;
-                    printf("read address\n");
+                    LOG_TRACE("read address\n");
                     break;
                 }
-                printf("wrong address: 0x%2x\n", bt);
+                LOG_WARN("wrong address: 0x%2x\n", bt);
                 state = STATE_WRITE_START;
                 break;
 
             case STATE_WRITE_A_RCV:
                 if (bt == FLAG)
                 {
-                    printf("found flag instead of command\n");
+                    LOG_TRACE("found flag instead of command\n");
                     state = STATE_WRITE_FLAG_RCV;
                     break;
                 }
 
                 code = bt;
+                if (code == CTRL_UI)
+                {
+                    LOG_DEBUG("Ignoring an unnumbered frame\n");
+                    state = STATE_WRITE_START;
+                    break;
+                }
                 if (code == CTRL_UA)
                 {
                     state = STATE_WRITE_REPEAT_UA_RECEIVED;
-                    printf("Random UA received!\n");
+                    LOG_WARN("Random UA received!\n");
                     break;
                 }
 
@@ -377,29 +406,29 @@ int llwrite(const unsigned char *buf, int bufSize)
                 {
                     if ((code == CTRL_REJ0) || (code == CTRL_RR1))
                     {
-                        printf("Read correct command(0x%2x)\n", code);
+                        LOG_TRACE("Read correct command(0x%2x)\n", code);
                         state = STATE_WRITE_C_RCV;
                         break;
                     }
                     else if ((code == CTRL_REJ1) || (code == CTRL_RR0))
                     {
-                        printf("Command read: out of sync!!\n");
+                        LOG_WARN("Command read: out of sync!!\n");
                         if (num_tries < TRIES)
                         {
                             if (rrLostTries > RR_LOST_TRIES && code == CTRL_REJ1)
                             {
-                                printf("Assumed rr lost, moving to next frame\n");
+                                LOG_WARN("Assumed rr lost, moving to next frame\n");
                                 frame_num = !frame_num;
                                 return -2;
                             }
-                            printf("Retrying rr reception\n");
+                            LOG_WARN("Retrying rr reception\n");
                             state = STATE_WRITE_START;
                             rrLostTries++;
                             break;
                         }
                         else
                         {
-                            printf("Skipping to next frame\n");
+                            LOG_WARN("Skipping to next frame\n");
                             frame_num = !frame_num;
                             alarm(0);
                             alarmEnabled = FALSE;
@@ -408,17 +437,17 @@ int llwrite(const unsigned char *buf, int bufSize)
                     }
                     else
                     {
-                        printf("didn't read the correct command:  0x%2x\n", code);
+                        LOG_WARN("didn't read the correct command:  0x%2x\n", code);
                         if (rrLostTries < TRIES)
                         {
-                            printf("Retrying rr reception\n");
+                            LOG_WARN("Retrying rr reception\n");
                             state = STATE_WRITE_START;
                             rrLostTries++;
                             break;
                         }
                         else
                         {
-                            printf("Serious error - exiting the program\n\n");
+                            LOG_ERROR("Serious error - exiting the program\n\n");
                             frame_num = !frame_num;
                             alarm(0);
                             alarmEnabled = FALSE;
@@ -431,29 +460,29 @@ int llwrite(const unsigned char *buf, int bufSize)
 
                     if ((code == CTRL_REJ1) || (code == CTRL_RR0))
                     {
-                        printf("Read correct command(0x%2x)\n", code);
+                        LOG_TRACE("Read correct command(0x%2x)\n", code);
                         state = STATE_WRITE_C_RCV;
                         break;
                     }
                     else if ((code == CTRL_REJ0) || (code == CTRL_RR1))
                     {
-                        printf("Command read: out of sync!!\n");
+                        LOG_WARN("Command read: out of sync!!\n");
                         if (rrLostTries < TRIES)
                         {
                             if (rrLostTries > RR_LOST_TRIES && code == CTRL_REJ0)
                             {
-                                printf("Assumed rr lost, moving to next frame\n");
+                                LOG_WARN("Assumed rr lost, moving to next frame\n");
                                 frame_num = !frame_num;
                                 return -2;
                             }
-                            printf("Retrying rr reception\n");
+                            LOG_WARN("Retrying rr reception\n");
                             state = STATE_WRITE_START;
                             rrLostTries++;
                             break;
                         }
                         else
                         {
-                            printf("Skipping to next frame\n");
+                            LOG_WARN("Skipping to next frame\n");
                             frame_num = !frame_num;
                             alarm(0);
                             alarmEnabled = FALSE;
@@ -463,17 +492,17 @@ int llwrite(const unsigned char *buf, int bufSize)
                     else
                     {
 
-                        printf("didn't read the correct command:  0x%2x\n", code);
+                        LOG_WARN("didn't read the correct command:  0x%2x\n", code);
                         if (rrLostTries < TRIES)
                         {
-                            printf("Retrying rr reception\n");
+                            LOG_WARN("Retrying rr reception\n");
                             state = STATE_WRITE_START;
                             rrLostTries++;
                             break;
                         }
                         else
                         {
-                            printf("Serious error - exiting the program\n\n");
+                            LOG_ERROR("Serious error - exiting the program\n\n");
                             frame_num = !frame_num;
                             alarm(0);
                             alarmEnabled = FALSE;
@@ -488,17 +517,17 @@ int llwrite(const unsigned char *buf, int bufSize)
             case STATE_WRITE_C_RCV:
                 if (bt == FLAG)
                 {
-                    printf("found flag instead of bcc\n");
+                    LOG_TRACE("found flag instead of bcc\n");
                     state = STATE_WRITE_FLAG_RCV;
                     break;
                 }
                 if (bt == (ADDR_SX ^ code))
                 {
                     state = STATE_WRITE_BCC_CORRECT;
-                    printf("read correct bcc\n");
+                    LOG_TRACE("read correct bcc\n");
                     break;
                 }
-                printf("problem in error correction: %d read, %d expected\n", bt, ADDR_SX ^ code);
+                LOG_WARN("problem in error correction: %d read, %d expected\n", bt, ADDR_SX ^ code);
                 state = STATE_WRITE_START;
                 break;
 
@@ -511,7 +540,7 @@ int llwrite(const unsigned char *buf, int bufSize)
                 if (bt == (ADDR_SX ^ CTRL_UA))
                 {
                     state = STATE_WRITE_BCC_CORRECT;
-                    printf("read error correction (repeat ua)\n");
+                    LOG_TRACE("read error correction (repeat ua)\n");
                     break;
                 }
                 state = STATE_WRITE_START;
@@ -522,13 +551,13 @@ int llwrite(const unsigned char *buf, int bufSize)
             case STATE_WRITE_BCC_CORRECT:
                 if (bt == FLAG)
                 {
-                    printf("read final flag\n");
+                    LOG_TRACE("read final flag\n");
 
                     if (frame_num == 0)
                     {
                         if (code == CTRL_REJ0)
                         {
-                            printf("resend 0\n");
+                            LOG_WARN("resend 0\n");
                             errors_read += 1;
                             state = STATE_WRITE_START;
                             alarmCount = 0;
@@ -536,21 +565,21 @@ int llwrite(const unsigned char *buf, int bufSize)
                         else if (code == CTRL_RR1)
                         {
 
-                            printf("send next 1\n\n");
+                            LOG_DEBUG("send next 1\n\n");
                             frame_num = !frame_num;
                             alarm(0);
                             alarmEnabled = FALSE;
 
                             return num_bytes;
                         }
-                        printf("shouldn't happen without resend 0\n");
+                        LOG_WARN("shouldn't happen without resend 0\n");
                         // WHAT HAPPENS IF RRO?
                     }
                     else
                     {
                         if (code == CTRL_REJ1)
                         {
-                            printf("resend 1\n");
+                            LOG_WARN("resend 1\n");
                             errors_read += 1;
                             state = STATE_WRITE_START;
                             alarmCount = 0;
@@ -561,17 +590,17 @@ int llwrite(const unsigned char *buf, int bufSize)
                             frame_num = !frame_num;
                             alarm(0);
                             alarmEnabled = FALSE;
-                            printf("send next 0\n\n");
+                            LOG_DEBUG("send next 0\n\n");
 
                             return num_bytes;
                         }
-                        printf("shouldn't happen without resend 1\n");
+                        LOG_WARN("shouldn't happen without resend 1\n");
                         // WHAT HAPPENS IF RR1?
                     }
                 }
                 else
                 {
-                    printf("Didn't read final flag - resetting\n");
+                    LOG_WARN("Didn't read final flag - resetting\n");
                     state = STATE_WRITE_START;
                 }
                 break;
@@ -582,10 +611,85 @@ int llwrite(const unsigned char *buf, int bufSize)
             return -1;
         }
     }
-    printf("write timeout\n");
+    LOG_ERROR("write timeout\n");
     return -1;
 }
 
+int llflush()
+{
+    if (queued_count == 0)
+    {
+        return 0;
+    }
+    int count = queued_count, res;
+    queued_count = 0;
+    if (count == 1)
+    {
+        res = write_numbered(queued + AGG_LENGTH_BYTES, queued_size - AGG_LENGTH_BYTES, FALSE);
+    }
+    else
+    {
+        LOG_DEBUG("sending %d packets in one frame\n", count);
+        res = write_numbered(queued, queued_size, TRUE);
+    }
+    queued_size = 0;
+    return res < 0 ? res : count;
+}
+
+int llwriteQueued(const unsigned char *buf, int bufSize)
+{
+    if (queued_size + AGG_LENGTH_BYTES + bufSize > MAX_PAYLOAD_SIZE)
+    {
+        int res = llflush();
+        if (res < 0)
+        {
+            return res;
+        }
+        if (AGG_LENGTH_BYTES + bufSize > MAX_PAYLOAD_SIZE)
+        {
+            return write_numbered(buf, bufSize, FALSE); // too big to share a frame
+        }
+    }
+    queued[queued_size] = bufSize >> 8;
+    queued[queued_size + 1] = bufSize & 0xFF;
+    memcpy(queued + queued_size + AGG_LENGTH_BYTES, buf, bufSize);
+    queued_size += AGG_LENGTH_BYTES + bufSize;
+    queued_count++;
+    return bufSize;
+}
+
+int llwrite(const unsigned char *buf, int bufSize)
+{
+    int res = llflush(); // keep the packets in order
+    if (res < 0)
+    {
+        return res;
+    }
+    return write_numbered(buf, bufSize, FALSE);
+}
+
+// Returns the next packet of the last aggregated frame received, or 0 if
+// there are none left.
+static int next_unpacked(unsigned char *packet)
+{
+    if (unpacked_index + AGG_LENGTH_BYTES > unpacked_size)
+    {
+        unpacked_size = unpacked_index = 0;
+        return 0;
+    }
+    int size = (unpacked[unpacked_index] << 8) | unpacked[unpacked_index + 1];
+    unpacked_index += AGG_LENGTH_BYTES;
+    if (size == 0 || unpacked_index + size > unpacked_size)
+    {
+        LOG_ERROR("Malformed aggregated frame\n");
+        unpacked_size = unpacked_index = 0;
+        return -1;
+    }
+    memcpy(packet, unpacked + unpacked_index, size);
+    unpacked_index += size;
+    return size;
+}
+
 ////////////////////////////////////////////////
 // LLREAD
 ////////////////////////////////////////////////
@@ -635,10 +739,10 @@ int terminate_reader()
                 {
                     state = RTERM_STATE_FLAG_RCV;
 
-                    printf("term read flag\n");
+                    LOG_TRACE("term read flag\n");
                     break;
                 }
-                printf("Should have been flag\n");
+                LOG_WARN("Should have been flag\n");
                 break;
 
             case RTERM_STATE_FLAG_RCV:
@@ -649,7 +753,7 @@ int terminate_reader()
                 if (buf == expected_address_flag)
                 {
                     state = RTERM_STATE_A_RCV;
-                    printf("term read address\n");
+                    LOG_TRACE("term read address\n");
                     break;
                 }
                 state = RTERM_STATE_START;
@@ -664,7 +768,7 @@ int terminate_reader()
                 if (buf == expected_code)
                 {
                     state = RTERM_STATE_C_RCV;
-                    printf("term read code\n");
+                    LOG_TRACE("term read code\n");
                     break;
                 }
                 state = RTERM_STATE_START;
@@ -679,7 +783,7 @@ int terminate_reader()
                 if (buf == (expected_address_flag ^ expected_code))
                 {
                     state = RTERM_STATE_BCC_OK;
-                    printf("term read error correction\n");
+                    LOG_TRACE("term read error correction\n");
                     break;
                 }
                 state = RTERM_STATE_START;
@@ -688,7 +792,7 @@ int terminate_reader()
             case RTERM_STATE_BCC_OK:
                 if (buf == FLAG)
                 {
-                    printf("term read final flag\n");
+                    LOG_TRACE("term read final flag\n");
                     ;
                     alarmEnabled = FALSE;
                     alarmCount = 0;
@@ -733,13 +837,58 @@ int data_is_correct(unsigned char *data, unsigned int data_length, unsigned char
     {
         res ^= data[i];
     }
-    printf("bcc2 created: %d, bcc2 received with message:%d\n", res, bbc2);
+    LOG_TRACE("bcc2 created: %d, bcc2 received with message:%d\n", res, bbc2);
     return res == bbc2;
 }
 
+// Check of the data of I frames set with llsetDataCheck, NULL to accept all
+static int (*data_check)(const unsigned char *data, int size) = NULL;
+
+void llsetDataCheck(int (*check)(const unsigned char *data, int size))
+{
+    data_check = check;
+}
+
+// Whether the data of an I frame passes the check, packet by packet in an
+// aggregated frame.
+static int data_is_accepted(const unsigned char *data, int size, int aggregated)
+{
+    if (data_check == NULL)
+    {
+        return TRUE;
+    }
+    if (!aggregated)
+    {
+        return data_check(data, size);
+    }
+    for (int index = 0; index + AGG_LENGTH_BYTES <= size;)
+    {
+        int length = (data[index] << 8) | data[index + 1];
+        index += AGG_LENGTH_BYTES;
+        if (length == 0 || index + length > size || !data_check(data + index, length))
+        {
+            return FALSE;
+        }
+        index += length;
+    }
+    return TRUE;
+}
+
 int llread(unsigned char *packet) // buffer already instantiated
 {
-    printf("frame ordering: %d\n", frame_num ? 1 : 0);
+    if (unpacked_size > 0)
+    {
+        int size = next_unpacked(packet);
+        if (size != 0)
+        {
+            return size;
+        }
+    }
+    if (llflush() < 0) // the other side may be waiting for them
+    {
+        return -1;
+    }
+    LOG_TRACE("frame ordering: %d\n", frame_num ? 1 : 0);
 
     alarmCount = 0;
     enum READ_STATE state = 0;
@@ -747,6 +896,7 @@ int llread(unsigned char *packet) // buffer already instantiated
 
     unsigned char buf, expected_address_flag = ADDR_SX, expected_code, expected_rej, expected_rr, out_of_order_frame_code, received_code, attemptCount = 0;
     unsigned int current_data_index = 0;
+    int aggregated = FALSE;
 
     if (frame_num == 0)
     {
@@ -781,9 +931,9 @@ int llread(unsigned char *packet) // buffer already instantiated
         {
             alarmCount = 0;
 
-            if (current_data_index > MAX_PAYLOAD_SIZE)
+            if (current_data_index > MAX_PAYLOAD_SIZE + 1) // payload and BCC2
             {
-                printf("Overflow danger: end flag not found for too long!!!\n");
+                LOG_ERROR("Overflow danger: end flag not found for too long!!!\n");
                 return -1;
             }
             switch (state)
@@ -794,23 +944,23 @@ int llread(unsigned char *packet) // buffer already instantiated
                 {
                     state = STATE_READ_FLAG_RCV;
 
-                    printf("read flag 1\n");
+                    LOG_TRACE("read flag 1\n");
                 }
                 break;
 
             case STATE_READ_FLAG_RCV:
                 if (buf == FLAG)
                 {
-                    printf("found flag instead of address\n");
+                    LOG_TRACE("found flag instead of address\n");
                     break;
                 }
                 if (buf == expected_address_flag)
                 {
                     state = STATE_READ_A_RCV;
-                    printf("read address\n");
+                    LOG_TRACE("read address\n");
                     break;
                 }
-                printf("read wrong address:  0x%2x\n", buf);
+                LOG_WARN("read wrong address:  0x%2x\n", buf);
                 state = STATE_READ_START;
                 break;
 
@@ -818,38 +968,52 @@ int llread(unsigned char *packet) // buffer already instantiated
                 if (buf == FLAG)
                 {
                     state = STATE_READ_FLAG_RCV;
-                    printf("found flag instead of code\n");
+                    LOG_TRACE("found flag instead of code\n");
                     break;
                 }
                 if (buf == CTRL_SET)
                 {
                     received_code = CTRL_SET;
                     state = STATE_READ_SET;
-                    printf("read set code\n");
+                    LOG_TRACE("read set code\n");
                     break;
                 }
                 if (buf == CTRL_DISC)
                 {
                     received_code = CTRL_DISC;
                     state = STATE_READ_DISC;
-                    printf("read disc code\n");
+                    LOG_TRACE("read disc code\n");
                     break;
                 }
                 if (buf == expected_code)
                 {
                     received_code = expected_code;
                     state = STATE_READ_C_RCV;
-                    printf("read frame code\n");
+                    LOG_TRACE("read frame code\n");
                     break;
                 }
                 if (buf == out_of_order_frame_code)
                 {
                     received_code = out_of_order_frame_code;
                     state = STATE_READ_C_RCV;
-                    printf("read out of order frame code\n");
+                    LOG_TRACE("read out of order frame code\n");
+                    break;
+                }
+                if (buf == CTRL_UI)
+                {
+                    received_code = CTRL_UI;
+                    state = STATE_READ_C_RCV;
+                    LOG_TRACE("read unnumbered frame code\n");
                     break;
                 }
-                printf("Read wrong code: 0x%2x\n", buf);
+                if (buf == CTRL_AGG0 || buf == CTRL_AGG1)
+                {
+                    received_code = buf; // numbered like I0/I1 at the final flag
+                    state = STATE_READ_C_RCV;
+                    LOG_TRACE("read aggregated frame code\n");
+                    break;
+                }
+                LOG_WARN("Read wrong code: 0x%2x\n", buf);
                 received_code = buf;
                 state = STATE_READ_C_RCV; // TODO: I don't like this, but it has to be, just in case it's a data frame. I don't want "arbitrary code execution" here at all
                 break;
@@ -858,7 +1022,7 @@ int llread(unsigned char *packet) // buffer already instantiated
                 if (buf == FLAG)
                 {
 
-                    printf("read flag instead of bcc!!!\n");
+                    LOG_WARN("read flag instead of bcc!!!\n");
 
                     state = STATE_READ_FLAG_RCV;
                     break;
@@ -866,10 +1030,10 @@ int llread(unsigned char *packet) // buffer already instantiated
                 if (buf == (expected_address_flag ^ received_code))
                 {
                     state = STATE_READ_SET_BCC_OK;
-                    printf("read set bbc ok\n");
+                    LOG_TRACE("read set bbc ok\n");
                     break;
                 }
-                printf("(set) bcc wrong\n");
+                LOG_WARN("(set) bcc wrong\n");
                 state = STATE_READ_DATA;
                 break;
             case STATE_READ_SET_BCC_OK:
@@ -880,10 +1044,10 @@ int llread(unsigned char *packet) // buffer already instantiated
                     alarmEnabled = FALSE;
                     alarmCount = 0;
                     writeBytesSerialPort(UA, SHORT_MESSAGE_SIZE);
-                    printf("Had to send another UA!");
+                    LOG_WARN("Had to send another UA!");
                     return -4; // also not a documented return value, but could be useful
                 }
-                printf("Didn't find the final flag of a set command!");
+                LOG_WARN("Didn't find the final flag of a set command!");
 
                 state = STATE_READ_DATA; // TODO: I hate that I have to do this, but I have no alternative. Many errors could happen if I didn't
                 break;
@@ -898,7 +1062,7 @@ int llread(unsigned char *packet) // buffer already instantiated
                 if (buf == (expected_address_flag ^ received_code))
                 {
                     state = STATE_READ_DISC_BCC_OK;
-                    printf("bbc ok\n");
+                    LOG_TRACE("bbc ok\n");
                     break;
                 }
                 state = STATE_READ_START;
@@ -907,7 +1071,7 @@ int llread(unsigned char *packet) // buffer already instantiated
             case STATE_READ_DISC_BCC_OK:
                 if (buf == FLAG)
                 {
-                    printf("terminating reader function called!\n");
+                    LOG_DEBUG("terminating reader function called!\n");
                     return (terminate_reader() == 1) ? -2 : -3;
                 }
                 state = STATE_READ_START;
@@ -917,7 +1081,7 @@ int llread(unsigned char *packet) // buffer already instantiated
             case STATE_READ_C_RCV:
                 if (buf == FLAG)
                 {
-                    printf("Found flag instead of bcc\n");
+                    LOG_WARN("Found flag instead of bcc\n");
                     state = STATE_READ_FLAG_RCV;
                     break;
                 }
@@ -926,13 +1090,13 @@ int llread(unsigned char *packet) // buffer already instantiated
 
                     state = STATE_READ_DATA;
 
-                    printf("bcc correct\n");
+                    LOG_TRACE("bcc correct\n");
                     break;
                 }
-                printf("bcc incorrect\n");
+                LOG_WARN("bcc incorrect\n");
                 if (received_code != CTRL_DISC && received_code != CTRL_SET)
                 {
-                    printf("Assuming data frame -> must not be induced in error due to possible frame content\n");
+                    LOG_WARN("Assuming data frame -> must not be induced in error due to possible frame content\n");
                     state = STATE_READ_DATA; // will this fix the problems?
                     break;
                 }
@@ -942,31 +1106,55 @@ int llread(unsigned char *packet) // buffer already instantiated
             case STATE_READ_DATA:
                 if (buf == FLAG)
                 {
-                    printf("read final flag\n");
+                    LOG_TRACE("read final flag\n");
+
+                    aggregated = received_code == CTRL_AGG0 || received_code == CTRL_AGG1;
+                    if (aggregated)
+                    {
+                        received_code = received_code == CTRL_AGG0 ? CTRL_I0 : CTRL_I1;
+                    }
+
+                    if (received_code == CTRL_UI)
+                    {
+                        // Delivered as is: no RR/REJ, and frame_num is left alone
+                        if (current_data_index > 0 &&
+                            data_is_correct(packet, current_data_index - 1, packet[current_data_index - 1]))
+                        {
+                            LOG_DEBUG("unnumbered frame received\n");
+                            alarm(0);
+                            alarmEnabled = FALSE;
+                            return current_data_index - 1;
+                        }
+                        LOG_WARN("bcc2 incorrect in an unnumbered frame, dropped\n");
+                        errors_read++;
+                        current_data_index = 0;
+                        state = STATE_READ_START;
+                        break;
+                    }
 
                     if (received_code == out_of_order_frame_code)
                     {
-                        printf("out of order frame received\n");
+                        LOG_WARN("out of order frame received\n");
                         current_data_index = 0;
                         int rs;
                         if (expected_rej == CTRL_REJ0)
                         {
-                            printf("rej0\n");
+                            LOG_WARN("rej0\n");
                             rs = writeBytesSerialPort(REJ0, SHORT_MESSAGE_SIZE);
                         }
                         else
                         {
-                            printf("rej1\n");
+                            LOG_WARN("rej1\n");
                             rs = writeBytesSerialPort(REJ1, SHORT_MESSAGE_SIZE);
                         }
                         // TODO: maybe don't send this?
                         if (rs == -1)
                         {
-                            printf("Error sending REJ\n");
+                            LOG_ERROR("Error sending REJ\n");
                             if (attemptCount < TRIES)
                             {
                                 attemptCount++;
-                                printf("Retrying reception\n");
+                                LOG_WARN("Retrying reception\n");
                                 state = STATE_READ_START;
                                 break;
                             }
@@ -975,7 +1163,7 @@ int llread(unsigned char *packet) // buffer already instantiated
                                 alarm(0);
                                 alarmEnabled = FALSE;
 
-                                printf("Irrecoverable send REJ error\n\n");
+                                LOG_ERROR("Irrecoverable send REJ error\n\n");
 
                                 return -1;
                             }
@@ -984,7 +1172,7 @@ int llread(unsigned char *packet) // buffer already instantiated
                         if (attemptCount < TRIES)
                         {
                             attemptCount++;
-                            printf("Retrying reception\n");
+                            LOG_WARN("Retrying reception\n");
                             state = STATE_READ_START;
                             break;
                         }
@@ -993,7 +1181,7 @@ int llread(unsigned char *packet) // buffer already instantiated
                             alarm(0);
                             alarmEnabled = FALSE;
 
-                            printf("Irrecoverable sync error\n\n");
+                            LOG_ERROR("Irrecoverable sync error\n\n");
 
                             return -1;
                         }
@@ -1006,7 +1194,7 @@ int llread(unsigned char *packet) // buffer already instantiated
                         if (attemptCount < TRIES)
                         {
                             attemptCount++;
-                            printf("Retrying reception due to error control\n");
+                            LOG_WARN("Retrying reception due to error control\n");
                             state = STATE_READ_START;
                             break;
                         }
@@ -1015,43 +1203,52 @@ int llread(unsigned char *packet) // buffer already instantiated
                             alarm(0);
                             alarmEnabled = FALSE;
 
-                            printf("Irrecoverable command related error\n\n");
+                            LOG_ERROR("Irrecoverable command related error\n\n");
 
                             return -1;
                         }
                     }
 
                     current_data_index--;
-                    if (data_is_correct(packet, current_data_index, packet[current_data_index]))
+                    if (data_is_correct(packet, current_data_index, packet[current_data_index]) &&
+                        data_is_accepted(packet, current_data_index, aggregated))
                     {
-                        printf("data received!\n");
+                        LOG_DEBUG("data received!\n");
                         int res;
                         if (expected_rr == CTRL_RR0)
                         {
                             res = writeBytesSerialPort(RR0, SHORT_MESSAGE_SIZE);
 
-                            printf("sent rr0\n");
+                            LOG_DEBUG("sent rr0\n");
                         }
                         else
                         {
                             res = writeBytesSerialPort(RR1, SHORT_MESSAGE_SIZE);
-                            printf("sent rr1\n");
+                            LOG_DEBUG("sent rr1\n");
                         }
                         if (res != -1)
                         {
                             alarm(0);
                             alarmEnabled = FALSE;
                             frame_num = !frame_num;
+                            if (aggregated)
+                            {
+                                memcpy(unpacked, packet, current_data_index);
+                                unpacked_size = current_data_index;
+                                unpacked_index = 0;
+                                int size = next_unpacked(packet);
+                                return size > 0 ? size : -1;
+                            }
                             return current_data_index;
                         }
                         alarm(0);
                         alarmEnabled = FALSE;
-                        printf("error in sending rr");
+                        LOG_ERROR("error in sending rr");
                         return -1;
                     }
                     else
                     {
-                        printf("bbc2 incorrect!\n");
+                        LOG_WARN("bbc2 incorrect or data rejected!\n");
                         if (expected_rej == CTRL_REJ0)
                         {
                             writeBytesSerialPort(REJ0, SHORT_MESSAGE_SIZE);
@@ -1066,7 +1263,7 @@ int llread(unsigned char *packet) // buffer already instantiated
                             attemptCount++;
                             current_data_index = 0;
                             state = STATE_READ_START;
-                            printf("--> Retrying reception: %d/%d\n", attemptCount, TRIES);
+                            LOG_WARN("--> Retrying reception: %d/%d\n", attemptCount, TRIES);
                             break;
                         }
                         else
@@ -1081,25 +1278,25 @@ int llread(unsigned char *packet) // buffer already instantiated
                 }
                 else if (buf == ESCAPE)
                 {
-                    printf("escaped\n");
+                    LOG_TRACE("escaped\n");
                     state = STATE_READ_ESCAPED;
                 }
                 else
                 {
                     packet[current_data_index] = buf;
                     current_data_index++;
-                    printf("byte: 0x%2x\n", packet[current_data_index - 1]);
+                    LOG_TRACE("byte: 0x%2x\n", packet[current_data_index - 1]);
                 }
                 break;
 
             case STATE_READ_ESCAPED:
                 packet[current_data_index] = buf ^ SPECIAL_MASK;
-                printf("byte: 0x%2x\n", packet[current_data_index]);
+                LOG_TRACE("byte: 0x%2x\n", packet[current_data_index]);
                 current_data_index++;
                 state = STATE_READ_DATA;
                 break;
             default:
-                printf("I quit,\n");
+                LOG_ERROR("I quit,\n");
                 return -1;
                 break;
             }
@@ -1113,6 +1310,185 @@ int llread(unsigned char *packet) // buffer already instantiated
     return -1;
 }
 
+////////////////////////////////////////////////
+// UNACKNOWLEDGED FRAMES
+////////////////////////////////////////////////
+
+// Shared line (llopenShared): several receivers, each with its own address
+static int shared_line = FALSE;
+static LinkLayerRole shared_role;
+static unsigned char station_address = ADDR_SX;
+
+// Whether a UI frame with this address is meant for this station
+static int accepts_address(unsigned char address)
+{
+    if (!shared_line)
+    {
+        return address == ADDR_SX;
+    }
+    if (shared_role == LlTx)
+    {
+        return TRUE; // responses carry the address of the receiver
+    }
+    return address == station_address || address == LL_ADDR_BROADCAST;
+}
+
+int llopenShared(LinkLayer connectionParameters, unsigned char address)
+{
+    LOG_DEBUG("llopenShared called (address 0x%02x)\n", address);
+    if (!open_port_called)
+    {
+        if (openSerialPort(connectionParameters.serialPort, connectionParameters.baudRate) < 0)
+        {
+            return -1;
+        }
+        open_port_called = TRUE;
+    }
+    shared_line = TRUE;
+    shared_role = connectionParameters.role;
+    station_address = connectionParameters.role == LlTx ? LL_ADDR_BROADCAST : address;
+    return 1;
+}
+
+int llwriteTo(unsigned char address, const unsigned char *buf, int bufSize)
+{
+    if (llflush() < 0) // keep the packets in order
+    {
+        return -1;
+    }
+    unsigned char frame[2 * bufSize + LLWRITE_EXTRA_BIT_NUM];
+    int num_bytes = build_frame(address, CTRL_UI, buf, bufSize, frame);
+    bytes_sent += num_bytes;
+    actual_bytes_sent += num_bytes;
+    swrite_calls++;
+
+    for (int done = 0; done < num_bytes;)
+    {
+        int res = writeBytesSerialPort(frame + done, num_bytes - done);
+        if (res == -1)
+        {
+            return -1;
+        }
+        done += res;
+    }
+    LOG_TRACE("sent unnumbered frame to 0x%02x\n", address);
+    return bufSize;
+}
+
+int llwriteUnacked(const unsigned char *buf, int bufSize)
+{
+    return llwriteTo(station_address, buf, bufSize);
+}
+
+// Frame being received by llpollUnacked, kept between calls
+static unsigned char poll_frame[2 * MAX_PAYLOAD_SIZE + LLWRITE_EXTRA_BIT_NUM];
+static int poll_size = 0;
+
+// Consumes the bytes received so far, up to the end of the first complete
+// UI frame accepted by accepts_address.
+static int poll_unnumbered(unsigned char *packet, unsigned char *address)
+{
+    unsigned char buf;
+    int bytes;
+    while ((bytes = readByteSerialPort(&buf)) == 1)
+    {
+        if (buf != FLAG)
+        {
+            if (poll_size < sizeof(poll_frame))
+            {
+                poll_frame[poll_size++] = buf;
+            }
+            continue;
+        }
+
+        // Closing flag (or an opening one after idle bytes): A C BCC1 data BCC2
+        int size = poll_size;
+        poll_size = 0;
+        if (!shared_line && size == 3 && poll_frame[0] == ADDR_SX && poll_frame[2] == (ADDR_SX ^ poll_frame[1]))
+        {
+            // Session kept open over UI frames: the UA was lost, or it's over
+            if (poll_frame[1] == CTRL_SET && writeBytesSerialPort(UA, SHORT_MESSAGE_SIZE) == -1)
+            {
+                return -1;
+            }
+            if (poll_frame[1] == CTRL_DISC)
+            {
+                LOG_DEBUG("disc received\n");
+                return terminate_reader() == 1 ? -2 : -1;
+            }
+            continue;
+        }
+        if (size < 4 || !accepts_address(poll_frame[0]) || poll_frame[1] != CTRL_UI ||
+            poll_frame[2] != (poll_frame[0] ^ CTRL_UI))
+        {
+            continue;
+        }
+        int length = 0;
+        for (int i = 3; i < size && length <= MAX_PAYLOAD_SIZE; i++)
+        {
+            packet[length++] = poll_frame[i] == ESCAPE && i + 1 < size ? poll_frame[++i] ^ SPECIAL_MASK : poll_frame[i];
+        }
+        if (length > 0 && length <= MAX_PAYLOAD_SIZE + 1 &&
+            data_is_correct(packet, length - 1, packet[length - 1]))
+        {
+            LOG_DEBUG("unnumbered frame received from 0x%02x\n", poll_frame[0]);
+            *address = poll_frame[0];
+            return length - 1;
+        }
+        LOG_WARN("bcc2 incorrect in an unnumbered frame, dropped\n");
+        errors_read++;
+    }
+    return bytes == -1 ? -1 : 0;
+}
+
+int llpollUnacked(unsigned char *packet)
+{
+    unsigned char address;
+    return poll_unnumbered(packet, &address);
+}
+
+int llreadUnacked(unsigned char *packet, unsigned char *address, int timeoutMs)
+{
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (TRUE)
+    {
+        int res = poll_unnumbered(packet, address);
+        if (res != 0)
+        {
+            return res;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+        {
+            return 0;
+        }
+        struct timespec idle = {.tv_sec = 0, .tv_nsec = 100000}; // the port can't block
+        nanosleep(&idle, NULL);
+    }
+}
+
+int llcloseShared(int showStatistics)
+{
+    if (showStatistics == TRUE)
+    {
+        LOG_INFO("Wrote %u bytes in %u frames, %u corrupted frames received.\n", bytes_sent,
+                 swrite_calls, errors_read);
+    }
+    shared_line = FALSE;
+    station_address = ADDR_SX;
+    open_port_called = FALSE;
+    return closeSerialPort() != -1 ? 1 : -1;
+}
+
 ////////////////////////////////////////////////
 // LLCLOSE
 ////////////////////////////////////////////////
@@ -1126,10 +1502,14 @@ enum CLOSE_STATE
 };
 int llclose(int showStatistics)
 {
+    if (llflush() < 0)
+    {
+        return -1;
+    }
 
     if (showStatistics == TRUE)
     {
-        printf("Wrote %u unique bytes(%u counting repeated sends), with %u calls to llwrite (repeated frames included).\n", bytes_sent,
+        LOG_INFO("Wrote %u unique bytes(%u counting repeated sends), with %u calls to llwrite (repeated frames included).\n", bytes_sent,
                actual_bytes_sent, swrite_calls);
     }
     enum CLOSE_STATE state = CLOSE_STATE_START;
@@ -1141,7 +1521,7 @@ int llclose(int showStatistics)
     {
         if (alarmEnabled == FALSE)
         {
-            printf("wrote disc\n");
+            LOG_DEBUG("wrote disc\n");
             alarmEnabled = TRUE;
             if (writeBytesSerialPort(DISC, SHORT_MESSAGE_SIZE) == -1)
             {
@@ -1167,7 +1547,7 @@ int llclose(int showStatistics)
                 {
                     state = CLOSE_STATE_FLAG_RCV;
 
-                    printf("read flag\n");
+                    LOG_TRACE("read flag\n");
                 }
                 break;
 
@@ -1179,7 +1559,7 @@ int llclose(int showStatistics)
                 if (buf == expected_address_flag)
                 {
                     state = CLOSE_STATE_A_RCV;
-                    printf("read address\n");
+                    LOG_TRACE("read address\n");
                     break;
                 }
                 state = CLOSE_STATE_START;
@@ -1194,7 +1574,7 @@ int llclose(int showStatistics)
                 if (buf == expected_code)
                 {
                     state = CLOSE_STATE_C_RCV;
-                    printf("read code\n");
+                    LOG_TRACE("read code\n");
                     break;
                 }
                 state = CLOSE_STATE_START;
@@ -1209,7 +1589,7 @@ int llclose(int showStatistics)
                 if (buf == (expected_address_flag ^ expected_code))
                 {
                     state = CLOSE_STATE_BCC_OK;
-                    printf("read error correction\n");
+                    LOG_TRACE("read error correction\n");
                     break;
                 }
                 state = CLOSE_STATE_START;
@@ -1218,7 +1598,7 @@ int llclose(int showStatistics)
             case CLOSE_STATE_BCC_OK:
                 if (buf == FLAG)
                 {
-                    printf("read final flag\n");
+                    LOG_TRACE("read final flag\n");
 
                     alarmEnabled = FALSE;
                     alarmCount = 0;
@@ -0,0 +1,214 @@
+// Logging implementation
+
+#include "log.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define LOG_RING_SLOTS 1024 // power of 2
+#define LOG_MESSAGE_SIZE 160
+#define FLUSH_INTERVAL_NSEC 5000000 // 5 ms
+
+// Bounded multi-producer ring (both the link layer and the file threads log).
+// A slot is free for the producer holding ticket t when seq == t, and ready
+// for the flusher when seq == t + 1.
+typedef struct
+{
+    atomic_uint seq;
+    char text[LOG_MESSAGE_SIZE];
+} LogSlot;
+
+LogLevel logLevel = LogInfo;
+
+static LogSlot ring[LOG_RING_SLOTS];
+static atomic_uint writeTicket;
+static unsigned int readTicket; // Only used by the flusher
+static atomic_uint dropped;
+static atomic_int running = 0;
+static atomic_int stopRequested = 0;
+static pthread_t flusher;
+static FILE *output = NULL; // stdout unless changed by logSetOutput
+
+static const char *levelNames[] = {"trace", "debug", "info", "warn", "error", "off"};
+
+// Writes every ready message to the console.
+// Returns the number of messages written.
+static int drainRing()
+{
+    int count = 0;
+    for (;;)
+    {
+        LogSlot *slot = &ring[readTicket % LOG_RING_SLOTS];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != readTicket + 1)
+        {
+            break; // Not written yet
+        }
+        fputs(slot->text, output);
+        atomic_store_explicit(&slot->seq, readTicket + LOG_RING_SLOTS, memory_order_release);
+        readTicket++;
+        count++;
+    }
+
+    unsigned int lost = atomic_exchange(&dropped, 0);
+    if (lost > 0)
+    {
+        fprintf(output, "[log] %u messages dropped (ring full)\n", lost);
+    }
+    if (count > 0 || lost > 0)
+    {
+        fflush(output);
+    }
+    return count;
+}
+
+static void *flusherThread(void *arg)
+{
+    // The link layer timeouts (SIGALRM) belong to the main thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    struct timespec wait = {.tv_sec = 0, .tv_nsec = FLUSH_INTERVAL_NSEC};
+    while (!atomic_load(&stopRequested))
+    {
+        if (drainRing() == 0)
+        {
+            nanosleep(&wait, NULL);
+        }
+    }
+    drainRing();
+    return NULL;
+}
+
+void logInit()
+{
+    if (atomic_load(&running))
+    {
+        return;
+    }
+
+    if (output == NULL)
+    {
+        output = stdout;
+    }
+
+    const char *env = getenv("FTA_LOG_LEVEL");
+    if (env != NULL)
+    {
+        for (int level = LogTrace; level <= LogOff; level++)
+        {
+            if (strcasecmp(env, levelNames[level]) == 0)
+            {
+                logLevel = level;
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < LOG_RING_SLOTS; i++)
+    {
+        atomic_init(&ring[i].seq, i);
+    }
+    atomic_init(&writeTicket, 0);
+    readTicket = 0;
+
+    atomic_store(&stopRequested, 0);
+    if (pthread_create(&flusher, NULL, flusherThread, NULL) != 0)
+    {
+        fprintf(stderr, "Could not start the log flusher, logging directly\n");
+        return;
+    }
+    atomic_store(&running, 1);
+
+    static int registered = 0;
+    if (!registered)
+    {
+        atexit(logShutdown);
+        registered = 1;
+    }
+}
+
+void logWrite(LogLevel level, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    if (!atomic_load_explicit(&running, memory_order_acquire))
+    {
+        vfprintf(output != NULL ? output : stdout, format, args);
+        va_end(args);
+        return;
+    }
+
+    unsigned int ticket = atomic_load_explicit(&writeTicket, memory_order_relaxed);
+    LogSlot *slot;
+    for (;;)
+    {
+        slot = &ring[ticket % LOG_RING_SLOTS];
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int diff = (int)(seq - ticket);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&writeTicket, &ticket, ticket + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // Ring full: the flusher is behind, drop rather than block
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            va_end(args);
+            return;
+        }
+        else
+        {
+            ticket = atomic_load_explicit(&writeTicket, memory_order_relaxed);
+        }
+    }
+
+    int n = vsnprintf(slot->text, LOG_MESSAGE_SIZE, format, args);
+    if (n >= LOG_MESSAGE_SIZE)
+    {
+        // Truncated: keep the line break
+        slot->text[LOG_MESSAGE_SIZE - 2] = '\n';
+    }
+    va_end(args);
+    atomic_store_explicit(&slot->seq, ticket + 1, memory_order_release);
+}
+
+void logShutdown()
+{
+    if (!atomic_exchange(&running, 0))
+    {
+        return;
+    }
+    atomic_store(&stopRequested, 1);
+    if (!pthread_equal(pthread_self(), flusher))
+    {
+        pthread_join(flusher, NULL);
+    }
+}
+
+void logSetOutput(FILE *stream)
+{
+    // Let the flusher finish with the current stream first
+    int wasRunning = atomic_load(&running);
+    if (wasRunning)
+    {
+        logShutdown();
+    }
+    output = stream;
+    if (wasRunning)
+    {
+        logInit();
+    }
+}
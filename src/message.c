@@ -0,0 +1,161 @@
+// Message (request/response) layer implementation
+
+#include "message.h"
+#include "link_layer_ext.h"
+#include "log.h"
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MSG_REQUEST 1
+#define MSG_RESPONSE 2
+
+#define MSG_IDLE_WAIT_MS 1000 // server: llreadUnacked slice while idle
+#define MSG_MIN_RETRY_MS 10
+
+static void putHeader(unsigned char *message, unsigned char kind, uint16_t id)
+{
+    message[0] = kind;
+    message[1] = id >> 8;
+    message[2] = id & 0xFF;
+}
+
+static uint16_t getId(const unsigned char *message)
+{
+    return (message[1] << 8) | message[2];
+}
+
+void msgClientInit(MsgClient *client, int timeoutMs, int tries)
+{
+    // Start anywhere: a server still holding its response to a request of an
+    // earlier session would take a new request with the same id for a repeat
+    client->nextId = (uint16_t)(time(NULL) ^ getpid());
+    client->timeoutMs = timeoutMs;
+    client->tries = tries;
+    client->srttUs = 0;
+    client->rttvarUs = 0;
+}
+
+static int64_t monotonicUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Smoothed round trip time and deviation, as TCP does (RFC 6298)
+static void sampleRoundTrip(MsgClient *client, int64_t us)
+{
+    if (client->srttUs == 0)
+    {
+        client->srttUs = us;
+        client->rttvarUs = us / 2;
+        return;
+    }
+    int64_t deviation = client->srttUs > us ? client->srttUs - us : us - client->srttUs;
+    client->rttvarUs = (3 * client->rttvarUs + deviation) / 4;
+    client->srttUs = (7 * client->srttUs + us) / 8;
+}
+
+static int retryTimeoutMs(const MsgClient *client, int try)
+{
+    if (client->srttUs == 0 || try == client->tries - 1)
+    {
+        return client->timeoutMs;
+    }
+    int64_t ms = (client->srttUs + 4 * client->rttvarUs) / 1000 + 1;
+    ms = (ms < MSG_MIN_RETRY_MS ? MSG_MIN_RETRY_MS : ms) << try;
+    return ms < client->timeoutMs ? ms : client->timeoutMs;
+}
+
+int msgRequest(MsgClient *client, const unsigned char *request, int size, unsigned char *response)
+{
+    if (size > MSG_MAX_SIZE)
+    {
+        return -1;
+    }
+    unsigned char message[MAX_PAYLOAD_SIZE + 1];
+    uint16_t id = client->nextId++;
+    putHeader(message, MSG_REQUEST, id);
+    memcpy(message + MSG_HEADER_BYTES, request, size);
+
+    for (int try = 0; try < client->tries; try++)
+    {
+        int64_t sent = monotonicUs();
+        if (llwriteUnacked(message, MSG_HEADER_BYTES + size) < 0)
+        {
+            return -1;
+        }
+        unsigned char reply[MAX_PAYLOAD_SIZE + 1];
+        unsigned char address;
+        int res;
+        while ((res = llreadUnacked(reply, &address, retryTimeoutMs(client, try))) > 0)
+        {
+            if (res >= MSG_HEADER_BYTES && reply[0] == MSG_RESPONSE && getId(reply) == id)
+            {
+                if (try == 0)
+                {
+                    // Only unambiguous samples: a response to a repeated
+                    // request may answer any of its copies (Karn)
+                    sampleRoundTrip(client, monotonicUs() - sent);
+                }
+                memcpy(response, reply + MSG_HEADER_BYTES, res - MSG_HEADER_BYTES);
+                return res - MSG_HEADER_BYTES;
+            }
+            LOG_DEBUG("Stale message dropped (id %u)\n", getId(reply));
+        }
+        if (res < 0)
+        {
+            return -1;
+        }
+        LOG_WARN("Request %u unanswered (try %d/%d)\n", id, try + 1, client->tries);
+    }
+    return -2;
+}
+
+void msgServerInit(MsgServer *server)
+{
+    memset(server, 0, sizeof(*server));
+}
+
+int msgReceive(MsgServer *server, unsigned char *request, uint16_t *id)
+{
+    unsigned char message[MAX_PAYLOAD_SIZE + 1];
+    unsigned char address;
+    while (1)
+    {
+        int res = llreadUnacked(message, &address, MSG_IDLE_WAIT_MS);
+        if (res < 0)
+        {
+            return res;
+        }
+        if (res < MSG_HEADER_BYTES || message[0] != MSG_REQUEST)
+        {
+            continue;
+        }
+        if (server->hasLast && getId(message) == server->lastId)
+        {
+            // The response was lost: don't handle the request twice
+            LOG_DEBUG("Repeated request %u answered again\n", server->lastId);
+            if (llwriteUnacked(server->last, server->lastSize) < 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+        *id = getId(message);
+        memcpy(request, message + MSG_HEADER_BYTES, res - MSG_HEADER_BYTES);
+        return res - MSG_HEADER_BYTES;
+    }
+}
+
+int msgRespond(MsgServer *server, uint16_t id, const unsigned char *response, int size)
+{
+    putHeader(server->last, MSG_RESPONSE, id);
+    memcpy(server->last + MSG_HEADER_BYTES, response, size);
+    server->lastSize = MSG_HEADER_BYTES + size;
+    server->lastId = id;
+    server->hasLast = 1;
+    return llwriteUnacked(server->last, server->lastSize) < 0 ? -1 : 0;
+}
@@ -0,0 +1,67 @@
+// Weighted packet scheduler implementation
+
+#include "scheduler.h"
+
+#include <string.h>
+
+void schedulerInit(Scheduler *scheduler, int quantum)
+{
+    memset(scheduler, 0, sizeof(*scheduler));
+    scheduler->quantum = quantum;
+}
+
+int schedulerAddChannel(Scheduler *scheduler, int weight)
+{
+    if (scheduler->numChannels == SCHEDULER_MAX_CHANNELS)
+    {
+        return -1;
+    }
+    int channel = scheduler->numChannels++;
+    scheduler->channels[channel].weight = weight;
+    scheduler->channels[channel].deficit = channel == scheduler->current ? (int64_t)weight * scheduler->quantum : 0;
+    scheduler->channels[channel].active = 1;
+    return channel;
+}
+
+void schedulerSetActive(Scheduler *scheduler, int channel, int active)
+{
+    scheduler->channels[channel].active = active;
+    if (!active)
+    {
+        scheduler->channels[channel].deficit = 0; // idle channels don't save up
+    }
+}
+
+int schedulerNext(Scheduler *scheduler)
+{
+    int any = 0;
+    for (int i = 0; i < scheduler->numChannels; i++)
+    {
+        any |= scheduler->channels[i].active;
+    }
+    if (!any)
+    {
+        return -1;
+    }
+
+    // Terminates: every lap adds a quantum to the deficit of the active channels
+    while (1)
+    {
+        SchedulerChannel *channel = &scheduler->channels[scheduler->current];
+        if (channel->active && channel->deficit > 0)
+        {
+            return scheduler->current;
+        }
+        scheduler->current = (scheduler->current + 1) % scheduler->numChannels;
+        channel = &scheduler->channels[scheduler->current];
+        if (channel->active)
+        {
+            channel->deficit += (int64_t)channel->weight * scheduler->quantum;
+        }
+    }
+}
+
+void schedulerCharge(Scheduler *scheduler, int channel, int size)
+{
+    scheduler->channels[channel].deficit -= size;
+}
@@ -0,0 +1,27 @@
+// Serial port rates beyond the termios constants
+
+#include "serial_baud.h"
+
+#include <asm/termbits.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+
+int setArbitraryBaudRate(int fd, int baudRate)
+{
+    struct termios2 tio;
+    if (ioctl(fd, TCGETS2, &tio) == -1)
+    {
+        perror("TCGETS2");
+        return -1;
+    }
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = baudRate;
+    tio.c_ospeed = baudRate;
+    if (ioctl(fd, TCSETS2, &tio) == -1)
+    {
+        perror("TCSETS2");
+        return -1;
+    }
+    return 0;
+}
@@ -2,6 +2,7 @@
 // DO NOT CHANGE THIS FILE
 
 #include "serial_port.h"
+#include "serial_baud.h"
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -38,8 +39,9 @@ int openSerialPort(const char *serialPort, int baudRate)
         return -1;
     }
 
-    // Convert baud rate to appropriate flag
+    // Convert baud rate to appropriate flag; other rates are set afterwards
     tcflag_t br;
+    int arbitrary = 0;
     switch (baudRate)
     {
     case 1200:
@@ -69,9 +71,32 @@ int openSerialPort(const char *serialPort, int baudRate)
     case 115200:
         br = B115200;
         break;
+    case 230400:
+        br = B230400;
+        break;
+    case 460800:
+        br = B460800;
+        break;
+    case 921600:
+        br = B921600;
+        break;
+    case 1000000:
+        br = B1000000;
+        break;
+    case 2000000:
+        br = B2000000;
+        break;
+    case 4000000:
+        br = B4000000;
+        break;
     default:
-        fprintf(stderr, "Unsupported baud rate (must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200)\n");
-        return -1;
+        if (baudRate <= 0 || baudRate > MAX_BAUD_RATE)
+        {
+            fprintf(stderr, "Unsupported baud rate (must be up to %d)\n", MAX_BAUD_RATE);
+            return -1;
+        }
+        br = B38400;
+        arbitrary = 1;
     }
 
     // New port settings
@@ -96,6 +121,11 @@ int openSerialPort(const char *serialPort, int baudRate)
         close(fd);
         return -1;
     }
+    if (arbitrary && setArbitraryBaudRate(fd, baudRate) == -1)
+    {
+        close(fd);
+        return -1;
+    }
 
     // Clear O_NONBLOCK flag to ensure blocking reads
     oflags ^= O_NONBLOCK;
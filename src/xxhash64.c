@@ -0,0 +1,147 @@
+// XXH64 streaming hash implementation (see the xxHash specification)
+
+#include "xxhash64.h"
+
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// Little endian loads, independent of the host byte order
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t mergeRound64(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void consumeStripe(Xxh64State *state, const unsigned char *p)
+{
+    state->v[0] = round64(state->v[0], read64(p));
+    state->v[1] = round64(state->v[1], read64(p + 8));
+    state->v[2] = round64(state->v[2], read64(p + 16));
+    state->v[3] = round64(state->v[3], read64(p + 24));
+}
+
+void xxh64Reset(Xxh64State *state, uint64_t seed)
+{
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->v[0] = seed + PRIME64_1 + PRIME64_2;
+    state->v[1] = seed + PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - PRIME64_1;
+}
+
+void xxh64Update(Xxh64State *state, const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + size;
+    state->totalLength += size;
+
+    // Not enough for a full stripe yet: just keep it
+    if (state->memSize + size < 32)
+    {
+        memcpy(state->mem + state->memSize, p, size);
+        state->memSize += size;
+        return;
+    }
+
+    // Complete the pending stripe first
+    if (state->memSize > 0)
+    {
+        unsigned int fill = 32 - state->memSize;
+        memcpy(state->mem + state->memSize, p, fill);
+        consumeStripe(state, state->mem);
+        p += fill;
+        state->memSize = 0;
+    }
+
+    while (p + 32 <= end)
+    {
+        consumeStripe(state, p);
+        p += 32;
+    }
+
+    if (p < end)
+    {
+        state->memSize = end - p;
+        memcpy(state->mem, p, state->memSize);
+    }
+}
+
+uint64_t xxh64Digest(const Xxh64State *state)
+{
+    uint64_t h;
+    if (state->totalLength >= 32)
+    {
+        h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) +
+            rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        h = mergeRound64(h, state->v[0]);
+        h = mergeRound64(h, state->v[1]);
+        h = mergeRound64(h, state->v[2]);
+        h = mergeRound64(h, state->v[3]);
+    }
+    else
+    {
+        h = state->seed + PRIME64_5;
+    }
+    h += state->totalLength;
+
+    const unsigned char *p = state->mem;
+    const unsigned char *end = p + state->memSize;
+    while (p + 8 <= end)
+    {
+        h ^= round64(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end)
+    {
+        h ^= (*p) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}